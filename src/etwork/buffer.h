@@ -8,9 +8,35 @@ namespace etwork {
 //! \addtogroup Support Support capabilities
 //! @{
 
+  //! A BufferSegment is a piece of queued data, as handed out by 
+  //! Buffer::get_segments().
+  struct BufferSegment {
+    //! Where the data is.
+    void const * data;
+    //! How many bytes there are.
+    size_t size;
+  };
+
+  //! An IBufferPool lends a Buffer the memory it keeps its queue in, 
+  //! so that buffers that are empty don't hold on to any. See 
+  //! Buffer::set_pool().
+  class IBufferPool {
+    public:
+      //! Lend out a block of memory.
+      //! \param size The size of the block, in bytes.
+      //! \return The block, or NULL if it can't be had right now.
+      virtual void * get( size_t size ) = 0;
+      //! Take back a block from get().
+      //! \param mem The block.
+      //! \param size Its size, as passed to get().
+      virtual void put( void * mem, size_t size ) = 0;
+    protected:
+      ~IBufferPool() {}
+  };
+
   //! A Buffer is a data structure that can marshal data to/from the wire 
-  //! protocol of etwork (which is a network-byte-order short followed by 
-  //! that much data; repeat). This class is used internally by the 
+  //! protocol of etwork (which is a network-byte-order short, or with 
+  //! EF_varint a varint, followed by that much data; repeat). This class is used internally by the 
   //! Etwork implementation, and is not necessary for you to use -- but 
   //! you can use it if you wish to.
   //!
@@ -18,8 +44,11 @@ namespace etwork {
   //!
   //! - Put data with put_message and get data with get_message
   //! - Put data with put_message and get data with get_data
+  //! - Put data with put_message and get data with get_segments and consume
   //! - Put data with put_data and get data with get_message
   //!
+  //! Wherever put_message is used, reserve and commit can be used too.
+  //!
   //! Any other combination of usage (including changing usage function 
   //! in the middle of operation) is unsupported and results in unexpected
   //! behavior.
@@ -40,12 +69,30 @@ namespace etwork {
       //! \param maxNumMessages is the total number of messages you want to 
       //! be able to queue (regardless of their total size, which is 
       //! separately capped).
-      Buffer( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages );
+      //! \param framing is the EtworkFraming of the wire protocol.
+      Buffer( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages, int framing = EF_short );
+      //! Create a buffer with the same limits, framing and pool as shape, 
+      //! sharing them instead of keeping a copy. With a pool, such a 
+      //! buffer takes no memory of its own while it is empty.
+      //! \param shape The buffer to share with, which must outlive this one.
+      explicit Buffer( Buffer const * shape );
       //! Deleting a buffer disposes all queued data.
       ~Buffer();
+      //! set_pool() makes the buffer borrow its storage from pool when 
+      //! something is put in it, and give it back whenever it is empty 
+      //! again. Without a pool, the buffer allocates its storage the 
+      //! first time, and keeps it. Call it before putting anything in. 
+      //! Buffers made from this one, or that it was made from, share it.
+      //! When the pool has no storage to lend, the buffer takes nothing 
+      //! in: put_message() fails, and put_data() drops messages.
+      //! \param pool The pool, which must outlive the buffer.
+      void set_pool( IBufferPool * pool );
+      //! \return Whether the buffer has its storage right now.
+      bool has_storage();
       //! put_data() puts formatted data into the queue. If the data describes 
       //! a format that exceeds the buffer capabilities of the buffer, the 
-      //! data will be dropped on the ground (silently). -1 indicates failure.
+      //! data will be dropped on the ground (silently). -1 indicates failure, 
+      //! such as messages dropped for want of storage from the pool.
       //! Returns the number of bytes actually taken from the buffer.
       //! \param data a pointer to the data to add to the buffer.
       //! \param size The number of bytes to add.
@@ -56,6 +103,19 @@ namespace etwork {
       //! \param size The number of bytes to add.
       //! \return -1 on error.
       int put_raw( void const * data, size_t size );
+      //! input_space() tells where the next bytes of formatted data can be 
+      //! written directly (say, by recv()) instead of going through 
+      //! put_data(), and how many of them. Follow it with commit_input() 
+      //! for the bytes actually written there.
+      //! \param oData Receives a pointer to the space.
+      //! \return The number of bytes that fit, or 0 if the next bytes have 
+      //! to go through put_data().
+      size_t input_space( void ** oData );
+      //! commit_input() takes in size bytes written to the space from 
+      //! input_space(), as put_data() would have.
+      //! \param size The number of bytes written; no more than the space.
+      //! \return The number of bytes taken, or -1 on error.
+      int commit_input( size_t size );
       //! put_message() puts a message into the queue; adding formatting to 
       //! make sure that only entire messages are sent or received. If the 
       //! size of the message is bigger than capacity, it will fail, returning 
@@ -63,6 +123,18 @@ namespace etwork {
       //! \param msg a pointer to the message data to add.
       //! \param size The size of the message in bytes.
       int put_message( void const * msg, size_t size );
+      //! reserve() hands out room for the next message, so that it can 
+      //! be built where it will be queued instead of being copied in by 
+      //! put_message(). Follow it with commit(). Nothing else may be put 
+      //! into the buffer in between; a second reserve() drops the first.
+      //! \param maxSize The most bytes the message may turn out to be.
+      //! \return Where to build the message, or NULL if a message of 
+      //! maxSize would not fit.
+      void * reserve( size_t maxSize );
+      //! commit() queues the message built in the room from reserve().
+      //! \param size The size of the message; no more than was reserved.
+      //! \return The size of the message, or -1 if nothing was reserved.
+      int commit( size_t size );
       //! get_data() reads data from the queue, including the formatting that 
       //! ensures packets are only read in their entirety. mSize must be at 
       //! least 3 when calling this function. The number of bytes read are 
@@ -71,6 +143,32 @@ namespace etwork {
       //! \param mSize must be at least 3, and indicates how many bytes to read (at most).
       //! \return The number of bytes read, or -1.
       int get_data( void * oData, size_t mSize );
+      //! get_segments() describes the queued data, including formatting, 
+      //! as up to maxSegs pieces of memory in order, without copying it 
+      //! out. The pieces stay valid until the next call that changes the 
+      //! buffer. Use consume() to remove data once it has been used, 
+      //! such as when it has been sent with writev().
+      //! \param oSegs The segments are returned here.
+      //! \param maxSegs The most segments to return.
+      //! \return The number of segments returned; 0 if the queue is empty.
+      int get_segments( BufferSegment * oSegs, int maxSegs );
+      //! consume() removes data from the front of what get_segments() 
+      //! describes. Messages are freed once all of them is consumed.
+      //! Don't use it while anything is held.
+      //! \param size The number of bytes to remove; no more than is queued.
+      void consume( size_t size );
+      //! hold() is consume() for data that must stay where it is for now 
+      //! (such as while the kernel sends it with MSG_ZEROCOPY): it is no 
+      //! longer described by get_segments(), but only freed by release().
+      //! \param size The number of bytes to hold, from the front of what 
+      //! get_segments() describes.
+      void hold( size_t size );
+      //! release() frees held data, oldest first.
+      //! \param size The number of bytes to release; no more than are held.
+      void release( size_t size );
+      //! \return The number of bytes, formatting included, that are queued 
+      //! and not held (that is, what get_segments() would describe).
+      size_t unsent();
       //! get_message() gets the next formatted message from the buffer. 
       //! Returns -1 if mSize is smaller than the message size, or if there 
       //! are no messages to get.
@@ -78,6 +176,17 @@ namespace etwork {
       //! \param mSize The maximum size message that can be returned.
       //! \return -1 on error.
       int get_message( void * oData, size_t mSize );
+      //! peek_message() describes the next formatted message where it is 
+      //! in the buffer, without copying it out: as one segment, or as two 
+      //! when it wraps around the end of the buffer's storage.
+      //! \param oSegs Receives the segments; must have room for two. The 
+      //! second has size 0 when the message is in one piece.
+      //! \return The size of the message, or -1 if there are no messages.
+      int peek_message( BufferSegment * oSegs );
+      //! skip_message() removes the next formatted message, as 
+      //! get_message() does, but without copying it anywhere.
+      //! \return The size of the message, or -1 if there are no messages.
+      int skip_message();
       //! \return the amount of data currently in the buffer 
       //! (discounting any formatting).
       size_t space_used();
@@ -100,6 +100,38 @@
   sock->write( "hello, world!", 13 );
 \endcode
 
+    <div class="text">
+      To look at a message without copying it out of the socket, use peek() 
+      instead of read(), and consume() when you're done with it. A message 
+      that wraps around the end of the socket's receive queue comes in two 
+      pieces.
+    </div>
+
+\code
+  void const * first, * rest;
+  size_t firstSize;
+  while( (r = sock->peek( &first, &firstSize, &rest )) >= 0 ) {
+    parse_message( first, firstSize, rest, r - firstSize, sock->data_ );
+    sock->consume();
+  }
+\endcode
+
+    <div class="text">
+      Likewise, to build a message right in the socket's send queue instead 
+      of copying it there with write(), reserve() room for it, and commit() 
+      it once you know how big it turned out.
+    </div>
+
+\code
+  void * room = sock->reserve( MAX_SNAPSHOT_SIZE );
+  if( room ) {
+    Block b( room, MAX_SNAPSHOT_SIZE );
+    if( IMarshalManager::instance()->marshal( snapshot, b ) ) {
+      sock->commit( b.pos() );
+    }
+  }
+\endcode
+
     <div class="text">
       To connect to another machine that's currently listening for connections, 
       use the connect() function on the manager. Note that this function may be 
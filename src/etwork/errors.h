@@ -6,9 +6,11 @@
 #include "etwork/etwork.h"
 
 class IErrorNotify;
+#if defined( WIN32 )
 enum ErrorSeverity;
 enum ErrorArea;
 enum ErrorOption;
+#endif
 
 //! \addtogroup API Core API
 //! @{
@@ -78,6 +80,9 @@ class ETWORK_API EtworkError {
     char const * c_str() const;
     //! Set the error text explicitly.
     void setText( char const * text );
+    //! Return TRUE if the error has text already (set with setText(), or 
+    //! made by an earlier c_str()), so c_str() won't have to make it.
+    bool hasText() const;
   private:
     int error_;
     mutable char * text_;
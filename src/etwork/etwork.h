@@ -42,6 +42,7 @@
  #include <windows.h>
 #else
  #include <sys/socket.h>
+ #include <netinet/in.h>
 #endif
 
 #include <stdlib.h>
@@ -50,6 +51,23 @@
 class ISocketManager;
 class ISocket;
 class IErrorNotify;
+class IShardHandler;
+class IShardedServer;
+
+//! EtworkEngine selects how a socket manager waits for, and performs, 
+//! socket I/O. Use it for EtworkSettings::engine .
+enum EtworkEngine {
+  EE_default = 0,           //!< select() on WIN32, epoll on Linux.
+  EE_uring = 1,             //!< io_uring on Linux, for reliable sockets. Others use EE_default.
+};
+
+//! EtworkFraming selects how the size of each message is sent ahead of 
+//! it on reliable sockets. Both ends must use the same framing. Use it 
+//! for EtworkSettings::framing .
+enum EtworkFraming {
+  EF_short = 0,             //!< Two bytes, network byte order. Messages up to 64 kB.
+  EF_varint = 1,            //!< One byte below 128, up to four bytes. Messages up to 256 MB.
+};
 
 //! EtworkSettings represents the various global parameter with which 
 //! you can configure a specific Etwork networking subsystem instance.
@@ -68,6 +86,19 @@ struct EtworkSettings {
   double keepalive;         //!< Send keepalives this often. If 0, send no keepalibes.
   double timeout;           //!< Time out a connection when it's been idle for this long. If 0, make no timeouts.
   IErrorNotify * notify;    //!< Set to a notifier interface to get notified about errors.
+  int engine;               //!< The EtworkEngine to use. If 0, use the platform default.
+  bool offload;             //!< Set to TRUE to have the kernel split and coalesce UDP datagrams (UDP_SEGMENT/UDP_GRO on Linux).
+  bool reuseport;           //!< Set to TRUE to let more than one instance listen to the same port (SO_REUSEPORT, where available).
+  bool threadedWrites;      //!< Set to TRUE to allow ISocket::write() from any thread. Messages are sent on the next poll().
+  bool asyncConnect;        //!< Set to TRUE to have ISocketManager::connect() return without waiting for TCP to connect, or for the host name to resolve.
+  char const * nameserver;  //!< "address[:port]" of the DNS server connect() asks about host names. If NULL, use the system's.
+  bool zerocopy;            //!< Set to TRUE to send big TCP writes with MSG_ZEROCOPY (Linux, default engine), which saves copying them into the kernel.
+  size_t readBudget;        //!< Most bytes to read from one TCP socket per pass through poll(); it reads until the socket has no more, or this much. If 0, defaults to queueSize.
+  int framing;              //!< The EtworkFraming of reliable sockets. With EF_varint, queueSize and maxMessageSize may go past 64 kB.
+  size_t memoryBudget;      //!< Most bytes of queue memory all sockets of the manager may hold at once. Sockets only hold it while their queues aren't empty. If 0, no limit.
+  bool histograms;          //!< Set to TRUE to time the phases of poll(); see ISocketManager::histograms().
+  size_t traceSize;         //!< Records in the ring of recent network events; see ISocketManager::dump_trace(). If 0, defaults to 8192. Rounded up to a power of two.
+  bool asyncErrors;         //!< Set to TRUE to queue up the errors of the manager and its sockets, and only format and report them in ISocketManager::drain_errors().
 
   //! By default, the settings will use game-size buffer and queue sizes, 
   //! with reliable transport, and debugging turned off if you build in 
@@ -83,6 +114,116 @@ struct EtworkSettings {
   }
 };
 
+//! EtworkSocketStats counts what has gone through one ISocket since it 
+//! was created. See ISocket::stats().
+struct EtworkSocketStats {
+  unsigned long long bytesIn;     //!< Bytes received, framing included.
+  unsigned long long bytesOut;    //!< Bytes sent, framing included.
+  unsigned int messagesIn;        //!< Messages received into the input queue.
+  unsigned int messagesOut;       //!< Messages written into the output queue.
+  unsigned int drops;             //!< Times received data was dropped because the input queue was full (EO_buffer_full).
+  unsigned int writesRefused;     //!< Times write() or reserve() found no room in the output queue. Not counted with threadedWrites.
+  unsigned int partialSends;      //!< Sends of which the kernel took less than it was offered.
+  unsigned int queueIn;           //!< Bytes of messages waiting in the input queue now.
+  unsigned int queueOut;          //!< Bytes of messages waiting in the output queue now.
+  unsigned int queueInHigh;       //!< The most queueIn has been.
+  unsigned int queueOutHigh;      //!< The most queueOut has been.
+};
+
+//! EtworkStats counts what has gone through all the sockets of an 
+//! ISocketManager, and the manager itself, since it was created. 
+//! See ISocketManager::stats().
+struct EtworkStats {
+  unsigned long long polls;         //!< Calls to ISocketManager::poll().
+  unsigned long long bytesIn;       //!< As EtworkSocketStats, for all sockets.
+  unsigned long long bytesOut;
+  unsigned long long messagesIn;
+  unsigned long long messagesOut;
+  unsigned long long drops;
+  unsigned long long writesRefused;
+  unsigned long long partialSends;
+  size_t queueMemory;               //!< Bytes of queue memory the sockets hold now.
+  size_t queueMemoryHigh;           //!< The most queueMemory has been.
+};
+
+//! EtworkPhase names the parts of ISocketManager::poll() that it keeps 
+//! an EtworkHistogram of. Each time through a phase counts once, and 
+//! the waiting and servicing phases may go around more than once in 
+//! one call to poll().
+enum EtworkPhase {
+  EP_timeouts = 0,          //!< Timeouts and keepalives, posted writes and host names, before waiting.
+  EP_wait = 1,              //!< Waiting in select(), epoll_wait() or io_uring_enter().
+  EP_read = 2,              //!< Receiving, and queuing what was received. With EE_uring, all completions.
+  EP_write = 3,             //!< Sending what was queued. With EE_uring, handing it to the kernel to be sent.
+  EP_except = 4,            //!< Socket errors and MSG_ZEROCOPY completions.
+  EP_notify = 5,            //!< Calling INotify::onNotify() on the way out.
+  EP_poll = 6,              //!< All of poll().
+  EP_overrun = 7,           //!< How much longer poll() took than asked, or 0.
+  EP_count = 8
+};
+
+//! The number of buckets in an EtworkHistogram.
+#define ETWORK_HISTOGRAM_BUCKETS 240
+
+//! EtworkHistogram counts how long something took. Below 8 us, each 
+//! microsecond has a bucket; above, each doubling is split in eight, 
+//! so a bucket is never wider than an eighth of the times in it. 
+//! The last bucket starts past an hour, and holds anything longer.
+//! EtworkHistogramBucket() and EtworkHistogramPercentile() read it.
+struct EtworkHistogram {
+  unsigned int counts[ETWORK_HISTOGRAM_BUCKETS];  //!< How many times fell in each bucket.
+  unsigned long long count; //!< How many times were counted.
+  double total;             //!< Their sum, in seconds.
+  double max;               //!< The longest, in seconds.
+};
+
+//! @return The shortest time, in seconds, that goes in the given 
+//! bucket of an EtworkHistogram.
+ETWORK_API double EtworkHistogramBucket( int bucket );
+
+//! @param hist The histogram to look at.
+//! @param fraction How many of the times to look at, such as 0.99.
+//! @return The time, in seconds, that this fraction of the counted 
+//! times were no longer than, to within the width of its bucket. 
+//! 0 if nothing was counted.
+ETWORK_API double EtworkHistogramPercentile( EtworkHistogram const * hist, double fraction );
+
+//! EtworkTraceEvent tells what an EtworkTraceRecord is about.
+enum EtworkTraceEvent {
+  ET_accept = 1,            //!< A connection came in.
+  ET_connect = 2,           //!< connect() made a socket, value 1 if it's still connecting. Then 0 once connected.
+  ET_recv = 3,              //!< value bytes were received.
+  ET_send = 4,              //!< value bytes were sent.
+  ET_partial = 5,           //!< The kernel took less of a send than offered; value bytes are left.
+  ET_drop = 6,              //!< Received data was dropped because the input queue was full (EO_buffer_full).
+  ET_timeout = 7,           //!< The socket timed out.
+  ET_keepalive = 8,         //!< A keepalive was queued.
+  ET_close = 9,             //!< The socket was closed.
+};
+
+//! EtworkTraceRecord is one network event in the ring of recent events 
+//! that each ISocketManager keeps. Writing one costs a clock reading 
+//! and 16 bytes of stores.
+struct EtworkTraceRecord {
+  unsigned int timeLow;     //!< Microseconds since the manager was created (low 32 bits).
+  unsigned short timeHigh;  //!< (high 16 bits)
+  unsigned short event;     //!< The EtworkTraceEvent.
+  unsigned int socket;      //!< The socket's handle (for UDP, its id within the manager).
+  unsigned int value;       //!< Depends on the event.
+};
+
+//! EtworkTraceHeader starts a file written by ISocketManager::dump_trace(). 
+//! It's followed by \c count EtworkTraceRecords, oldest first. All of it 
+//! is in the byte order of the machine that wrote it. The tracedump 
+//! tool turns such a file into text.
+struct EtworkTraceHeader {
+  char magic[8];            //!< "ETWTRACE"
+  unsigned int version;     //!< 1
+  unsigned int recordSize;  //!< sizeof( EtworkTraceRecord )
+  unsigned long long count; //!< Records in the file.
+  unsigned long long total; //!< Records ever written; the oldest (total - count) are gone.
+};
+
 //! CreateEtwork will open a socket, and bind it to the given port and 
 //! listen to it if you set \c accepting to true in the \ref EtworkSettings .
 //! If the settings are not \c reliable , a socket will be created even if 
@@ -164,6 +305,37 @@ class ISocketManager {
     //! @note This call may use blocking name resolution 
     //! if the address parameter isn't a numeric-form IP address.
     virtual int connect( char const * address, unsigned short port, ISocket ** outConnected ) = 0;
+    //! Get the counters of this networking subsystem. They are plain 
+    //! counters, kept by the thread that calls poll(), so call this 
+    //! from that thread, too.
+    //! @param out Receives the counters.
+    virtual void stats( EtworkStats * out ) = 0;
+    //! Get the histograms of how long the phases of poll() take, if the 
+    //! networking subsystem was created with \c histograms . Like 
+    //! stats(), call this from the thread that calls poll().
+    //! @param out Receives the histograms, indexed by EtworkPhase.
+    //! @param maxOut The size (in histograms) of out.
+    //! @param reset If true, start all histograms over, such as at the 
+    //! end of each reporting interval.
+    //! @return The number of histograms put into out (at most EP_count), 
+    //! or -1 if there are none to get.
+    virtual int histograms( EtworkHistogram * out, int maxOut, bool reset ) = 0;
+    //! Write the ring of recent network events to a file, such as when 
+    //! poll() has taken much too long. It's an EtworkTraceHeader and 
+    //! the EtworkTraceRecords. Call this from the thread that calls poll().
+    //! @param path The name of the file to write.
+    //! @return False if the file could not be written.
+    virtual bool dump_trace( char const * path ) = 0;
+    //! Report the errors that have been queued up since last time, if the 
+    //! networking subsystem was created with \c asyncErrors . The same 
+    //! error from the same socket many times in a row is reported once, 
+    //! with the count in its text. If errors come faster than they are 
+    //! drained, the newest are dropped, and that is reported at the end. 
+    //! Call this from the thread that calls poll(), whenever it suits 
+    //! (such as between frames). dispose() reports what's left.
+    //! @param maxErrors The most errors to report; 0 for all of them.
+    //! @return The number of errors reported, or -1 if errors are not queued.
+    virtual int drain_errors( int maxErrors ) = 0;
     //! When you're all done with all sockets, call dispose() to close the 
     //! listening socket (if server), and deallocate all memory used by this 
     //! networking subsystem. It is illegal to call dispose() when there are 
@@ -196,6 +368,19 @@ class ISocket {
     //! generated by the networking layer, and may be queued by 
     //! you as well.
     virtual int read( void * buffer, size_t maxSize ) = 0;
+    //! Look at the next message where it is, without copying it out. 
+    //! A message that wraps around the end of the socket's receive 
+    //! queue comes in two pieces; then \c *rest points to the last 
+    //! (return value - \c *firstSize) bytes of it.
+    //! @param first Receives a pointer to the message (or its first piece).
+    //! @param firstSize Receives the size of that piece.
+    //! @param rest Receives a pointer to the rest of the message, or NULL 
+    //! if it is all in one piece.
+    //! @return The size of the message, or -1 if there are no messages 
+    //! pending. The message stays put until you consume() or read() it.
+    virtual int peek( void const ** first, size_t * firstSize, void const ** rest ) = 0;
+    //! Let go of the message that peek() returns, moving on to the next.
+    virtual void consume() = 0;
     //! Queue a message to the other end of the connection. For 
     //! each call to write(), read() will return the same number 
     //! of bytes -- i e, the socket is packet-semantic, not 
@@ -208,11 +393,44 @@ class ISocket {
     //! may make it out of order, or may make it in more than one 
     //! copy, if you created the ISocketManager without using 
     //! the reliable flag.
+    //! @note If the ISocketManager was created with \c threadedWrites , 
+    //! write() may be called from any thread, also while another thread 
+    //! is in ISocketManager::poll(). The message is queued without 
+    //! locking, and moved to the socket on the next poll(). Messages 
+    //! from one thread arrive in the order they were written. All 
+    //! writing threads must be done with the socket before it is 
+    //! disposed.
     virtual int write( void const * buffer, size_t size ) = 0;
+    //! Get room to build a message in, right where write() would 
+    //! have copied it, such as for a Block to marshal into. Then 
+    //! commit() the message. Don't write() or reserve() again 
+    //! before you do; a second reserve() drops the first.
+    //! @param maxSize The most bytes the message may turn out to be.
+    //! @return Where to build the message, or NULL if there is no 
+    //! queuing space for maxSize bytes. Always NULL if the 
+    //! ISocketManager was created with \c threadedWrites .
+    virtual void * reserve( size_t maxSize ) = 0;
+    //! Queue the message built in the room from reserve().
+    //! @param size The size of the message; no more than was reserved.
+    //! @return The size of the message, or -1 if nothing was reserved.
+    virtual int commit( size_t size ) = 0;
     //! Check whether the other end has closed the connection.
     //! @return True if the other end has closed the connection 
     //! (or, in the case of UDP, has timed out).
     virtual bool closed() = 0;
+    //! Check whether the socket is still connecting. With \c asyncConnect , 
+    //! ISocketManager::connect() returns sockets that are still connecting. 
+    //! Messages written before the connection is made are sent once it is. 
+    //! When the connection is made, or fails (which closes the socket), 
+    //! the socket is returned from ISocketManager::poll() as active (or 
+    //! its INotify is called).
+    //! @return True if the connection is not yet made.
+    virtual bool connecting() = 0;
+    //! Get the counters of this socket, and how full its queues are. 
+    //! Like ISocketManager::stats(), call this from the thread that 
+    //! calls poll().
+    //! @param out Receives the counters.
+    virtual void stats( EtworkSocketStats * out ) = 0;
     //! Let go of the socket. You must dispose all sockets before 
     //! you dispose the network subsystem itself.
     virtual void dispose() = 0;
@@ -228,6 +446,59 @@ class ISocket {
     ~ISocket() {}
 };
 
+//! CreateShardedEtwork creates a server made from \c numShards socket 
+//! managers that all listen to the same port (using \c reuseport ), so 
+//! the kernel spreads incoming connections (or, for UDP, peers) across 
+//! them. Each shard gets a thread of its own, pinned to a CPU where the 
+//! platform allows, which calls \c handler->onShard() with the shard's 
+//! ISocketManager. Because each manager is only ever used on its own 
+//! thread, no locking is needed, and accept, read and write work scales 
+//! with the number of shards.
+//!
+//! @param settings Options for each shard; \c accepting must be true, 
+//! and \c port must be set.
+//! @param numShards The number of managers and threads to create. If 0, 
+//! create one per CPU.
+//! @param handler Called once per shard, on that shard's thread.
+//!
+//! @return The sharded server, or NULL if any shard could not be created.
+//!
+//! @note Where the platform has no SO_REUSEPORT (WIN32), only one shard 
+//! is created.
+ETWORK_API IShardedServer * CreateShardedEtwork( EtworkSettings * settings, int numShards, IShardHandler * handler );
+
+//! IShardHandler is implemented by you, to run the shards of a server 
+//! created with CreateShardedEtwork().
+class IShardHandler {
+  public:
+    //! onShard() is called on the shard's own thread. Run the poll() and 
+    //! accept() loop for the shard here, and return when the shard should 
+    //! stop. Dispose all sockets of the shard before returning; the 
+    //! manager itself is disposed by IShardedServer::dispose().
+    //! @param index The shard number, from 0 to count()-1.
+    //! @param mgr The socket manager of the shard.
+    virtual void onShard( int index, ISocketManager * mgr ) = 0;
+};
+
+//! IShardedServer owns the socket managers and threads of a server 
+//! created with CreateShardedEtwork().
+class IShardedServer {
+  public:
+    //! @return The number of shards.
+    virtual int count() = 0;
+    //! @return The socket manager of shard \c index . Only the thread 
+    //! running that shard may use it.
+    virtual ISocketManager * shard( int index ) = 0;
+    //! Wait for all shard threads to return from IShardHandler::onShard().
+    virtual void join() = 0;
+    //! Wait for the shard threads, then dispose all socket managers and 
+    //! the server itself.
+    virtual void dispose() = 0;
+
+  protected:
+    ~IShardedServer() {}
+};
+
 //! @}
 
 //! \addtogroup Support Support capabilities
@@ -235,15 +506,15 @@ class ISocket {
 
 //! \c operator==() and \c operator<() allow you to put \c sockaddr_in in a \c map<> or \c set<> .
 inline bool operator==( sockaddr_in const & a, sockaddr_in const & b ) {
-  return a.sin_family == b.sin_family && a.sin_addr.S_un.S_addr == b.sin_addr.S_un.S_addr &&
+  return a.sin_family == b.sin_family && a.sin_addr.s_addr == b.sin_addr.s_addr &&
       a.sin_port == b.sin_port;
 }
 //! \c operator==() and \c operator<() allow you to put \c sockaddr_in in a \c map<> or \c set<> .
 inline bool operator<( sockaddr_in const & a, sockaddr_in const & b ) {
   return (a.sin_family < b.sin_family) ||
       ((a.sin_family == b.sin_family) &&
-        ((a.sin_addr.S_un.S_addr < b.sin_addr.S_un.S_addr) || 
-          ((a.sin_addr.S_un.S_addr == b.sin_addr.S_un.S_addr) &&
+        ((a.sin_addr.s_addr < b.sin_addr.s_addr) || 
+          ((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
             (a.sin_port < b.sin_port))));
 }
 
@@ -49,6 +49,55 @@ namespace etwork {
 //! @}
 }
 
+#elif defined( __linux__ )
+
+#include <pthread.h>
+
+namespace etwork {
+//! \addtogroup Support Support capabilities
+//! @{
+
+  //! A Lock is a mutex (mutual exclusion within a 
+  //! single process). It can only be locked and 
+  //! unlocked through the Locker class (to be exception 
+  //! safe).
+  class Lock {
+    public:
+      //! Creating a Lock will create the underlying system lock.
+      Lock() {
+        pthread_mutex_init( &lock_, 0 );
+      }
+      //! Destroying a Lock releases the underlying system lock. 
+      //! Nobody may be waiting on it at that point.
+      ~Lock() {
+        pthread_mutex_destroy( &lock_ );
+      }
+    private:
+      friend class Locker;
+      pthread_mutex_t lock_;
+  };
+  //! Class Locker is intended to be created on the stack, straddling 
+  //! some critical section. Using a locker class makes the mutual 
+  //! exclusion exception safe.
+  class Locker {
+    public:
+      //! Acquire the given Lock. This constructor will not return 
+      //! until the lock is acquired by the current thread.
+      Locker( Lock & l ) : l_( l ) {
+        pthread_mutex_lock( &l_.lock_ );
+      }
+      //! Release the lock, making it available for another thread 
+      //! to acquire.
+      ~Locker() {
+        pthread_mutex_unlock( &l_.lock_ );
+      }
+    private:
+      Lock & l_;
+  };
+
+//! @}
+}
+
 #else
 #error "implement me!"
 #endif
@@ -41,6 +41,40 @@ namespace etwork {
 
 }
 
+#elif defined( __linux__ )
+
+#include <time.h>
+
+namespace etwork {
+//! \addtogroup Support Support capabilities
+//! @{
+
+  //! A Timer is really just a clock. It measures time passed 
+  //! since the timer was created, and returns it in double-precision
+  //! seconds.
+  class Timer {
+    public:
+      //! Initialize the timer; measure current baseline time.
+      Timer() {
+        ::clock_gettime( CLOCK_MONOTONIC, &baseTime_ );
+      }
+      //! Return the elapsed time since construction in seconds.
+      //! Returns elapsed time as a double-precision floating point number.
+      double seconds() const throw() {
+        timespec cur;
+        ::clock_gettime( CLOCK_MONOTONIC, &cur );
+        return (cur.tv_sec - baseTime_.tv_sec) + 
+            (cur.tv_nsec - baseTime_.tv_nsec) * 1e-9;
+      }
+    private:
+      //! \internal baseline timer reading
+      timespec baseTime_;
+  };
+
+//! @}
+
+}
+
 #else
 #error "implement me!"
 #endif
@@ -2,7 +2,6 @@
 #include "etwork/buffer.h"
 
 #include <string.h>
-#include <deque>
 #include <assert.h>
 
 using namespace etwork;
@@ -28,279 +27,868 @@ using namespace etwork;
 //! Note that any higher-level protocol might still be confused by the 
 //! packet stream returned by such a sync protocol, which makes it 
 //! even less useful for real-life usage.
+//!
+//! With EF_varint framing, the length is instead sent seven bits at a 
+//! time, least significant first, with the top bit set in every byte 
+//! but the last; at most four bytes, so messages can be up to 256 MB. 
+//! Messages shorter than 128 bytes take one byte of framing. A length 
+//! may be padded with extra 0x80 bytes, as reserve() does.
 namespace etwork {
+  //  The limits and pool of a Buffer, which Buffers made from it share.
+  struct Shape {
+    size_t maxMsgSize_;
+    size_t queueSize_;
+    size_t maxNumMessages_;
+    int framing_;
+    IBufferPool * pool_;
+  };
+
+  //  The queue is one circular arena per Buffer, holding the messages 
+  //  just as they go on the wire: a header, then the data. 
+  //  The limits on message size, count and total data also bound how 
+  //  much of the arena can be in use, so it never has to grow, and it 
+  //  isn't allocated until something is put in it.
+  //
+  //  With a pool, an empty Buffer doesn't keep its Impl either; then 
+  //  its pImpl is the Shape pointer, tagged with IDLE (and OWNED, if 
+  //  the Shape goes away with the Buffer).
   class Impl {
     public:
-      struct Message {
-        unsigned short offset_;
-        unsigned short size_;
-      };
-      Impl( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages );
+      enum { NONE = -1, VARINT_MAX = 4 };
+      enum { IDLE = 1, OWNED = 2 };
+      Impl( Shape * shape, bool ownsShape );
       ~Impl();
 
-      int Impl::put_data( void const * data, size_t size );
-      int Impl::put_message( void const * msg, size_t size );
-      int Impl::get_data( void * oData, size_t mSize );
-      int Impl::get_message( void * oData, size_t mSize );
+      static bool idle( void * p ) { return ((size_t)p & IDLE) != 0; }
+      static Shape * shape_of( void * p );
+      static Impl * live( void * & p );
+      static void settle_buffer( void * & p );
+      bool can_idle();
+
+      int put_data( void const * data, size_t size );
+      size_t take_frames( unsigned char const * p, size_t size, size_t * oCount, size_t * oWritten );
+      int put_message( void const * msg, size_t size );
+      void * reserve( size_t maxSize );
+      int commit( size_t size );
+      size_t input_space( void ** oData );
+      int commit_input( size_t size );
+      int get_data( void * oData, size_t mSize );
+      int get_message( void * oData, size_t mSize );
+      int peek_message( BufferSegment * oSegs );
+      int skip_message();
+      int get_segments( BufferSegment * oSegs, int maxSegs );
+      void hold( size_t size );
+      void release( size_t size );
 
       size_t space_used() { return written_; }
-      size_t message_count() { return queue_.size(); }
+      size_t message_count() { return count_; }
+      size_t unsent() { return framed_ - held_; }
 
-      Message * new_message( size_t size );
-      void delete_message( Message * msg );
+      bool fits( size_t size );
+      bool make_arena();
+      size_t wrap( size_t pos ) { return pos >= cap_ ? pos - cap_ : pos; }
+      void copy_in( size_t pos, void const * src, size_t n );
+      void copy_out( void * dst, size_t pos, size_t n );
+      size_t header_size( size_t size );
+      size_t make_header( unsigned char * hdr, size_t size, size_t len );
+      size_t size_at( size_t pos, size_t * oHdr );
+      void start_input( size_t size );
+      void finish_input();
+      void settle();
 
+      Shape * shape_;
+      bool ownsShape_;
       size_t maxMsgSize_;
       size_t queueSize_;
       size_t maxNumMessages_;
+      int framing_;
+      size_t hdrMax_;
 
-      std::deque< Message * > queue_;
-      Message * curTarget_;
-      size_t written_;
-      size_t toSkip_;
-      size_t tmpSize_;
+      unsigned char * arena_;
+      size_t cap_;
+      size_t head_;       //  where the oldest message (or what's left of it) starts
+      size_t framed_;     //  bytes of complete messages from head_, counting headers
+      size_t held_;       //  of those, what's been handed out past get_segments()
+      size_t count_;      //  complete messages, counting a partly released one
+      size_t written_;    //  the data bytes of those
+      size_t frontLeft_;  //  bytes left of a partly released message at head_
+      size_t frontSize_;  //  and its data size
+      size_t frontHdr_;   //  and its header size
+
+      //  put_data() builds a message after the complete ones
+      size_t inSize_;     //  its data size, or NONE
+      size_t inHave_;     //  how much of the data has come
+      size_t inHdr_;      //  the size of its header in the arena
+      size_t tmpSize_;    //  the header so far, when only part of it has come; or NONE
+      size_t tmpHave_;    //  how many header bytes that is
+      size_t toSkip_;     //  what's left of a message that doesn't fit
+
+      //  reserve() hands out room for a message after the complete ones
+      size_t reserved_;   //  how much, or NONE
+      size_t resHdr_;     //  the room left for its header
+      unsigned char * bounce_;  //  where it goes when the arena wraps inside it
+      bool bounced_;      //  whether the room handed out is bounce_
   };
 }
 
-//  It is possible, inside the implementation, to calculate the maximum 
-//  size of data actually needed by the queue, and allocate that up 
-//  front. Then manage the data space using a FIFO cyclic order (where 
-//  the FIFO has space equal to maxMsgSize added to queueSize). However, 
-//  right now, I'm using operator new() because it's easier to get to 
-//  work right. Optimization later!
-Impl::Impl( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages )
+Impl::Impl( Shape * shape, bool ownsShape )
 {
-  maxMsgSize_ = maxMsgSize;
-  queueSize_ = queueSize;
-  maxNumMessages_ = maxNumMessages;
+  shape_ = shape;
+  ownsShape_ = ownsShape;
+  maxMsgSize_ = shape->maxMsgSize_;
+  queueSize_ = shape->queueSize_;
+  maxNumMessages_ = shape->maxNumMessages_;
+  framing_ = shape->framing_;
+  hdrMax_ = (framing_ == EF_varint) ? VARINT_MAX : 2;
 
-  curTarget_ = 0;
+  arena_ = 0;
+  cap_ = queueSize_ + hdrMax_ * (maxNumMessages_ + 1);
+  head_ = 0;
+  framed_ = 0;
+  held_ = 0;
+  count_ = 0;
   written_ = 0;
+  frontLeft_ = 0;
+  frontSize_ = 0;
+  frontHdr_ = 0;
+  inSize_ = (size_t)NONE;
+  inHave_ = 0;
+  inHdr_ = 0;
+  tmpSize_ = (size_t)NONE;
+  tmpHave_ = 0;
   toSkip_ = 0;
-  tmpSize_ = (size_t)-1;
+  reserved_ = (size_t)NONE;
+  resHdr_ = 0;
+  bounce_ = 0;
+  bounced_ = false;
 }
 
 Impl::~Impl()
 {
-  size_t s = queue_.size();
-  for( size_t i = 0; i < s; ++i ) {
-    delete_message( queue_[i] );
+  if( shape_->pool_ ) {
+    if( arena_ ) {
+      shape_->pool_->put( arena_, cap_ );
+    }
+  }
+  else {
+    ::operator delete( arena_ );
+  }
+  ::operator delete( bounce_ );
+}
+
+//  Whether a message of this size may be added. Together, the limits 
+//  keep framed_ (plus a message on its way in) within cap_.
+bool Impl::fits( size_t size )
+{
+  if( size > maxMsgSize_ ) {
+    //OutputDebugString( "Etwork: Request for message larger than max size in Impl::fits()\n" );
+    return false;
+  }
+  if( count_ >= maxNumMessages_ ) {
+    //OutputDebugString( "Etwork: Attempting to allocate more than allowed number of messages in Impl::fits()\n" );
+    return false;
+  }
+  if( written_ + size > queueSize_ ) {
+    //OutputDebugString( "Etwork: Attempting to allocate more than allowed size of message queue in Impl::fits()\n" );
+    return false;
+  }
+  return true;
+}
+
+bool Impl::make_arena()
+{
+  if( !arena_ ) {
+    IBufferPool * pool = shape_->pool_;
+    arena_ = (unsigned char *)(pool ? pool->get( cap_ ) : ::operator new( cap_ ));
+  }
+  return arena_ != 0;
+}
+
+void Impl::copy_in( size_t pos, void const * src, size_t n )
+{
+  size_t first = cap_ - pos;
+  if( first >= n ) {
+    memcpy( &arena_[pos], src, n );
+  }
+  else {
+    memcpy( &arena_[pos], src, first );
+    memcpy( arena_, (char const *)src + first, n - first );
+  }
+}
+
+void Impl::copy_out( void * dst, size_t pos, size_t n )
+{
+  size_t first = cap_ - pos;
+  if( first >= n ) {
+    memcpy( dst, &arena_[pos], n );
+  }
+  else {
+    memcpy( dst, &arena_[pos], first );
+    memcpy( (char *)dst + first, arena_, n - first );
+  }
+}
+
+size_t Impl::header_size( size_t size )
+{
+  if( framing_ != EF_varint ) {
+    return 2;
+  }
+  size_t n = 1;
+  while( size >= 0x80 ) {
+    size >>= 7;
+    ++n;
+  }
+  return n;
+}
+
+//  Writes the header for a message of this size, padded out to at 
+//  least len bytes where the framing allows; returns its size.
+size_t Impl::make_header( unsigned char * hdr, size_t size, size_t len )
+{
+  if( framing_ != EF_varint ) {
+    hdr[0] = (unsigned char)(size >> 8);
+    hdr[1] = (unsigned char)size;
+    return 2;
+  }
+  size_t n = 0;
+  while( size >= 0x80 || n + 1 < len ) {
+    hdr[n++] = (unsigned char)((size & 0x7f) | 0x80);
+    size >>= 7;
+  }
+  hdr[n++] = (unsigned char)size;
+  return n;
+}
+
+size_t Impl::size_at( size_t pos, size_t * oHdr )
+{
+  if( framing_ != EF_varint ) {
+    *oHdr = 2;
+    return (arena_[pos] << 8) | arena_[wrap( pos + 1 )];
+  }
+  size_t size = 0;
+  size_t n = 0;
+  unsigned char b;
+  do {
+    b = arena_[wrap( pos + n )];
+    size |= (size_t)(b & 0x7f) << (7 * n);
+    ++n;
+  }
+  while( (b & 0x80) && n < VARINT_MAX );
+  *oHdr = n;
+  return size;
+}
+
+void Impl::start_input( size_t size )
+{
+  unsigned char hdr[VARINT_MAX];
+  inHdr_ = make_header( hdr, size, 0 );
+  copy_in( wrap( head_ + framed_ ), hdr, inHdr_ );
+  inSize_ = size;
+  inHave_ = 0;
+}
+
+void Impl::finish_input()
+{
+  framed_ += inHdr_ + inSize_;
+  written_ += inSize_;
+  ++count_;
+  inSize_ = (size_t)NONE;
+}
+
+//  An empty queue starts over at the beginning of the arena, so 
+//  that messages wrap around the end less often; and with a pool, 
+//  it gives the arena back until it is needed again.
+void Impl::settle()
+{
+  if( !framed_ && inSize_ == (size_t)NONE && reserved_ == (size_t)NONE ) {
+    head_ = 0;
+    if( shape_->pool_ && arena_ ) {
+      shape_->pool_->put( arena_, cap_ );
+      arena_ = 0;
+    }
+  }
+}
+
+//  Whether there is nothing in the Impl that has to be kept.
+bool Impl::can_idle()
+{
+  return shape_->pool_ && !arena_ && !framed_ && inSize_ == (size_t)NONE 
+      && tmpSize_ == (size_t)NONE && !toSkip_ && reserved_ == (size_t)NONE;
+}
+
+Shape * Impl::shape_of( void * p )
+{
+  if( idle( p ) ) {
+    return (Shape *)((size_t)p & ~(size_t)(IDLE | OWNED));
+  }
+  return ((Impl *)p)->shape_;
+}
+
+Impl * Impl::live( void * & p )
+{
+  if( idle( p ) ) {
+    p = new Impl( shape_of( p ), ((size_t)p & OWNED) != 0 );
   }
-  queue_.clear();
+  return (Impl *)p;
+}
+
+void Impl::settle_buffer( void * & p )
+{
+  if( !idle( p ) && ((Impl *)p)->can_idle() ) {
+    Impl * i = (Impl *)p;
+    p = (void *)((size_t)i->shape_ | IDLE | (i->ownsShape_ ? OWNED : 0));
+    delete i;
+  }
+}
+
+//  Received data is in the same format as the arena, so a run of 
+//  complete messages that all fit can go in with one copy. This 
+//  finds how long that run is, and what count_ and written_ will be 
+//  with it; the caller copies it in.
+size_t Impl::take_frames( unsigned char const * p, size_t size, size_t * oCount, size_t * oWritten )
+{
+  size_t pos = 0;
+  size_t count = count_;
+  size_t written = written_;
+  while( true ) {
+    size_t len;
+    size_t h;
+    if( framing_ != EF_varint ) {
+      if( size - pos < 2 ) {
+        break;
+      }
+      len = (p[pos] << 8) | p[pos + 1];
+      h = 2;
+    }
+    else {
+      len = 0;
+      h = 0;
+      unsigned char c;
+      do {
+        if( pos + h == size ) {
+          goto done;
+        }
+        c = p[pos + h];
+        len |= (size_t)(c & 0x7f) << (7 * h);
+        ++h;
+      }
+      while( (c & 0x80) && h < VARINT_MAX );
+    }
+    if( len > size - pos - h || len > maxMsgSize_ || count >= maxNumMessages_ 
+        || written + len > queueSize_ ) {
+      break;
+    }
+    pos += h + len;
+    written += len;
+    ++count;
+  }
+done:
+  *oCount = count;
+  *oWritten = written;
+  return pos;
 }
 
 int Impl::put_data( void const * data, size_t size )
 {
-#if 0   //  this is useful when debugging gnarly problems
-  std::string msg( "put_data() " );
-  char x[20];
-  msg += itoa( (int)size, x, 10 );
-  msg += " bytes;";
-  for( int i = 0; i < 40 && i < (int)size; ++i ) {
-    msg += " $";
-    msg += itoa( ((unsigned char *)data)[i], x, 16 );
-  }
-  msg += "\n";
-  OutputDebugString( msg.c_str() );
-#endif
+  unsigned char const * p = (unsigned char const *)data;
   int total = 0;
-more:
-  if( !size ) {
-    return total;
-  }
-  //  first, deal with a half-received size
-  if( tmpSize_ != (size_t)-1 ) {
-    assert( curTarget_ == 0 );
-    assert( toSkip_ == 0 );
-    tmpSize_ += *(unsigned char *)data;
-    data = (char *)data + 1;
-    --size;
-    ++total;
-  }
-  //  second, if we don't have a target, get a size for it
-  else if( !curTarget_ ) {
-    assert( tmpSize_ == (size_t)-1 );
-    if( size == 1 ) {
-      //  a single byte of the two-byte length
-      tmpSize_ = *(unsigned char *)data << 8;
-      return total+1;
+  bool dropped = false;
+  while( size > 0 ) {
+    if( !toSkip_ && inSize_ == (size_t)NONE && tmpSize_ == (size_t)NONE ) {
+      //  Between messages: take all the complete ones at once, and 
+      //  leave only the rest to go a piece at a time below.
+      size_t count, written;
+      size_t n = take_frames( p, size, &count, &written );
+      if( n && make_arena() ) {
+        copy_in( wrap( head_ + framed_ ), p, n );
+        framed_ += n;
+        count_ = count;
+        written_ = written;
+        p += n;
+        size -= n;
+        total += (int)n;
+        if( !size ) {
+          break;
+        }
+      }
     }
-    tmpSize_ = (((unsigned char *)data)[0] << 8) + ((unsigned char *)data)[1];
-    size -= 2;
-    data = (char *)data + 2;
-    total += 2;
-  }
-  //  if it's time to allocate a target, do it
-  if( tmpSize_ != (size_t)-1 ) {
-    assert( !curTarget_ );
-    curTarget_ = new_message( tmpSize_ );
-    if( !curTarget_ ) {
-      //OutputDebugString( "Etwork: Skipping too large message in Buffer::put_data()\n" );
-      toSkip_ = tmpSize_;
+    if( toSkip_ > 0 ) {
+      size_t skip = toSkip_;
+      if( skip > size ) {
+        skip = size;
+      }
+      toSkip_ -= skip;
+      p += skip;
+      size -= skip;
+      total += (int)skip;
+      continue;
     }
-    tmpSize_ = (size_t)-1;
-  }
-  if( curTarget_ == 0 ) {
-    assert( toSkip_ > 0 );
-    size_t skip = toSkip_;
-    if( skip > size ) {
-      skip = size;
+    if( inSize_ == (size_t)NONE ) {
+      //  The header, which may come a byte at a time.
+      size_t len;
+      if( framing_ == EF_varint ) {
+        len = (tmpSize_ == (size_t)NONE) ? 0 : tmpSize_;
+        size_t have = (tmpSize_ == (size_t)NONE) ? 0 : tmpHave_;
+        unsigned char c;
+        do {
+          if( !size ) {
+            tmpSize_ = len;
+            tmpHave_ = have;
+            return dropped ? -1 : total;
+          }
+          c = *p++;
+          --size;
+          ++total;
+          len |= (size_t)(c & 0x7f) << (7 * have);
+          ++have;
+        }
+        while( (c & 0x80) && have < VARINT_MAX );
+        tmpSize_ = (size_t)NONE;
+      }
+      else if( tmpSize_ != (size_t)NONE ) {
+        len = tmpSize_ + p[0];
+        tmpSize_ = (size_t)NONE;
+        p += 1;
+        size -= 1;
+        total += 1;
+      }
+      else if( size == 1 ) {
+        tmpSize_ = p[0] << 8;
+        return dropped ? -1 : total + 1;
+      }
+      else {
+        len = (p[0] << 8) + p[1];
+        p += 2;
+        size -= 2;
+        total += 2;
+      }
+      if( !fits( len ) ) {
+        //OutputDebugString( "Etwork: Skipping too large message in Buffer::put_data()\n" );
+        toSkip_ = len;
+        continue;
+      }
+      if( !make_arena() ) {
+        toSkip_ = len;
+        dropped = true;
+        continue;
+      }
+      start_input( len );
+      if( !len ) {
+        finish_input();
+        continue;
+      }
+    }
+    size_t n = inSize_ - inHave_;
+    if( n > size ) {
+      n = size;
     }
-    toSkip_ -= skip;
-    data = (char *)data + skip;
-    size -= skip;
-    total += (int)skip;
-    goto more;  //  try next packet, if any
-  }
-  assert( curTarget_ != 0 );
-  assert( tmpSize_ == (size_t)-1 );
-  assert( toSkip_ == 0 );
-  //  now, keep filling the target
-  size_t toread = curTarget_->size_-curTarget_->offset_;
-  if( toread > size ) {
-    toread = size;
-  }
-  memcpy( &curTarget_[1], data, toread );
-  data = (char *)data + toread;
-  size -= toread;
-  total += (int)toread;
-  curTarget_->offset_ += (unsigned short)toread;
-  if( curTarget_->size_ == curTarget_->offset_ ) {
-    queue_.push_back( curTarget_ );
-    written_ += curTarget_->size_;
-    curTarget_->offset_ = 0;
-    curTarget_ = 0;
-  }
-  goto more;
+    copy_in( wrap( head_ + framed_ + inHdr_ + inHave_ ), p, n );
+    inHave_ += n;
+    p += n;
+    size -= n;
+    total += (int)n;
+    if( inHave_ == inSize_ ) {
+      finish_input();
+    }
+  }
+  return dropped ? -1 : total;
 }
 
 int Impl::put_message( void const * msg, size_t size )
 {
-  Message * w = new_message( size );
-  if( w == 0 ) return -1;
-  memcpy( &w[1], msg, size );
-  queue_.push_back( w );
+  if( reserved_ != (size_t)NONE || !fits( size ) || !make_arena() ) {
+    return -1;
+  }
+  size_t pos = wrap( head_ + framed_ );
+  unsigned char hdr[VARINT_MAX];
+  size_t h = make_header( hdr, size, 0 );
+  copy_in( pos, hdr, h );
+  copy_in( wrap( pos + h ), msg, size );
+  framed_ += h + size;
+  written_ += size;
+  ++count_;
+  return (int)size;
+}
+
+//  The room goes right after the header of the message-to-be, so 
+//  commit() only has to fill in the header (which, with EF_varint, 
+//  is padded out to the size for maxSize). Only when the arena wraps 
+//  inside the room does the message get built on the side, and copied 
+//  in by commit().
+void * Impl::reserve( size_t maxSize )
+{
+  reserved_ = (size_t)NONE;
+  if( !fits( maxSize ) || !make_arena() ) {
+    return 0;
+  }
+  resHdr_ = header_size( maxSize );
+  size_t pos = wrap( head_ + framed_ + resHdr_ );
+  reserved_ = maxSize;
+  bounced_ = maxSize > cap_ - pos;
+  if( !bounced_ ) {
+    return &arena_[pos];
+  }
+  if( !bounce_ ) {
+    bounce_ = (unsigned char *)::operator new( maxMsgSize_ );
+  }
+  return bounce_;
+}
+
+int Impl::commit( size_t size )
+{
+  if( reserved_ == (size_t)NONE || size > reserved_ ) {
+    return -1;
+  }
+  size_t pos = wrap( head_ + framed_ );
+  unsigned char hdr[VARINT_MAX];
+  size_t h = make_header( hdr, size, resHdr_ );
+  copy_in( pos, hdr, h );
+  if( bounced_ ) {
+    copy_in( wrap( pos + h ), bounce_, size );
+  }
+  reserved_ = (size_t)NONE;
+  framed_ += h + size;
   written_ += size;
+  ++count_;
+  return (int)size;
+}
+
+//  The rest of a message that has started arriving can be received in 
+//  place, up to the end of the arena; its size came in with the header.
+size_t Impl::input_space( void ** oData )
+{
+  if( inSize_ == (size_t)NONE ) {
+    return 0;
+  }
+  size_t pos = wrap( head_ + framed_ + inHdr_ + inHave_ );
+  size_t n = inSize_ - inHave_;
+  if( n > cap_ - pos ) {
+    n = cap_ - pos;
+  }
+  *oData = &arena_[pos];
+  return n;
+}
+
+int Impl::commit_input( size_t size )
+{
+  if( inSize_ == (size_t)NONE || size > inSize_ - inHave_ ) {
+    return -1;
+  }
+  inHave_ += size;
+  if( inHave_ == inSize_ ) {
+    finish_input();
+  }
   return (int)size;
 }
 
 int Impl::get_data( void * oData, size_t mSize )
 {
-  int total = 0;
   //  ensure that we get at least one byte into a 
   //  message without staying in the middle of the size.
   if( mSize < 3 ) {
     //OutputDebugString( "Etwork: mSize must be at least 3 in Buffer::get_data()" );
     return -1;
   }
-  unsigned char * data = (unsigned char *)oData;
-more:
-  if( queue_.empty() ) return total;
-  Message * w = queue_.front();
-  if( w->offset_ == 0 ) {
-    data[0] = (unsigned char)(w->size_ >> 8);
-    data[1] = (unsigned char)w->size_;
-    data += 2;
-    mSize -= 2;
-    total += 2;
-  }
-  size_t towrite = w->size_ - w->offset_;
-  if( towrite > mSize ) towrite = mSize;
-  memcpy( data, &w[1], towrite );
-  w->offset_ += (int)towrite;
-  total += (int)towrite;
-  data += towrite;
-  mSize -= towrite;
-  if( w->offset_ == w->size_ ) {
-    queue_.pop_front();
-    written_ -= w->size_;
-    delete_message( w );
+  size_t n = unsent();
+  if( n > mSize ) {
+    n = mSize;
   }
-  if( mSize < 3 ) {
-    return total;
+  if( n ) {
+    copy_out( oData, wrap( head_ + held_ ), n );
+    hold( n );
+    release( n );
   }
-  goto more;
+  return (int)n;
+}
+
+//  Held data is still in the arena, ahead of what get_segments() 
+//  describes. What it does describe is one run of bytes, or two 
+//  when it wraps around the end of the arena.
+int Impl::get_segments( BufferSegment * oSegs, int maxSegs )
+{
+  size_t n = unsent();
+  if( !n || maxSegs < 1 ) {
+    return 0;
+  }
+  size_t pos = wrap( head_ + held_ );
+  size_t first = cap_ - pos;
+  if( first >= n ) {
+    first = n;
+  }
+  oSegs[0].data = &arena_[pos];
+  oSegs[0].size = first;
+  if( first == n || maxSegs < 2 ) {
+    return 1;
+  }
+  oSegs[1].data = arena_;
+  oSegs[1].size = n - first;
+  return 2;
+}
+
+void Impl::hold( size_t size )
+{
+  assert( held_ + size <= framed_ );
+  held_ += size;
+}
+
+void Impl::release( size_t size )
+{
+  assert( size <= held_ );
+  held_ -= size;
+  framed_ -= size;
+  while( size > 0 ) {
+    if( !frontLeft_ ) {
+      frontSize_ = size_at( head_, &frontHdr_ );
+      frontLeft_ = frontHdr_ + frontSize_;
+    }
+    size_t n = frontLeft_;
+    if( n > size ) {
+      n = size;
+    }
+    head_ = wrap( head_ + n );
+    frontLeft_ -= n;
+    size -= n;
+    if( !frontLeft_ ) {
+      written_ -= frontSize_;
+      --count_;
+    }
+  }
+  settle();
 }
 
 int Impl::get_message( void * oData, size_t mSize )
 {
-  if( queue_.empty() ) {
+  if( !count_ ) {
     return -1;
   }
-  Message * msg = queue_.front();
-  size_t copy = msg->size_;
+  size_t h;
+  size_t copy = size_at( head_, &h );
   if( copy > mSize ) {
     return -1;
   }
-  memcpy( oData, &msg[1], copy );
-  written_ -= copy;
-  queue_.pop_front();
-  delete_message( msg );
-  return (int)copy;
+  copy_out( oData, wrap( head_ + h ), copy );
+  return skip_message();
 }
 
-Impl::Message * Impl::new_message( size_t size )
+int Impl::peek_message( BufferSegment * oSegs )
 {
-  if( size > maxMsgSize_ ) {
-    //OutputDebugString( "Etwork: Request for message larger than max size in Impl::new_message()\n" );
-    return 0;
+  if( !count_ ) {
+    return -1;
   }
-  if( queue_.size() >= maxNumMessages_ ) {
-    //OutputDebugString( "Etwork: Attempting to allocate more than allowed number of messages in Impl::new_message()\n" );
-    return 0;
+  size_t h;
+  size_t size = size_at( head_, &h );
+  size_t pos = wrap( head_ + h );
+  size_t first = cap_ - pos;
+  if( first > size ) {
+    first = size;
   }
-  if( written_ + size > queueSize_ ) {
-    //OutputDebugString( "Etwork: Attempting to allocate more than allowed size of message queue in Impl::new_message()\n" );
-    return 0;
-  }
-  Message * m = (Message *)::operator new( size + sizeof( Message ) );
-  m->offset_ = 0;
-  m->size_ = (int)size;
-  return m;
+  oSegs[0].data = &arena_[pos];
+  oSegs[0].size = first;
+  oSegs[1].data = arena_;
+  oSegs[1].size = size - first;
+  return (int)size;
 }
 
-void Impl::delete_message( Message * msg )
+int Impl::skip_message()
 {
-  ::operator delete( msg );
+  if( !count_ ) {
+    return -1;
+  }
+  size_t h;
+  size_t size = size_at( head_, &h );
+  head_ = wrap( head_ + h + size );
+  framed_ -= h + size;
+  written_ -= size;
+  --count_;
+  settle();
+  return (int)size;
 }
 
 
-Buffer::Buffer( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages )
+Buffer::Buffer( size_t maxMsgSize, size_t queueSize, size_t maxNumMessages, int framing )
 {
   assert( sizeof( short ) == 2 );
-  pImpl = new Impl( maxMsgSize, queueSize, maxNumMessages );
+  Shape * sh = new Shape;
+  sh->maxMsgSize_ = maxMsgSize;
+  sh->queueSize_ = queueSize;
+  sh->maxNumMessages_ = maxNumMessages;
+  sh->framing_ = framing;
+  sh->pool_ = 0;
+  pImpl = (void *)((size_t)sh | Impl::IDLE | Impl::OWNED);
+}
+
+Buffer::Buffer( Buffer const * shape )
+{
+  pImpl = (void *)((size_t)Impl::shape_of( shape->pImpl ) | Impl::IDLE);
 }
 
 Buffer::~Buffer()
 {
-  delete (Impl *)pImpl;
+  Shape * sh = Impl::shape_of( pImpl );
+  bool owned;
+  if( Impl::idle( pImpl ) ) {
+    owned = ((size_t)pImpl & Impl::OWNED) != 0;
+  }
+  else {
+    owned = ((Impl *)pImpl)->ownsShape_;
+    delete (Impl *)pImpl;
+  }
+  if( owned ) {
+    delete sh;
+  }
+}
+
+void Buffer::set_pool( IBufferPool * pool )
+{
+  Impl::shape_of( pImpl )->pool_ = pool;
+}
+
+bool Buffer::has_storage()
+{
+  return !Impl::idle( pImpl ) && ((Impl *)pImpl)->arena_ != 0;
 }
 
 int Buffer::put_data( void const * data, size_t size )
 {
-  return ((Impl *)pImpl)->put_data( data, size );
+  int r = Impl::live( pImpl )->put_data( data, size );
+  Impl::settle_buffer( pImpl );
+  return r;
 }
 
 int Buffer::put_message( void const * msg, size_t size )
 {
-  return ((Impl *)pImpl)->put_message( msg, size );
+  int r = Impl::live( pImpl )->put_message( msg, size );
+  Impl::settle_buffer( pImpl );
+  return r;
+}
+
+void * Buffer::reserve( size_t maxSize )
+{
+  void * r = Impl::live( pImpl )->reserve( maxSize );
+  Impl::settle_buffer( pImpl );
+  return r;
+}
+
+int Buffer::commit( size_t size )
+{
+  if( Impl::idle( pImpl ) ) {
+    return -1;
+  }
+  return ((Impl *)pImpl)->commit( size );
+}
+
+size_t Buffer::input_space( void ** oData )
+{
+  if( Impl::idle( pImpl ) ) {
+    return 0;
+  }
+  return ((Impl *)pImpl)->input_space( oData );
+}
+
+int Buffer::commit_input( size_t size )
+{
+  if( Impl::idle( pImpl ) ) {
+    return -1;
+  }
+  return ((Impl *)pImpl)->commit_input( size );
 }
 
 int Buffer::get_data( void * oData, size_t mSize )
 {
-  return ((Impl *)pImpl)->get_data( oData, mSize );
+  if( Impl::idle( pImpl ) ) {
+    return mSize < 3 ? -1 : 0;
+  }
+  int r = ((Impl *)pImpl)->get_data( oData, mSize );
+  Impl::settle_buffer( pImpl );
+  return r;
 }
 
 int Buffer::get_message( void * oData, size_t mSize )
 {
-  return ((Impl *)pImpl)->get_message( oData, mSize );
+  if( Impl::idle( pImpl ) ) {
+    return -1;
+  }
+  int r = ((Impl *)pImpl)->get_message( oData, mSize );
+  Impl::settle_buffer( pImpl );
+  return r;
+}
+
+int Buffer::peek_message( BufferSegment * oSegs )
+{
+  if( Impl::idle( pImpl ) ) {
+    return -1;
+  }
+  return ((Impl *)pImpl)->peek_message( oSegs );
+}
+
+int Buffer::skip_message()
+{
+  if( Impl::idle( pImpl ) ) {
+    return -1;
+  }
+  int r = ((Impl *)pImpl)->skip_message();
+  Impl::settle_buffer( pImpl );
+  return r;
+}
+
+int Buffer::get_segments( BufferSegment * oSegs, int maxSegs )
+{
+  if( Impl::idle( pImpl ) ) {
+    return 0;
+  }
+  return ((Impl *)pImpl)->get_segments( oSegs, maxSegs );
+}
+
+void Buffer::consume( size_t size )
+{
+  if( Impl::idle( pImpl ) ) {
+    assert( !size );
+    return;
+  }
+  ((Impl *)pImpl)->hold( size );
+  ((Impl *)pImpl)->release( size );
+  Impl::settle_buffer( pImpl );
+}
+
+void Buffer::hold( size_t size )
+{
+  if( Impl::idle( pImpl ) ) {
+    assert( !size );
+    return;
+  }
+  ((Impl *)pImpl)->hold( size );
+}
+
+void Buffer::release( size_t size )
+{
+  if( Impl::idle( pImpl ) ) {
+    assert( !size );
+    return;
+  }
+  ((Impl *)pImpl)->release( size );
+  Impl::settle_buffer( pImpl );
+}
+
+size_t Buffer::unsent()
+{
+  if( Impl::idle( pImpl ) ) {
+    return 0;
+  }
+  return ((Impl *)pImpl)->unsent();
 }
 
 size_t Buffer::space_used()
 {
+  if( Impl::idle( pImpl ) ) {
+    return 0;
+  }
   return ((Impl *)pImpl)->space_used();
 }
 
 size_t Buffer::message_count()
 {
+  if( Impl::idle( pImpl ) ) {
+    return 0;
+  }
   return ((Impl *)pImpl)->message_count();
 }
@@ -1,4 +1,3 @@
-
 #if !defined( eimpl_h )
 #define eimpl_h
 
@@ -11,6 +10,91 @@
 #define IS_SOCKET_ERROR(x) \
   ((x) == INVALID_SOCKET)
 
+#if defined( WIN32 )
+
+typedef int SOCKLEN;
+
+#define SEND_FLAGS 0
+
+#define DEBUG_BREAK() \
+  __asm { int 3 }
+
+#elif defined( __linux__ )
+
+//  The BSD sockets API is close enough to WinSock that the
+//  implementation can use the WinSock names, and have them
+//  mapped to the POSIX equivalents here.
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+//  Older libc headers don't know about UDP segmentation offload.
+#if !defined( SOL_UDP )
+#define SOL_UDP 17
+#endif
+#if !defined( UDP_SEGMENT )
+#define UDP_SEGMENT 103
+#endif
+#if !defined( UDP_GRO )
+#define UDP_GRO 104
+#endif
+
+//  ... nor about zero-copy TCP sends.
+#include <linux/errqueue.h>
+#if !defined( SO_ZEROCOPY )
+#define SO_ZEROCOPY 60
+#endif
+#if !defined( MSG_ZEROCOPY )
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#if !defined( SO_EE_ORIGIN_ZEROCOPY )
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+typedef int SOCKET;
+typedef socklen_t SOCKLEN;
+
+#define INVALID_SOCKET (-1)
+
+#define closesocket close
+#define ioctlsocket ioctl
+
+#define WSAEINVAL EINVAL
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAEINPROGRESS EINPROGRESS
+
+#define _snprintf snprintf
+#define _vsnprintf vsnprintf
+
+//  Writing to a socket that the peer has closed must return
+//  an error, not kill the process.
+#define SEND_FLAGS MSG_NOSIGNAL
+
+#define DEBUG_BREAK() \
+  ::raise( SIGTRAP )
+
+inline int WSAGetLastError() {
+  return errno;
+}
+
+inline void OutputDebugString( char const * str ) {
+  ::fputs( str, stderr );
+}
+
+#else
+#error "implement me!"
+#endif
+
 
 namespace etwork {
   namespace impl {
@@ -31,9 +115,38 @@ namespace etwork {
     bool etwork_error_from( ISocket * sock, ISocketManager * mgr, EtworkError err );
     bool etwork_info_from( ISocketManager * mgr, ErrorInfo info );
     void etwork_log( ISocket * sock, ErrorSeverity sev, char const * text, ... );
+
+    //  Atomic operations, for the parts of Etwork that other threads 
+    //  may touch without locking (see EtworkSettings::threadedWrites).
+#if defined( WIN32 )
+    inline void * atomic_load( void * volatile * p ) {
+      return InterlockedCompareExchangePointer( p, 0, 0 );
+    }
+    inline void * atomic_exchange( void * volatile * p, void * v ) {
+      return InterlockedExchangePointer( p, v );
+    }
+    inline bool atomic_cas( void * volatile * p, void * expected, void * v ) {
+      return InterlockedCompareExchangePointer( p, v, expected ) == expected;
+    }
+    inline long atomic_add( long volatile * p, long v ) {
+      return InterlockedExchangeAdd( p, v ) + v;
+    }
+#else
+    inline void * atomic_load( void * volatile * p ) {
+      return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+    }
+    inline void * atomic_exchange( void * volatile * p, void * v ) {
+      return __atomic_exchange_n( p, v, __ATOMIC_ACQ_REL );
+    }
+    inline bool atomic_cas( void * volatile * p, void * expected, void * v ) {
+      return __atomic_compare_exchange_n( p, &expected, v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+    }
+    inline long atomic_add( long volatile * p, long v ) {
+      return __atomic_add_fetch( p, v, __ATOMIC_ACQ_REL );
+    }
+#endif
   }
 }
 
 
 #endif  //  eimpl_h
-
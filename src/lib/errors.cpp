@@ -28,6 +28,7 @@ static EtworkError GetWsaError( int wsaError, ErrorArea area )
   ErrorOption eo = EO_unknown_error;
   ErrorSeverity es = ES_error;
   switch( wsaError ) {
+#if defined( WIN32 )
   case WSAEINTR:
     break;
   case WSAEACCES:         eo = EO_already_in_use;
@@ -128,6 +129,84 @@ static EtworkError GetWsaError( int wsaError, ErrorArea area )
     break;
   case WSASYSCALLFAILURE:
     break;
+#else
+  case EINTR:
+    break;
+  case EACCES:            eo = EO_already_in_use;
+    break;
+  case EFAULT:            eo = EO_invalid_parameters;
+    break;
+  case EINVAL:            eo = EO_invalid_parameters;
+    break;
+  case EMFILE:            eo = EO_out_of_resources; es = ES_catastrophe;
+    break;
+  case ENFILE:            eo = EO_out_of_resources; es = ES_catastrophe;
+    break;
+  case EWOULDBLOCK:       es = ES_warning;
+    break;
+  case EINPROGRESS:       es = ES_warning;
+    break;
+  case EALREADY:          eo = EO_invalid_parameters;
+    break;
+  case ENOTSOCK:          eo = EO_invalid_parameters;
+    break;
+  case EBADF:             eo = EO_invalid_parameters;
+    break;
+  case EDESTADDRREQ:      eo = EO_invalid_parameters; es = ES_catastrophe;
+    break;
+  case EMSGSIZE:          eo = EO_out_of_resources; es = ES_warning;
+    break;
+  case EPROTOTYPE:        eo = EO_invalid_parameters;
+    break;
+  case ENOPROTOOPT:       eo = EO_invalid_parameters;
+    break;
+  case EPROTONOSUPPORT:   eo = EO_unsupported_platform; es = ES_catastrophe;
+    break;
+  case ESOCKTNOSUPPORT:   eo = EO_unsupported_platform; es = ES_catastrophe;
+    break;
+  case EOPNOTSUPP:        eo = EO_invalid_parameters;
+    break;
+  case EPFNOSUPPORT:      eo = EO_unsupported_platform; es = ES_catastrophe;
+    break;
+  case EAFNOSUPPORT:      eo = EO_unsupported_platform; es = ES_catastrophe;
+    break;
+  case EADDRINUSE:        eo = EO_already_in_use;
+    break;
+  case EADDRNOTAVAIL:     eo = EO_invalid_parameters;
+    break;
+  case ENETDOWN:          eo = EO_out_of_resources;
+    break;
+  case ENETUNREACH:       eo = EO_bad_address;
+    break;
+  case ENETRESET:         eo = EO_out_of_resources;
+    break;
+  case ECONNABORTED:      eo = EO_peer_timeout;
+    break;
+  case ECONNRESET:        eo = EO_peer_dropped;
+    break;
+  case EPIPE:             eo = EO_peer_dropped;
+    break;
+  case ENOBUFS:           eo = EO_out_of_resources;
+    break;
+  case ENOMEM:            eo = EO_out_of_resources;
+    break;
+  case EISCONN:           eo = EO_invalid_parameters; es = ES_catastrophe;
+    break;
+  case ENOTCONN:          eo = EO_invalid_parameters; es = ES_catastrophe;
+    break;
+  case ESHUTDOWN:         eo = EO_invalid_parameters;
+    break;
+  case ETIMEDOUT:         eo = EO_peer_timeout;
+    break;
+  case ECONNREFUSED:      eo = EO_peer_refused;
+    break;
+  case EHOSTDOWN:         eo = EO_peer_timeout;
+    break;
+  case EHOSTUNREACH:      eo = EO_bad_address;
+    break;
+  case 0:
+    break;
+#endif
   default:
     {
       char buf[1024];
@@ -149,6 +228,7 @@ std::string etwork::impl::get_error_string( int err )
     error_ = "";
   }
   else {
+#if defined( WIN32 )
     char buf[2048];
     int l = ::FormatMessageA( FORMAT_MESSAGE_FROM_SYSTEM, 0, err, 0, buf, 2048, 0 );
     if( l < 0 || l > 2047 ) {
@@ -156,6 +236,9 @@ std::string etwork::impl::get_error_string( int err )
     }
     buf[l] = 0;
     error_ = buf;
+#else
+    error_ = ::strerror( err );
+#endif
     size_t pos;
     while( (pos = error_.find( '\n' )) != std::string::npos ) {
       error_.erase( pos, 1 );
@@ -187,13 +270,15 @@ void etwork::impl::assert_failure( char const * expr, char const * file, int lin
   }
   else {
     OutputDebugString( str );
+#if defined( WIN32 )
     if( gDebugging ) {
       if( ::MessageBox( NULL, str, "Etwork: Assert Failure", MB_OKCANCEL | MB_ICONSTOP ) 
           == IDCANCEL ) {
         OutputDebugString( "User pressed CANCEL on assert dialog; hitting breakpoint.\n" );
-        __asm { int 3 }
+        DEBUG_BREAK();
       }
     }
+#endif
   }
 }
 
@@ -353,6 +438,11 @@ void EtworkError::setText( char const * text )
   }
 }
 
+bool EtworkError::hasText() const
+{
+  return text_ != 0;
+}
+
 
 
 
@@ -378,6 +468,10 @@ bool etwork::impl::wsa_error_from( ISocket * sock, ISocketManager * mgr, int wsa
   SocketManager * sm = static_cast< SocketManager * >( mgr );
   ErrorInfo info;
   info.error = GetWsaError( wsaErr, area );
+  if( sm && sm->errors_ ) {
+    sm->queue_error( sock, info.error, wsaErr );
+    return info.error.severity() < ES_catastrophe;
+  }
   info.osError = wsaErr;
   info.socket = sock;
   if( en ) {
@@ -403,6 +497,10 @@ bool etwork::impl::etwork_error_from( ISocket * sock, ISocketManager * mgr, Etwo
     }
   }
   SocketManager * sm = static_cast< SocketManager * >( mgr );
+  if( sm && sm->errors_ ) {
+    sm->queue_error( sock, err, 0 );
+    return err.severity() < ES_catastrophe;
+  }
   ErrorInfo info;
   info.error = err;
   info.osError = 0;
@@ -464,3 +562,106 @@ void etwork::impl::etwork_log( ISocket * sock, ErrorSeverity sev, char const * t
   etwork_info_from( 0, ei );
 }
 
+
+
+//  With asyncErrors, this is all an error costs where it happens. The 
+//  same error from the same socket, again and again, takes one record. 
+//  An error with text of its own keeps it in errorTexts_, once per text.
+void SocketManager::queue_error( ISocket * sock, EtworkError const & err, int osError )
+{
+  int error = err;
+  char const * text = 0;
+  if( err.hasText() ) {
+    text = (*errorTexts_.insert( std::string( err.c_str() ) ).first).c_str();
+  }
+  if( errorCount_ ) {
+    QueuedError & last = errors_[(errorFirst_ + errorCount_ - 1) & (ERROR_QUEUE - 1)];
+    if( last.error_ == error && last.text_ == text && last.osError_ == osError && last.socket_ == sock ) {
+      ++last.repeat_;
+      return;
+    }
+  }
+  if( errorCount_ == ERROR_QUEUE ) {
+    ++errorsDropped_;
+    return;
+  }
+  QueuedError & qe = errors_[(errorFirst_ + errorCount_) & (ERROR_QUEUE - 1)];
+  qe.error_ = error;
+  qe.text_ = text;
+  qe.osError_ = osError;
+  qe.socket_ = sock;
+  qe.repeat_ = 1;
+  qe.time_ = curTime_;
+  ++errorCount_;
+}
+
+void SocketManager::forget_errors( ISocket * sock )
+{
+  for( size_t i = 0; i < errorCount_; ++i ) {
+    QueuedError & qe = errors_[(errorFirst_ + i) & (ERROR_QUEUE - 1)];
+    if( qe.socket_ == sock ) {
+      qe.socket_ = 0;
+    }
+  }
+}
+
+//  What wsa_error_from() or etwork_error_from() would have done.
+void SocketManager::report_queued( EtworkError const & err, int osError, ISocket * sock, unsigned int repeat, double time )
+{
+  IErrorNotify * en = settings_.notify ? settings_.notify : gErrorNotify;
+  ErrorInfo info;
+  info.error = err;
+  info.osError = osError;
+  info.socket = sock;
+  if( repeat > 1 ) {
+    char buf[2048];
+    _snprintf( buf, 2048, "%s (%u times)", info.error.c_str(), repeat );
+    buf[2047] = 0;
+    info.error.setText( buf );
+  }
+  if( en ) {
+    en->onSocketError( info );
+  }
+  else if( (osError && info.error.severity() >= ES_error) || settings_.debug || gDebugging ) {
+    char buf[2048];
+    _snprintf( buf, 2048, "Etwork: Error %d at %.3f: %s (%s)\n", osError, time,
+        info.error.c_str(), get_error_string( osError ).c_str() );
+    buf[2047] = 0;
+    OutputDebugString( buf );
+  }
+}
+
+int SocketManager::drain_errors( int maxErrors )
+{
+  if( !errors_ ) {
+    return -1;
+  }
+  int n = 0;
+  while( errorCount_ && (maxErrors <= 0 || n < maxErrors) ) {
+    //  Take it out first; reporting it may queue more.
+    QueuedError qe = errors_[errorFirst_];
+    errorFirst_ = (errorFirst_ + 1) & (ERROR_QUEUE - 1);
+    --errorCount_;
+    EtworkError err;
+    err = qe.error_;
+    if( qe.text_ ) {
+      err.setText( qe.text_ );
+    }
+    report_queued( err, qe.osError_, qe.socket_, qe.repeat_, qe.time_ );
+    ++n;
+  }
+  if( !errorCount_ ) {
+    //  No record points into it anymore.
+    errorTexts_.clear();
+  }
+  if( errorsDropped_ && !errorCount_ ) {
+    char buf[256];
+    _snprintf( buf, 256, "%lu errors did not fit in the queue for drain_errors().", errorsDropped_ );
+    buf[255] = 0;
+    errorsDropped_ = 0;
+    EtworkError err( ES_warning, EA_unknown, EO_buffer_full );
+    err.setText( buf );
+    report_queued( err, 0, 0, 1, curTime_ );
+  }
+  return n;
+}
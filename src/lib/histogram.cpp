@@ -0,0 +1,64 @@
+
+#include "sockimpl.h"
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+//  Times are counted in whole microseconds. Below 8, each has its own
+//  bucket; from there, each doubling gets 8 buckets, told apart by the
+//  three bits below the top one.
+static int bucket_of( double seconds )
+{
+  double us = seconds * 1e6;
+  if( us < 8 ) {
+    return us > 0 ? (int)us : 0;
+  }
+  if( us >= 4294967296.0 ) {
+    return ETWORK_HISTOGRAM_BUCKETS - 1;
+  }
+  unsigned long v = (unsigned long)us;
+  int top = 3;
+  while( (v >> top) > 1 ) {
+    ++top;
+  }
+  return (top - 2) * 8 + (int)((v >> (top - 3)) & 7);
+}
+
+void PollTimer::add( EtworkHistogram * h, double seconds )
+{
+  h->counts[bucket_of( seconds )]++;
+  h->count++;
+  h->total += seconds;
+  if( seconds > h->max ) {
+    h->max = seconds;
+  }
+}
+
+double EtworkHistogramBucket( int bucket )
+{
+  if( bucket < 8 ) {
+    return bucket * 1e-6;
+  }
+  int top = bucket / 8 + 2;
+  return (double)((8 + (bucket & 7)) * (1ULL << (top - 3))) * 1e-6;
+}
+
+//  The answer is the top of the bucket that the fraction falls in,
+//  as the times in it may be that long; but no more than the longest.
+double EtworkHistogramPercentile( EtworkHistogram const * hist, double fraction )
+{
+  if( !hist->count ) {
+    return 0;
+  }
+  double want = fraction * (double)hist->count;
+  unsigned long long have = 0;
+  for( int i = 0; i < ETWORK_HISTOGRAM_BUCKETS - 1; ++i ) {
+    have += hist->counts[i];
+    if( (double)have >= want ) {
+      double top = EtworkHistogramBucket( i + 1 );
+      return top < hist->max ? top : hist->max;
+    }
+  }
+  return hist->max;
+}
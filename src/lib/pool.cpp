@@ -0,0 +1,55 @@
+
+#include "sockimpl.h"
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+BufferPool::BufferPool()
+{
+  budget_ = 0;
+  lent_ = 0;
+  lentHigh_ = 0;
+  size_ = 0;
+  returned_ = false;
+}
+
+BufferPool::~BufferPool()
+{
+  for( size_t i = 0, n = spare_.size(); i != n; ++i ) {
+    ::operator delete( spare_[i] );
+  }
+}
+
+void * BufferPool::get( size_t size )
+{
+  if( budget_ && lent_ + size > budget_ ) {
+    return 0;
+  }
+  void * mem;
+  if( size == size_ && !spare_.empty() ) {
+    mem = spare_.back();
+    spare_.pop_back();
+  }
+  else {
+    mem = ::operator new( size );
+  }
+  size_ = size;
+  lent_ += size;
+  if( lent_ > lentHigh_ ) {
+    lentHigh_ = lent_;
+  }
+  return mem;
+}
+
+void BufferPool::put( void * mem, size_t size )
+{
+  lent_ -= size;
+  returned_ = true;
+  if( size == size_ && spare_.size() < POOL_SPARE ) {
+    spare_.push_back( mem );
+  }
+  else {
+    ::operator delete( mem );
+  }
+}
@@ -0,0 +1,510 @@
+
+#include "sockimpl.h"
+
+#if defined( WIN32 )
+#include <ntsecapi.h>   //  for RtlGenRandom()
+#pragma comment( lib, "advapi32.lib" )
+#else
+#include <poll.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+//  This is a minimal stub resolver (RFC 1035): one A question per query, 
+//  recursion desired, sent to one name server, retried a few times. 
+//  Negative answers are cached per RFC 2308.
+namespace {
+  double const RETRY_TIME = 1.0;        //  seconds between tries
+  int const MAX_TRIES = 3;
+  unsigned long const MAX_TTL = 86400;  //  don't believe anything for longer than a day
+  unsigned long const NEG_TTL = 60;     //  "no such host" without an SOA to go by
+  size_t const MAX_CACHE = 1024;
+  size_t const MAX_PACKET = 512;        //  DNS over UDP, without EDNS
+
+  enum {
+    TYPE_A = 1,
+    TYPE_SOA = 6,
+    CLASS_IN = 1,
+    RCODE_NXDOMAIN = 3,
+  };
+
+  inline unsigned int get16( unsigned char const * p ) {
+    return (p[0] << 8) | p[1];
+  }
+  inline unsigned long get32( unsigned char const * p ) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | (p[2] << 8) | p[3];
+  }
+
+  //  Return the offset after the (possibly compressed) name at 'off', 
+  //  or -1 if it runs off the end of the packet.
+  int skip_name( unsigned char const * p, int n, int off ) {
+    while( off < n ) {
+      unsigned int len = p[off];
+      if( (len & 0xc0) == 0xc0 ) {
+        return (off + 2 <= n) ? off + 2 : -1;
+      }
+      if( len == 0 ) {
+        return off + 1;
+      }
+      off += len + 1;
+    }
+    return -1;
+  }
+
+  //  Whether the question at 'off' is the one make_query() asks about 
+  //  'name' (which make_key() has lower-cased). Returns the offset after 
+  //  it, or -1 if it isn't.
+  int match_question( unsigned char const * p, int n, int off, std::string const & name ) {
+    size_t start = 0;
+    while( off < n && p[off] != 0 ) {
+      unsigned int len = p[off];
+      if( len > 63 || off + 1 + (int)len > n || start + len > name.size() ) {
+        return -1;  //  compressed, cut short, or too long
+      }
+      for( unsigned int i = 0; i < len; ++i ) {
+        if( (char)tolower( p[off+1+i] ) != name[start+i] ) {
+          return -1;
+        }
+      }
+      start += len;
+      if( start < name.size() ) {
+        if( name[start] != '.' ) {
+          return -1;
+        }
+        ++start;
+      }
+      off += len + 1;
+    }
+    if( off + 5 > n || start != name.size() ) {
+      return -1;
+    }
+    if( get16( p+off+1 ) != TYPE_A || get16( p+off+3 ) != CLASS_IN ) {
+      return -1;
+    }
+    return off + 5;
+  }
+
+  //  Anyone who can guess the id of a query can answer it first, so 
+  //  each one gets its own, from the system's random number source.
+  unsigned short random_id() {
+    unsigned short id = 0;
+#if defined( WIN32 )
+    if( !RtlGenRandom( &id, sizeof( id ) ) ) {
+      id = (unsigned short)rand();
+    }
+#else
+    long r = -1;
+#if defined( SYS_getrandom )
+    r = ::syscall( SYS_getrandom, &id, sizeof( id ), 0 );
+#endif
+    if( r != (long)sizeof( id ) ) {
+      //  A kernel without getrandom()
+      int fd = ::open( "/dev/urandom", O_RDONLY );
+      if( fd < 0 || ::read( fd, &id, sizeof( id ) ) != (ssize_t)sizeof( id ) ) {
+        id = (unsigned short)rand();
+      }
+      if( fd >= 0 ) {
+        ::close( fd );
+      }
+    }
+#endif
+    return id;
+  }
+
+  //  Put a query for the A record of 'name' into buf. Returns its size, 
+  //  or -1 if 'name' can't be a DNS name.
+  int make_query( unsigned char * buf, std::string const & name, unsigned short id ) {
+    if( name.empty() || name.size() > 253 ) {
+      return -1;
+    }
+    unsigned char * p = buf;
+    *p++ = (unsigned char)(id >> 8);
+    *p++ = (unsigned char)id;
+    *p++ = 0x01;    //  recursion desired
+    *p++ = 0x00;
+    *p++ = 0;       //  one question
+    *p++ = 1;
+    memset( p, 0, 6 );
+    p += 6;
+    size_t start = 0;
+    while( start < name.size() ) {
+      size_t dot = name.find( '.', start );
+      if( dot == std::string::npos ) {
+        dot = name.size();
+      }
+      size_t len = dot - start;
+      if( len == 0 || len > 63 ) {
+        return -1;
+      }
+      *p++ = (unsigned char)len;
+      memcpy( p, &name[start], len );
+      p += len;
+      start = dot + 1;
+    }
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = TYPE_A;
+    *p++ = 0;
+    *p++ = CLASS_IN;
+    return (int)(p - buf);
+  }
+
+  //  Find the name server the system uses. Only IPv4 servers will do.
+  bool system_nameserver( char * buf, size_t size ) {
+#if defined( WIN32 )
+    return false;   //  connect() falls back to gethostbyname()
+#else
+    FILE * f = ::fopen( "/etc/resolv.conf", "r" );
+    if( !f ) {
+      return false;
+    }
+    char line[256];
+    char addr[64];
+    bool found = false;
+    while( !found && ::fgets( line, sizeof( line ), f ) ) {
+      if( ::sscanf( line, " nameserver %63s", addr ) == 1 && ::inet_addr( addr ) != INADDR_NONE ) {
+        ::snprintf( buf, size, "%s", addr );
+        found = true;
+      }
+    }
+    ::fclose( f );
+    return found;
+#endif
+  }
+}
+
+
+Resolver::Resolver()
+{
+  s_ = INVALID_SOCKET;
+  configured_ = false;
+  memset( &server_, 0, sizeof( server_ ) );
+}
+
+Resolver::~Resolver()
+{
+  if( is_open() ) {
+    ::closesocket( s_ );
+  }
+}
+
+//  Decide which name server to use: "address[:port]", or the system's 
+//  if 'nameserver' is NULL. Returns false if there isn't one, in which 
+//  case there is no Resolver to open().
+bool Resolver::configure( char const * nameserver )
+{
+  char buf[256];
+  if( nameserver ) {
+    _snprintf( buf, sizeof( buf ), "%s", nameserver );
+    buf[sizeof( buf )-1] = 0;
+  }
+  else if( !system_nameserver( buf, sizeof( buf ) ) ) {
+    return false;
+  }
+  server_.sin_family = AF_INET;
+  server_.sin_port = htons( 53 );
+  char * colon = strchr( buf, ':' );
+  if( colon ) {
+    *colon = 0;
+    server_.sin_port = htons( (unsigned short)atoi( colon+1 ) );
+  }
+  server_.sin_addr.s_addr = ::inet_addr( buf );
+  if( server_.sin_addr.s_addr == INADDR_NONE ) {
+    etwork_log( 0, ES_warning, "'%s' is not a name server address.", buf );
+    return false;
+  }
+  configured_ = true;
+  return true;
+}
+
+bool Resolver::open()
+{
+  if( !configured_ ) {
+    return false;
+  }
+  s_ = ::socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+  if( IS_SOCKET_ERROR( s_ ) ) {
+    wsa_error( ::WSAGetLastError(), EA_address );
+    return false;
+  }
+  u_long nonblock = 1;
+  //  Connecting the socket means only the name server's packets get in.
+  if( ::ioctlsocket( s_, FIONBIO, &nonblock ) < 0
+      || ::connect( s_, (sockaddr const *)&server_, sizeof( server_ ) ) < 0 ) {
+    wsa_error( ::WSAGetLastError(), EA_address );
+    ::closesocket( s_ );
+    s_ = INVALID_SOCKET;
+    return false;
+  }
+  return true;
+}
+
+std::string Resolver::make_key( char const * name )
+{
+  std::string key( name );
+  for( size_t i = 0; i < key.size(); ++i ) {
+    key[i] = (char)tolower( (unsigned char)key[i] );
+  }
+  if( key.size() && key[key.size()-1] == '.' ) {
+    key.resize( key.size()-1 );
+  }
+  return key;
+}
+
+//  Returns 1 (and the address) if the name is known, -1 if it is known 
+//  not to exist (or can't be a name at all), and 0 if the name server 
+//  has been asked. The answer will show up in answers_.
+int Resolver::lookup( char const * name, in_addr * out, double now )
+{
+  std::string key = make_key( name );
+  if( key == "localhost" ) {
+    out->s_addr = htonl( INADDR_LOOPBACK );
+    return 1;
+  }
+  int r = find( key, out, now );
+  if( r != 0 ) {
+    return r;
+  }
+  if( pending_.find( key ) == pending_.end() && !send_query( key, now ) ) {
+    return -1;
+  }
+  return 0;
+}
+
+//  Block until the name server answers about 'name', or gives up. This 
+//  is for connect() without asyncConnect; it only holds up this manager.
+int Resolver::wait( char const * name, in_addr * out, Timer const & time )
+{
+  std::string key = make_key( name );
+  while( pending_.find( key ) != pending_.end() ) {
+#if defined( WIN32 )
+    fd_set fds;
+    FD_ZERO( &fds );
+    FD_SET( s_, &fds );
+    timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    int r = ::select( (int)s_+1, &fds, 0, 0, &tv );
+#else
+    pollfd pfd;
+    pfd.fd = s_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int r = ::poll( &pfd, 1, 100 );
+#endif
+    double now = time.seconds();
+    if( r > 0 ) {
+      handle_read( now );
+    }
+    handle_timeouts( now );
+  }
+  int found = -1;
+  for( size_t i = 0; i < answers_.size(); ) {
+    if( answers_[i].name_ == key ) {
+      if( answers_[i].found_ ) {
+        *out = answers_[i].addr_;
+        found = 1;
+      }
+      answers_.erase( answers_.begin() + i );
+    }
+    else {
+      ++i;
+    }
+  }
+  return found;
+}
+
+int Resolver::find( std::string const & key, in_addr * out, double now )
+{
+  Cache::iterator ptr = cache_.find( key );
+  if( ptr == cache_.end() ) {
+    return 0;
+  }
+  if( (*ptr).second.expires_ <= now ) {
+    cache_.erase( ptr );
+    return 0;
+  }
+  if( !(*ptr).second.found_ ) {
+    return -1;
+  }
+  *out = (*ptr).second.addr_;
+  return 1;
+}
+
+//  Send the query for 'key', for the first time or again.
+bool Resolver::send_query( std::string const & key, double now )
+{
+  if( !is_open() ) {
+    return false;
+  }
+  QueryMap::iterator ptr = pending_.find( key );
+  if( ptr == pending_.end() ) {
+    Query q;
+    do {
+      q.id_ = random_id();
+    }
+    while( ids_.find( q.id_ ) != ids_.end() );
+    q.tries_ = 0;
+    q.sent_ = now;
+    ptr = pending_.insert( QueryMap::value_type( key, q ) ).first;
+    ids_[q.id_] = key;
+  }
+  Query & q = (*ptr).second;
+  unsigned char buf[MAX_PACKET];
+  int n = make_query( buf, key, q.id_ );
+  if( n < 0 ) {
+    ids_.erase( q.id_ );
+    pending_.erase( ptr );
+    return false;
+  }
+  q.sent_ = now;
+  ++q.tries_;
+  //  If this fails, the retry timer will try again.
+  if( ::send( s_, (char const *)buf, n, 0 ) < 0 ) {
+    wsa_error( ::WSAGetLastError(), EA_address );
+  }
+  return true;
+}
+
+void Resolver::handle_read( double now )
+{
+  unsigned char buf[MAX_PACKET];
+  //  A bounded number of reads, so a flood can't keep the manager here.
+  for( int i = 0; i < 64; ++i ) {
+    int r = ::recv( s_, (char *)buf, sizeof( buf ), 0 );
+    if( r < 0 ) {
+      if( ::WSAGetLastError() == WSAEWOULDBLOCK ) {
+        break;
+      }
+      //  Typically ICMP "port unreachable" from an earlier query; the 
+      //  retry timer deals with that.
+      continue;
+    }
+    handle_reply( buf, r, now );
+  }
+}
+
+void Resolver::handle_timeouts( double now )
+{
+  for( QueryMap::iterator ptr = pending_.begin(); ptr != pending_.end(); ) {
+    QueryMap::iterator cur = ptr++;
+    Query & q = (*cur).second;
+    if( now - q.sent_ < RETRY_TIME ) {
+      continue;
+    }
+    if( q.tries_ >= MAX_TRIES ) {
+      //  Give up, but don't remember it; it may work next time.
+      Answer a;
+      a.name_ = (*cur).first;
+      a.found_ = false;
+      a.addr_.s_addr = 0;
+      answers_.push_back( a );
+      ids_.erase( q.id_ );
+      pending_.erase( cur );
+    }
+    else {
+      send_query( (*cur).first, now );
+    }
+  }
+}
+
+void Resolver::handle_reply( unsigned char const * p, int n, double now )
+{
+  if( n < 12 || !(p[2] & 0x80) ) {
+    return;   //  not a response
+  }
+  IdMap::iterator ip = ids_.find( (unsigned short)get16( p ) );
+  if( ip == ids_.end() ) {
+    return;   //  late answer to a query that was given up on
+  }
+  std::string key = (*ip).second;
+  int rcode = p[3] & 0x0f;
+  int qd = get16( p+4 );
+  int an = get16( p+6 );
+  int ns = get16( p+8 );
+  //  The answer has to be to the question that was asked, not just 
+  //  carry its id; anything else stays out of the cache.
+  if( qd != 1 ) {
+    return;
+  }
+  int off = match_question( p, n, 12, key );
+  if( off < 0 ) {
+    return;
+  }
+  Answer a;
+  a.name_ = key;
+  a.found_ = false;
+  a.addr_.s_addr = 0;
+  unsigned long ttl = MAX_TTL;
+  unsigned long negTtl = NEG_TTL;
+  for( int i = 0; i < an + ns; ++i ) {
+    off = skip_name( p, n, off );
+    if( off < 0 || off + 10 > n ) {
+      break;
+    }
+    unsigned int type = get16( p+off );
+    unsigned int cls = get16( p+off+2 );
+    unsigned long rttl = get32( p+off+4 );
+    int rdlen = get16( p+off+8 );
+    off += 10;
+    if( off + rdlen > n ) {
+      break;
+    }
+    if( i < an ) {
+      //  An answer is only good for as long as every link (CNAMEs 
+      //  included) in it is.
+      ttl = std::min( ttl, rttl );
+      if( type == TYPE_A && cls == CLASS_IN && rdlen == 4 && !a.found_ ) {
+        memcpy( &a.addr_, p+off, 4 );
+        a.found_ = true;
+      }
+    }
+    else if( type == TYPE_SOA ) {
+      //  A negative answer lasts for the smaller of the SOA's TTL and 
+      //  its MINIMUM field, which is the last of its five numbers.
+      int m = skip_name( p, n, off );
+      if( m >= 0 ) {
+        m = skip_name( p, n, m );
+      }
+      if( m >= 0 && m + 20 <= off + rdlen ) {
+        negTtl = std::min( rttl, get32( p+m+16 ) );
+      }
+    }
+    off += rdlen;
+  }
+  if( a.found_ ) {
+    store( key, true, a.addr_, ttl, now );
+  }
+  else if( rcode == RCODE_NXDOMAIN || rcode == 0 ) {
+    //  No such host, or no address for it.
+    store( key, false, a.addr_, std::min( negTtl, MAX_TTL ), now );
+  }
+  //  Other errors (SERVFAIL, REFUSED, ...) fail this lookup, but aren't remembered.
+  answers_.push_back( a );
+  pending_.erase( key );
+  ids_.erase( ip );
+}
+
+void Resolver::store( std::string const & key, bool found, in_addr const & addr, unsigned long ttl, double now )
+{
+  if( cache_.size() >= MAX_CACHE ) {
+    for( Cache::iterator ptr = cache_.begin(); ptr != cache_.end(); ) {
+      Cache::iterator cur = ptr++;
+      if( (*cur).second.expires_ <= now ) {
+        cache_.erase( cur );
+      }
+    }
+    if( cache_.size() >= MAX_CACHE ) {
+      cache_.erase( cache_.begin() );
+    }
+  }
+  Entry & e = cache_[key];
+  e.found_ = found;
+  e.addr_ = addr;
+  e.expires_ = now + ttl;
+}
@@ -0,0 +1,170 @@
+
+#include "sockimpl.h"
+
+#if !defined( WIN32 )
+#include <sched.h>
+#endif
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+namespace {
+  int num_cpus()
+  {
+#if defined( WIN32 )
+    SYSTEM_INFO si;
+    ::GetSystemInfo( &si );
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = ::sysconf( _SC_NPROCESSORS_ONLN );
+    return (n > 0) ? (int)n : 1;
+#endif
+  }
+
+  //  Keep each shard on one CPU, so its sockets and buffers stay in 
+  //  that CPU's cache. Failing to do so is not fatal.
+  void pin_thread( int index )
+  {
+    int cpu = index % num_cpus();
+#if defined( WIN32 )
+    if( cpu < 32 && !::SetThreadAffinityMask( ::GetCurrentThread(), (DWORD_PTR)1 << cpu ) ) {
+      etwork_log( 0, ES_note, "Could not pin shard %d to CPU %d.", index, cpu );
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    if( ::pthread_setaffinity_np( ::pthread_self(), sizeof( set ), &set ) != 0 ) {
+      etwork_log( 0, ES_note, "Could not pin shard %d to CPU %d.", index, cpu );
+    }
+#endif
+  }
+
+#if defined( WIN32 )
+  DWORD WINAPI shard_thread( void * arg )
+#else
+  void * shard_thread( void * arg )
+#endif
+  {
+    ShardedServer::Shard * sh = (ShardedServer::Shard *)arg;
+    sh->srv_->run( sh->index_ );
+    return 0;
+  }
+}
+
+
+ShardedServer::ShardedServer( IShardHandler * handler )
+{
+  handler_ = handler;
+}
+
+ShardedServer::~ShardedServer()
+{
+  join();
+  for( size_t i = 0; i < shards_.size(); ++i ) {
+    if( shards_[i].mgr_ ) {
+      shards_[i].mgr_->dispose();
+    }
+  }
+}
+
+int ShardedServer::count()
+{
+  return (int)shards_.size();
+}
+
+ISocketManager * ShardedServer::shard( int index )
+{
+  if( index < 0 || index >= (int)shards_.size() ) {
+    etwork_error_from( 0, 0, EtworkError( ES_error, EA_session, EO_invalid_parameters ) );
+    return 0;
+  }
+  return shards_[index].mgr_;
+}
+
+void ShardedServer::join()
+{
+  for( size_t i = 0; i < shards_.size(); ++i ) {
+    Shard & sh = shards_[i];
+    if( sh.running_ ) {
+#if defined( WIN32 )
+      ::WaitForSingleObject( sh.thread_, INFINITE );
+      ::CloseHandle( sh.thread_ );
+#else
+      ::pthread_join( sh.thread_, 0 );
+#endif
+      sh.running_ = false;
+    }
+  }
+}
+
+void ShardedServer::dispose()
+{
+  delete this;
+}
+
+//  Start the thread for shard 'index'. shards_ must not change size 
+//  after this, as the thread holds on to its Shard.
+bool ShardedServer::start( int index )
+{
+  Shard & sh = shards_[index];
+#if defined( WIN32 )
+  sh.thread_ = ::CreateThread( 0, 0, &shard_thread, &sh, 0, 0 );
+  sh.running_ = (sh.thread_ != 0);
+#else
+  sh.running_ = (::pthread_create( &sh.thread_, 0, &shard_thread, &sh ) == 0);
+#endif
+  return sh.running_;
+}
+
+void ShardedServer::run( int index )
+{
+  pin_thread( index );
+  handler_->onShard( index, shards_[index].mgr_ );
+}
+
+
+IShardedServer * CreateShardedEtwork( EtworkSettings * settings, int numShards, IShardHandler * handler )
+{
+  if( !settings || !settings->accepting || !handler || numShards < 0 ) {
+    etwork_error_from( 0, 0, EtworkError( ES_error, EA_init, EO_invalid_parameters ) );
+    return 0;
+  }
+  if( numShards == 0 ) {
+    numShards = num_cpus();
+  }
+#if !defined( SO_REUSEPORT )
+  if( numShards > 1 ) {
+    etwork_log( 0, ES_note, "No SO_REUSEPORT on this platform; using one shard." );
+    numShards = 1;
+  }
+#endif
+  ShardedServer * srv = new ShardedServer( handler );
+  srv->shards_.resize( numShards );
+  for( int i = 0; i < numShards; ++i ) {
+    ShardedServer::Shard & sh = srv->shards_[i];
+    sh.srv_ = srv;
+    sh.index_ = i;
+    sh.running_ = false;
+    sh.mgr_ = 0;
+  }
+  //  Create all the managers before any thread starts, so a port that 
+  //  is in use doesn't leave some shards running.
+  for( int i = 0; i < numShards; ++i ) {
+    EtworkSettings es( *settings );
+    es.reuseport = true;
+    srv->shards_[i].mgr_ = CreateEtwork( &es );
+    if( !srv->shards_[i].mgr_ ) {
+      srv->dispose();
+      return 0;
+    }
+  }
+  for( int i = 0; i < numShards; ++i ) {
+    if( !srv->start( i ) ) {
+      //  The shard is still there, for the user to drive through shard().
+      etwork_log( 0, ES_error, "Could not start a thread for shard %d.", i );
+    }
+  }
+  return srv;
+}
@@ -5,12 +5,16 @@ using namespace etwork;
 using namespace etwork::impl;
 
 
-SocketManager::SocketManager()
+//  Deadlines are kept to a hundredth of a second.
+SocketManager::SocketManager() :
+  wheel_( 0.01 )
 {
   listening_ = INVALID_SOCKET;
+  postedWriters_ = 0;
   maxNumSocks_ = FD_SETSIZE;
   numSocks_ = 0;
   maxSock_ = 0;
+#if defined( WIN32 )
   allSet_ = (fd_set *)::operator new( sizeof(fd_set) );
   FD_ZERO( allSet_ );
   readSet_ = (fd_set *)::operator new( sizeof(fd_set) );
@@ -21,10 +25,34 @@ SocketManager::SocketManager()
   FD_ZERO( writeTempSet_ );
   exceptSet_ = (fd_set *)::operator new( sizeof(fd_set) );
   FD_ZERO( exceptSet_ );
+#else
+  //  maxNumSocks_ is the most events taken out of epoll per pass; 
+  //  anything more stays pending until the next pass.
+  epoll_ = -1;
+  events_ = new epoll_event[ maxNumSocks_ ];
+  listenInterest_ = 0;
+  resolverInterest_ = 0;
+  wakeup_ = -1;
+  wakeupInterest_ = 0;
+  recvBatch_ = 0;
+  sendBatch_ = 0;
+  sendCount_ = 0;
+  sendDone_ = 0;
+#endif
   nextSocket_ = 1;
   tmpBuffer_ = 0;
+  bufShape_ = 0;
+  hist_ = 0;
+  trace_ = 0;
+  traceMask_ = 0;
+  traced_ = 0;
+  errors_ = 0;
+  errorFirst_ = 0;
+  errorCount_ = 0;
+  errorsDropped_ = 0;
   curQueueSpace_ = 0;
   curTime_ = time_.seconds();
+  memset( &stats_, 0, sizeof( stats_ ) );
 }
 
 SocketManager::~SocketManager()
@@ -33,17 +61,58 @@ SocketManager::~SocketManager()
     ::closesocket( listening_ );
     listening_ = INVALID_SOCKET;
   }
+#if defined( WIN32 )
   ::operator delete( allSet_ );
   ::operator delete( readSet_ );
   ::operator delete( writeSet_ );
   ::operator delete( writeTempSet_ );
   ::operator delete( exceptSet_ );
+#else
+  //  The kernel may not be done with these yet, but nothing can 
+  //  wait for it anymore.
+  for( size_t i = 0, n = lingering_.size(); i != n; ++i ) {
+    delete lingering_[i];
+  }
+  if( epoll_ >= 0 ) {
+    ::close( epoll_ );
+  }
+  if( wakeup_ >= 0 ) {
+    ::close( wakeup_ );
+  }
+  delete[] events_;
+  delete_batch( recvBatch_ );
+  delete_batch( sendBatch_ );
+#endif
   delete[] tmpBuffer_;
+  delete bufShape_;
+  delete[] hist_;
+  delete[] trace_;
+  delete[] errors_;
 }
 
 bool SocketManager::open( EtworkSettings * settings )
 {
   settings_ = *settings;
+  size_t traceSize = 1;
+  while( traceSize < settings_.traceSize ) {
+    traceSize <<= 1;
+  }
+  trace_ = new EtworkTraceRecord[ traceSize ];
+  memset( trace_, 0, sizeof( EtworkTraceRecord ) * traceSize );
+  traceMask_ = traceSize - 1;
+  if( settings_.asyncErrors ) {
+    errors_ = new QueuedError[ ERROR_QUEUE ];
+  }
+  pool_.budget_ = settings_.memoryBudget;
+  bufShape_ = new Buffer( settings_.maxMessageSize, settings_.queueSize, settings_.maxMessageCount, settings_.framing );
+  bufShape_->set_pool( &pool_ );
+  if( settings_.histograms ) {
+    hist_ = new EtworkHistogram[ EP_count ];
+    memset( hist_, 0, sizeof( EtworkHistogram ) * EP_count );
+  }
+  //  The name server string is only good for the duration of the call.
+  resolver_.configure( settings_.nameserver );
+  settings_.nameserver = 0;
 
   if( settings_.accepting && !settings_.port ) {
     ErrorInfo ei;
@@ -74,6 +143,15 @@ bool SocketManager::open( EtworkSettings * settings )
       debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::setsockopt(SO_REUSEADDR)" );
       goto failure;
     }
+#if defined( SO_REUSEPORT )
+    if( settings->reuseport ) {
+      r = ::setsockopt( listening_, SOL_SOCKET, SO_REUSEPORT, (char const *)&one, sizeof(one) );
+      if( r < 0 ) {
+        debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::setsockopt(SO_REUSEPORT)" );
+        goto failure;
+      }
+    }
+#endif
     sockaddr_in addr;
     memset( &addr, 0, sizeof( addr ) );
     addr.sin_family = AF_INET;
@@ -89,6 +167,13 @@ bool SocketManager::open( EtworkSettings * settings )
         debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::listen(100)" );
         goto failure;
       }
+#if !defined( WIN32 )
+      //  a client that goes away between readiness and accept() 
+      //  must not block the poll loop
+      if( !make_nonblocking( listening_, EA_init ) ) {
+        goto failure;
+      }
+#endif
     }
     else {
       //  make the socket non-blocking
@@ -102,7 +187,41 @@ bool SocketManager::open( EtworkSettings * settings )
       change_queuing_space();
     }
   }
+#if !defined( WIN32 )
+  //  A write posted from another thread has to wake a poll() that is 
+  //  already waiting.
+  if( settings_.threadedWrites ) {
+    wakeup_ = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( wakeup_ < 0 ) {
+      debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::eventfd()" );
+      goto failure;
+    }
+  }
+  if( !open_engine() ) {
+    goto failure;
+  }
+#endif
   tmpBuffer_ = new char[ settings_.maxMessageSize ];
+#if !defined( WIN32 )
+  if( !settings_.reliable ) {
+    size_t recvSize = settings_.maxMessageSize;
+    size_t sendSize = settings_.maxMessageSize;
+    if( settings_.offload && open_offload() ) {
+      //  A coalesced receive can be as big as an IP packet; a 
+      //  segmented send must fit in one.
+      recvSize = 65535;
+      sendSize = std::min( (size_t)65507, settings_.maxMessageSize * UDP_MAX_SEGMENTS );
+      sendSize = std::max( sendSize, settings_.maxMessageSize );
+    }
+    else {
+      settings_.offload = false;
+    }
+    recvBatch_ = new_batch( recvSize );
+    sendBatch_ = new_batch( sendSize );
+  }
+#else
+  settings_.offload = false;
+#endif
   if( settings->debug ) {
     OutputDebugString( "Etwork: SocketManager::open() was succesful.\n" );
   }
@@ -110,49 +229,51 @@ bool SocketManager::open( EtworkSettings * settings )
   return true;
 
 failure:
-  ::closesocket( listening_ );
+  if( !IS_SOCKET_ERROR( listening_ ) ) {
+    ::closesocket( listening_ );
+  }
   listening_ = INVALID_SOCKET;
   return false;
 }
 
-namespace {
-  struct NotifyActive {
-    std::set< ISocket * > & s_;
-    NotifyActive( std::set< ISocket * > & s ) : s_( s ) {
-    }
-    ~NotifyActive() {
-      std::set< ISocket * > tmp;
-      tmp.swap( s_ );
-      std::for_each( tmp.begin(), tmp.end(), notify );
-    }
-    static void notify( ISocket * s ) {
-      Socket * ss = static_cast< Socket * >( s );
-      if( !ss->notify_ ) {
-        //  The socket notify was removed from this socket while in-flight!
-        //  User won't really hear about this through the regular channel.
-        etwork_error_from( ss, ss->mgr_, EtworkError( ES_warning, EA_session, EO_internal_error ) );
-      }
-      else {
-        ss->notify_->onNotify();
-      }
-    }
-  };
+#if !defined( WIN32 )
+bool SocketManager::open_engine()
+{
+  epoll_ = ::epoll_create1( EPOLL_CLOEXEC );
+  if( epoll_ < 0 ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::epoll_create1()" );
+    return false;
+  }
+  if( !IS_SOCKET_ERROR( listening_ ) ) {
+    set_interest( listening_, listenInterest_, EPOLLIN );
+  }
+  if( wakeup_ >= 0 ) {
+    set_interest( wakeup_, wakeupInterest_, EPOLLIN );
+  }
+  return true;
 }
+#endif
 
 void SocketManager::timeout_sockets()
 {
-  for( SocketMap::iterator ptr = sockets_.begin(), end = sockets_.end(); ptr != end; ) {
-    Socket *cl = (*ptr).second;
+  //  Only the sockets whose deadline has come out of the wheel get
+  //  looked at. They may have been active since they were put in;
+  //  then they just go back in, with their new deadline.
+  expired_.clear();
+  wheel_.expire( curTime_, expired_ );
+  for( std::vector< Socket * >::iterator ptr = expired_.begin(), end = expired_.end(); ptr != end; ++ptr ) {
+    Socket *cl = *ptr;
     bool remove = false;
     if( settings_.timeout > 0 && cl->lastActive_ + settings_.timeout < curTime_ ) {
+      trace( ET_timeout, cl->s_, 0 );
       etwork_error_from( cl, this, EtworkError( ES_note, EA_session, EO_peer_timeout ) );
       remove = true;
     }
     else if( settings_.keepalive > 0 && cl->lastKeepalive_ + settings_.keepalive < curTime_ ) {
       //  send keepalive message
+      trace( ET_keepalive, cl->s_, 0 );
       cl->write( "", 0 );
     }
-    ++ptr;
     if( remove ) {
       cl->close_socket();
       if( cl->accepted_ ) {
@@ -164,6 +285,96 @@ void SocketManager::timeout_sockets()
         }
       }
     }
+    else if( !cl->closed_ ) {
+      schedule_timeout( cl );
+    }
+  }
+}
+
+//  Puts the socket in the wheel for whichever of its timeout and
+//  keepalive comes first.
+void SocketManager::schedule_timeout( Socket * s )
+{
+  if( settings_.timeout <= 0 && settings_.keepalive <= 0 ) {
+    return;
+  }
+  double when = 0;
+  bool any = false;
+  if( settings_.timeout > 0 ) {
+    when = s->lastActive_ + settings_.timeout;
+    any = true;
+  }
+  if( settings_.keepalive > 0 ) {
+    double ka = s->lastKeepalive_ + settings_.keepalive;
+    if( ka < curTime_ ) {
+      //  a keepalive was just queued, but hasn't gone out yet
+      ka = curTime_ + settings_.keepalive;
+    }
+    if( !any || ka < when ) {
+      when = ka;
+    }
+  }
+  wheel_.schedule( s, when );
+}
+
+//  Called from any thread, when a socket gets its first posted write.
+//  Only the writer that makes the list non-empty needs to wake poll(); 
+//  the others find it already on its way to drain_writes().
+void SocketManager::post_writer( Socket * s )
+{
+  void * head;
+  do {
+    head = atomic_load( &postedWriters_ );
+    s->cold_->nextPosted_ = (Socket *)head;
+  }
+  while( !atomic_cas( &postedWriters_, head, s ) );
+#if !defined( WIN32 )
+  if( !head && wakeup_ >= 0 ) {
+    unsigned long long one = 1;
+    if( ::write( wakeup_, &one, sizeof( one ) ) < 0 && ::WSAGetLastError() != EAGAIN ) {
+      debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::write(eventfd)" );
+    }
+  }
+#endif
+}
+
+#if !defined( WIN32 )
+//  Reset the wakeup eventfd, before draining what woke it.
+void SocketManager::take_wakeup()
+{
+  unsigned long long n;
+  if( ::read( wakeup_, &n, sizeof( n ) ) < 0 && ::WSAGetLastError() != EAGAIN ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::read(eventfd)" );
+  }
+}
+#endif
+
+//  Take the writes posted from other threads since last time. A socket 
+//  can be posted again as soon as take_posted() has emptied it, so the 
+//  link to the next one is read first.
+void SocketManager::drain_writes()
+{
+  std::vector< Socket * > held;
+  held.swap( heldWriters_ );
+  for( size_t i = 0; i < held.size(); ++i ) {
+    held[i]->cold_->heldQueued_ = false;
+  }
+  for( size_t i = 0; i < held.size(); ++i ) {
+    hold_writes( held[i] );
+  }
+  Socket * s = (Socket *)atomic_exchange( &postedWriters_, 0 );
+  while( s ) {
+    Socket * next = s->cold_->nextPosted_;
+    hold_writes( s );
+    s = next;
+  }
+}
+
+void SocketManager::hold_writes( Socket * s )
+{
+  if( s->take_posted() && !s->cold_->heldQueued_ ) {
+    s->cold_->heldQueued_ = true;
+    heldWriters_.push_back( s );
   }
 }
 
@@ -173,28 +384,46 @@ int SocketManager::poll( double seconds, ISocket ** outActive, int maxActive )
     debug_sock_error( 0, WSAEINVAL, EA_session, "SocketManager::poll() maxActive" );
     return -1;
   }
+  ++stats_.polls;
 
   memset( outActive, 0, sizeof( *outActive )*maxActive );
   active_.clear();
-  NotifyActive na( notify_ );   //  Make sure they get notified on all exit paths.
-                                //  Also, NotifyActive clears the set after notification.
+  PollTimer pt( this, seconds );
+  NotifyActive na( notify_, pt );   //  Make sure they get notified on all exit paths.
+                                    //  Also, NotifyActive clears the set after notification.
 
   //  handle timeouts
   double now = time_.seconds();
   curTime_ = now;
   timeout_sockets();
+  if( settings_.threadedWrites ) {
+    drain_writes();
+  }
+  if( resolver_.busy() || !resolver_.answers_.empty() ) {
+    finish_lookups();
+  }
 
   if( seconds < 0 ) {
     seconds = 0;
   }
 
+#if defined( WIN32 )
   //  Only write to sockets the first time I poll in a given timeout period,
   //  unless they show to have activity (making progress).
   memcpy( writeSet_, allSet_, sizeof(fd_set)+sizeof(SOCKET)*(numSocks_-FD_SETSIZE) );
+#endif
 
 again:
+#if !defined( WIN32 )
+  if( !lingering_.empty() ) {
+    reap_lingering();
+  }
+  if( pool_.returned_ && !parked_.empty() ) {
+    unpark_sockets();
+  }
+#endif
 #if defined( WIN32 )
-  if( numSocks_ == 0 ) {
+  if( numSocks_ == 0 && lookups_.empty() ) {
     //  no sockets to poll anymore -- return what we have
     std::copy( active_.begin(), active_.end(), outActive );
     return (int)active_.size();
@@ -207,7 +436,11 @@ again:
   memcpy( readSet_, allSet_, sizeof(fd_set)+sizeof(SOCKET)*(numSocks_-FD_SETSIZE) );
   memcpy( exceptSet_, allSet_, sizeof(fd_set)+sizeof(SOCKET)*(numSocks_-FD_SETSIZE) );
 #else
-#error "implement me!"
+  if( IS_SOCKET_ERROR( listening_ ) && sockets_.empty() && lookups_.empty() ) {
+    //  no sockets to poll anymore -- return what we have
+    std::copy( active_.begin(), active_.end(), outActive );
+    return (int)active_.size();
+  }
 #endif
 
   //  Calculate timeout
@@ -216,10 +449,23 @@ again:
   if( then < 0 ) {
     then = 0;
   }
+#if defined( WIN32 )
   timeval timo;
   timo.tv_sec = (int)floor( then );
   timo.tv_usec = (int)((seconds-timo.tv_sec)*1000000);
+  pt.enter( EP_wait );
   int r = ::select( (int)maxSock_, readSet_, writeSet_, exceptSet_, &timo );
+#else
+  //  Don't wait around if there is output that can go out right away.
+  //  epoll only reports the sockets that actually have activity, so 
+  //  the cost of a pass doesn't depend on how many sockets are idle.
+  int timo = writes_pending() ? 0 : (int)ceil( then * 1000 );
+  pt.enter( EP_wait );
+  int r = ::epoll_wait( epoll_, events_, (int)maxNumSocks_, timo );
+  if( r < 0 && ::WSAGetLastError() == EINTR ) {
+    r = 0;
+  }
+#endif
   // Handle error case
   if( r < 0 ) {
     debug_sock_error( 0, WSAGetLastError(), EA_session, "::select()" );
@@ -233,15 +479,25 @@ again:
     return -1;
   }
 
+  pt.enter( EP_read );
+#if defined( WIN32 )
   //  Start out assuming no sockets will be writing the next time around.
   FD_ZERO( writeTempSet_ );
+#else
+  collect_writes( r );
+#endif
   bool progress = true;
 #if defined( WIN32 )
   for( size_t i = 0; i < readSet_->fd_count; ++i ) {
     //  service read
     SOCKET s = readSet_->fd_array[i];
 #else
-#error "implement me"
+  for( int i = 0; i < r; ++i ) {
+    //  service read
+    if( !(events_[i].events & (EPOLLIN | EPOLLHUP)) ) {
+      continue;
+    }
+    SOCKET s = events_[i].data.fd;
 #endif
     if( s == listening_ ) {
       //  Listening read will also do unreliable sockets.
@@ -253,31 +509,52 @@ again:
         progress = false;
       }
     }
+#if !defined( WIN32 )
+    else if( s == wakeup_ ) {
+      //  the posted writes go out in the next pass
+      take_wakeup();
+      drain_writes();
+    }
+#endif
+    else if( s == resolver_.socket() ) {
+      resolver_.handle_read( curTime_ );
+      finish_lookups();
+    }
     else {
       //  look up the socket handler for this fd
-      SocketMap::iterator ptr = sockets_.find( s );
-      ASSERT( ptr != sockets_.end() );
-      if( ptr != sockets_.end() ) {
-        Socket * s = (*ptr).second;
+      Socket * so = sockets_.find( s );
+      ASSERT( so != 0 );
+      if( so ) {
         //  Tell the socket to put data into its message queue.
         //  Return false if it's time to exit out of the read loop.
-        if( s->wants_to_read() ) {
-          if( !s->do_read() ) {
+        //  (A connecting socket finds out how it went in write or except.)
+        if( !so->connecting_ && so->wants_to_read() ) {
+          if( !so->do_read() ) {
             if( settings_.debug ) {
               OutputDebugString( "Socket->do_read() failed.\n" );
             }
             progress = false;
           }
-          if( s->notify_ ) {
-            notify_.insert( s );
+          if( so->notify_ ) {
+            notify_.insert( so );
           }
           else {
-            active_.insert( s );
+            active_.insert( so );
           }
         }
+#if !defined( WIN32 )
+        else if( !so->connecting_ && !so->closed() ) {
+          //  epoll would keep telling me about it until it can read.
+          park( so );
+        }
+#endif
         //  this socket has activity -- give it another chance at writing
-        if( progress && s->bufOut_.space_used() > 0 && !s->closed() ) {
-          FD_SET( (*ptr).first, writeTempSet_ );
+        if( progress && so->bufOut_.space_used() > 0 && !so->closed() ) {
+#if defined( WIN32 )
+          FD_SET( s, writeTempSet_ );
+#else
+          queue_write( so );
+#endif
         }
       }
     }
@@ -287,13 +564,16 @@ again:
       }
       goto no_more_actives;
     }
-#if defined( WIN32 )
   }
+  pt.enter( EP_write );
+#if defined( WIN32 )
   for( size_t i = 0; i < writeSet_->fd_count; ++i ) {
     //  service write
     SOCKET s = writeSet_->fd_array[i];
 #else
-#error "implement me"
+  for( size_t i = 0; i < writeList_.size(); ++i ) {
+    //  service write
+    SOCKET s = writeList_[i];
 #endif
     if( s == listening_ ) {
       if( !handle_listening_write( maxActive ) ) {
@@ -304,32 +584,46 @@ again:
       }
     }
     else {
-      SocketMap::iterator ptr = sockets_.find( s );
+      Socket * so = sockets_.find( s );
       //  socket may close inside read()
-      if( ptr != sockets_.end() ) {
-        if( (*ptr).second->wants_to_write() ) {
-          if( !(*ptr).second->do_write() ) {
+      if( so ) {
+        //  do_write() may close the socket, which takes it out of sockets_
+        if( so->connecting_ ) {
+          //  writable means connected (or failed)
+          finish_connect( so );
+        }
+        if( !so->closed() && so->wants_to_write() ) {
+          if( !so->do_write() ) {
             if( settings_.debug ) {
               OutputDebugString( "Socket->do_write() failed.\n" );
             }
             progress = false;
           }
           else {
-            if( (*ptr).second->notify_ ) {
-              notify_.insert( (*ptr).second );
+            if( so->notify_ ) {
+              notify_.insert( so );
             }
             else {
-              active_.insert( (*ptr).second );
+              active_.insert( so );
             }
           }
+#if defined( WIN32 )
           //  this socket has activity -- give it another chance at writing
-          if( progress && (*ptr).second->wants_to_write() ) {
-            FD_SET( (*ptr).first, writeTempSet_ );
+          if( progress && so->wants_to_write() ) {
+            FD_SET( s, writeTempSet_ );
           }
+#endif
         }
-        //  I don't add back sockets that have writebufData_, because those
+        //  I don't add back sockets that still have output, because those
         //  mean that they are behind on their window size, so I should
         //  wait trying to ram more data down their throat anyway.
+#if !defined( WIN32 )
+        //  Instead, epoll tells me when they have caught up.
+        if( !so->closed() ) {
+          unsigned int want = so->parked_ ? 0 : (unsigned int)EPOLLIN;
+          set_interest( s, so->interest_, so->wants_to_write() ? (want | EPOLLOUT) : want );
+        }
+#endif
       }
     }
     if( active_.size() == maxActive ) {
@@ -338,13 +632,19 @@ again:
       }
       goto no_more_actives;
     }
-#if defined( WIN32 )
   }
+  pt.enter( EP_except );
+#if defined( WIN32 )
   for( size_t i = 0; i < exceptSet_->fd_count; ++i ) {
     //  service except
     SOCKET s = exceptSet_->fd_array[i];
 #else
-#error "implement me"
+  for( int i = 0; i < r; ++i ) {
+    //  service except
+    if( !(events_[i].events & EPOLLERR) ) {
+      continue;
+    }
+    SOCKET s = events_[i].data.fd;
 #endif
     if( s == listening_ ) {
       if( !handle_listening_except( maxActive ) ) {
@@ -354,21 +654,35 @@ again:
         progress = false;
       }
     }
+    else if( s == resolver_.socket() ) {
+      //  reading clears the error
+      resolver_.handle_read( curTime_ );
+    }
     else {
-      SocketMap::iterator ptr = sockets_.find( s );
+      Socket * so = sockets_.find( s );
       //  sockets may close within read()
-      if( ptr != sockets_.end() ) {
-        if( !(*ptr).second->do_except() ) {
+      if( so ) {
+#if !defined( WIN32 )
+        if( so->zeroCopy_ && !so->connecting_ && so->reap_zerocopy() ) {
+          //  Just the kernel being done with some output; nothing 
+          //  the user needs to hear about.
+          continue;
+        }
+#endif
+        if( so->connecting_ ) {
+          finish_connect( so );
+        }
+        else if( !so->do_except() ) {
           if( settings_.debug ) {
             OutputDebugString( "Socket->do_except() failed.\n" );
           }
           progress = false;
         }
-        if( (*ptr).second->notify_ ) {
-          notify_.insert( (*ptr).second );
+        if( so->notify_ ) {
+          notify_.insert( so );
         }
         else {
-          active_.insert( (*ptr).second );
+          active_.insert( so );
         }
       }
     }
@@ -378,23 +692,21 @@ again:
       }
       goto no_more_actives;
     }
-#if defined( WIN32 )
   }
-#else
-#error "implement me"
-#endif
   then = time_.seconds();
   //  If I made progress (i e, no-one spin-reading on a full buffer), then
   //  I may consider going back for seconds until the timeout runs out.
   if( then-now < seconds && progress ) {
 #if defined( WIN32 )
     memcpy( writeSet_, writeTempSet_, sizeof(((fd_set *)0)->fd_count)+sizeof(SOCKET)*numSocks_ );
-#else
-#error "implement me"
 #endif
     goto again;
   }
 no_more_actives:
+#if !defined( WIN32 )
+  //  Anything I didn't get around to writing gets tried next time.
+  requeue_writes();
+#endif
   std::copy( active_.begin(), active_.end(), outActive );
   return (int)active_.size();
 }
@@ -410,8 +722,7 @@ int SocketManager::accept( ISocket ** outAccepted, int maxAccepted )
     }
     Socket * s = accepted_.front();
     accepted_.pop_front();
-    // note that s_ is a "socket id" for unreliable sockets
-    sockets_[s->s_] = s;
+    add_socket( s );
     changed = true;
     outAccepted[i] = s;
     s->accepted_ = true;
@@ -430,38 +741,25 @@ int SocketManager::connect( char const * address, unsigned short port, ISocket *
   memset( &addr, 0, sizeof( addr ) );
   addr.sin_family = AF_INET;
   addr.sin_port = htons( port );
-  {
-    //  gethostbyname() is not thread-safe, even across instances
-    Locker ghl( gethostLock );
-    hostent * ent = gethostbyname( address );
-    if( !ent ) {
-      debug_sock_error( 0, WSAGetLastError(), EA_address, "::gethostbyname()" );
-      return -1;
-    }
-    memcpy( &addr.sin_addr, ent->h_addr_list[0], sizeof(addr.sin_addr) );
+  int found = resolve( address, &addr.sin_addr );
+  if( found < 0 ) {
+    return -1;
   }
 
-  SOCKET s;
-  if( settings_.reliable ) {
-    s = ::socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
-    if( IS_SOCKET_ERROR( s ) ) {
-      debug_sock_error( 0, WSAGetLastError(), EA_connect, "::socket(AF_INET)" );
-      return -1;
+  SOCKET s = listening_;
+  bool connecting = false;
+  if( found == 0 ) {
+    //  The socket gets made once the name server has answered.
+    connecting = true;
+    if( settings_.reliable ) {
+      s = INVALID_SOCKET;
     }
-    int r = ::connect( s, (sockaddr const *)&addr, (int)sizeof( addr ) );
-    if( r < 0 ) {
-      debug_sock_error( 0, WSAGetLastError(), EA_connect, "::connect()" );
-      ::closesocket( s );
+  }
+  else if( settings_.reliable ) {
+    s = open_connection( addr, connecting );
+    if( IS_SOCKET_ERROR( s ) ) {
       return -1;
     }
-    int one = 1;
-    r = ::setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (char const *)&one, sizeof( one ) );
-    if( r < 0 ) {
-      debug_sock_error( 0, WSAGetLastError(), EA_connect, "::setsockopt(TCP_NODELAY)" );
-    }
-  }
-  else {
-    s = listening_;
   }
   //  @TODO: There is a potential race here, where we may have a socket 
   //  waiting inside accepting_ but not yet accepted, yet the client 
@@ -469,37 +767,234 @@ int SocketManager::connect( char const * address, unsigned short port, ISocket *
   //  accepted socket? Delete the accepted socket? (that might lead to 
   //  live-lock if we're unlucky)
   Socket * so = new Socket( this, s, addr );
-  //  note that s_ is a "socket id" for unreliable sockets
-  sockets_[so->s_] = so;
+  so->connecting_ = connecting;
+  so->resolving_ = (found == 0);
+  trace( ET_connect, so->s_, connecting ? 1 : 0 );
   *outConnected = so;
   so->accepted_ = true;
+  if( so->resolving_ ) {
+    lookups_.insert( LookupMap::value_type( Resolver::make_key( address ), so ) );
+  }
+  if( !so->resolving_ || !settings_.reliable ) {
+    add_socket( so );
+  }
   regenerate_sets();
   if( !settings_.reliable ) {
     //  gotta make sure that we can find this socket again
-    socketAddrs_[addr] = so;
+    if( !so->resolving_ ) {
+      socketAddrs_.insert( addr, so );
+    }
     so->write( "", 0 ); //  send an empty packet to establish a connection
   }
   return 1;
 }
 
+//  Make a TCP socket and connect it to 'addr'. With asyncConnect, 
+//  'connecting' comes back true if poll() will have to finish the job.
+SOCKET SocketManager::open_connection( sockaddr_in const & addr, bool & connecting )
+{
+  connecting = false;
+  SOCKET s = ::socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+  if( IS_SOCKET_ERROR( s ) ) {
+    debug_sock_error( 0, WSAGetLastError(), EA_connect, "::socket(AF_INET)" );
+    return INVALID_SOCKET;
+  }
+  //  With asyncConnect, the socket goes non-blocking before connecting, 
+  //  and poll() finds out how it went.
+  if( settings_.asyncConnect && !make_nonblocking( s, EA_connect ) ) {
+    ::closesocket( s );
+    return INVALID_SOCKET;
+  }
+  int r = ::connect( s, (sockaddr const *)&addr, (int)sizeof( addr ) );
+  if( r < 0 ) {
+    int err = WSAGetLastError();
+    if( settings_.asyncConnect && (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS) ) {
+      connecting = true;
+    }
+    else {
+      debug_sock_error( 0, err, EA_connect, "::connect()" );
+      ::closesocket( s );
+      return INVALID_SOCKET;
+    }
+  }
+  int one = 1;
+  r = ::setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (char const *)&one, sizeof( one ) );
+  if( r < 0 ) {
+    debug_sock_error( 0, WSAGetLastError(), EA_connect, "::setsockopt(TCP_NODELAY)" );
+  }
+#if !defined( WIN32 )
+  if( !settings_.asyncConnect && !make_nonblocking( s, EA_connect ) ) {
+    ::closesocket( s );
+    return INVALID_SOCKET;
+  }
+#endif
+  return s;
+}
+
+//  Turn a host name (or dotted address) into an address. Returns 1 if 
+//  the address is known, -1 if there is none, and 0 if (with 
+//  asyncConnect) the name server has been asked, and poll() will take 
+//  it from there.
+int SocketManager::resolve( char const * address, in_addr * out )
+{
+  unsigned long a = ::inet_addr( address );
+  if( a != INADDR_NONE || !strcmp( address, "255.255.255.255" ) ) {
+    out->s_addr = a;
+    return 1;
+  }
+  if( !resolver_.is_open() && !open_resolver() ) {
+    //  No name server to talk to; do it the old way.
+    //  gethostbyname() is not thread-safe, even across instances
+    Locker ghl( gethostLock );
+    hostent * ent = gethostbyname( address );
+    if( !ent ) {
+      debug_sock_error( 0, WSAGetLastError(), EA_address, "::gethostbyname()" );
+      return -1;
+    }
+    memcpy( out, ent->h_addr_list[0], sizeof( *out ) );
+    return 1;
+  }
+  int r = resolver_.lookup( address, out, time_.seconds() );
+  if( r == 0 && !settings_.asyncConnect ) {
+    r = resolver_.wait( address, out, time_ );
+  }
+  if( r < 0 ) {
+    etwork_error_from( 0, this, EtworkError( ES_error, EA_address, EO_bad_address ) );
+  }
+  return r;
+}
+
+bool SocketManager::open_resolver()
+{
+  if( !resolver_.open() ) {
+    return false;
+  }
+#if !defined( WIN32 )
+  set_interest( resolver_.socket(), resolverInterest_, EPOLLIN );
+#endif
+  regenerate_sets();
+  return true;
+}
+
+//  Hand the answers the resolver has gotten since last time to the 
+//  sockets that are waiting for them.
+void SocketManager::finish_lookups()
+{
+  resolver_.handle_timeouts( curTime_ );
+  std::vector< Resolver::Answer > answers;
+  answers.swap( resolver_.answers_ );
+  for( size_t i = 0; i < answers.size(); ++i ) {
+    Resolver::Answer & a = answers[i];
+    std::pair< LookupMap::iterator, LookupMap::iterator > range = lookups_.equal_range( a.name_ );
+    std::vector< Socket * > waiting;
+    for( LookupMap::iterator ptr = range.first; ptr != range.second; ++ptr ) {
+      waiting.push_back( (*ptr).second );
+    }
+    lookups_.erase( range.first, range.second );
+    for( size_t j = 0; j < waiting.size(); ++j ) {
+      resolved( waiting[j], a.found_ ? &a.addr_ : 0 );
+    }
+  }
+}
+
+//  The name server has answered for a socket that connect() returned 
+//  before knowing the address. Connect it for real (or fail it), and 
+//  let the user know through the active list.
+void SocketManager::resolved( Socket * s, in_addr const * addr )
+{
+  s->resolving_ = false;
+  if( !addr ) {
+    etwork_error_from( s, this, EtworkError( ES_error, EA_address, EO_bad_address ) );
+    s->connecting_ = false;
+    if( settings_.reliable ) {
+      s->closed_ = true;  //  it never got a socket to close
+    }
+    else {
+      s->close_socket();
+    }
+  }
+  else {
+    s->addr_.sin_addr = *addr;
+    if( settings_.reliable ) {
+      bool connecting = false;
+      SOCKET so = open_connection( s->addr_, connecting );
+      s->connecting_ = connecting;
+      if( IS_SOCKET_ERROR( so ) ) {
+        s->closed_ = true;
+      }
+      else {
+        s->s_ = so;
+        add_socket( s );
+        regenerate_sets();
+        if( connecting ) {
+          return;   //  finish_connect() will make it active
+        }
+        trace( ET_connect, so, 0 );
+        if( s->wants_to_write() ) {
+          queue_write( s );
+        }
+      }
+    }
+    else {
+      s->connecting_ = false;
+      socketAddrs_.insert( s->addr_, s );
+      trace( ET_connect, s->s_, 0 );
+      if( s->wants_to_write() ) {
+        queue_write( s );
+      }
+    }
+  }
+  if( s->notify_ ) {
+    notify_.insert( s );
+  }
+  else {
+    active_.insert( s );
+  }
+}
+
+void SocketManager::stats( EtworkStats * out )
+{
+  *out = stats_;
+  out->queueMemory = pool_.lent_;
+  out->queueMemoryHigh = pool_.lentHigh_;
+}
+
+int SocketManager::histograms( EtworkHistogram * out, int maxOut, bool reset )
+{
+  if( !hist_ ) {
+    return -1;
+  }
+  int n = maxOut < EP_count ? maxOut : EP_count;
+  if( n > 0 ) {
+    memcpy( out, hist_, sizeof( EtworkHistogram ) * n );
+  }
+  if( reset ) {
+    memset( hist_, 0, sizeof( EtworkHistogram ) * EP_count );
+  }
+  return n > 0 ? n : 0;
+}
+
 void SocketManager::dispose()
 {
+  if( errors_ ) {
+    drain_errors( 0 );
+  }
   if( sockets_.size() ) {
     char buf[2048];
-    _snprintf( buf, 2048, "Etwork: SocketManager::dispose() sees %d active sockets.\n", sockets_.size() );
+    _snprintf( buf, 2048, "Etwork: SocketManager::dispose() sees %d active sockets.\n", (int)sockets_.size() );
     buf[2047] = 0;
     OutputDebugString( buf );
     if( settings_.debug ) {
-      __asm { int 3 }
+      DEBUG_BREAK();
     }
   }
   if( accepted_.size() ) {
     char buf[2048];
-    _snprintf( buf, 2048, "Etwork: SocketManager::dispose() sees %d sockets pending accept.\n", accepted_.size() );
+    _snprintf( buf, 2048, "Etwork: SocketManager::dispose() sees %d sockets pending accept.\n", (int)accepted_.size() );
     buf[2047] = 0;
     OutputDebugString( buf );
     if( settings_.debug ) {
-      __asm { int 3 }
+      DEBUG_BREAK();
     }
   }
   delete this;
@@ -510,39 +1005,114 @@ void SocketManager::debug_sock_error( ISocket * sock, int err, ErrorArea area, c
   wsa_error_from( sock, this, err, area );
 }
 
-void SocketManager::remove_socket( Socket * s )
+bool SocketManager::make_nonblocking( SOCKET s, ErrorArea area )
 {
-  socketAddrs_.erase( s->addr_ );
-  SocketMap::iterator ptr = sockets_.find( s->s_ );
-  if( ptr != sockets_.end() ) {
-    sockets_.erase( ptr );
-    if( settings_.reliable ) {
-      regenerate_sets();
-    }
-    return;
-  }
-  std::deque< Socket * >::iterator q = std::find( accepted_.begin(), accepted_.end(), s );
-  if( q != accepted_.end() ) {
-    accepted_.erase( q );
-    return;
+  u_long nonblock = 1;
+  int r = ::ioctlsocket( s, FIONBIO, &nonblock );
+  if( r < 0 ) {
+    debug_sock_error( 0, ::WSAGetLastError(), area, "::ioctlsocket(FIONBIO)" );
+    return false;
   }
-  ASSERT( !"Socket not found in SocketManager::remove_socket()" );
+  return true;
 }
 
-//  The theory behind regenerate_sets() is that it's more efficient 
-//  to create the socket read/write/exception fd_set once, and keep 
-//  it around, than having to scrape through all the individual 
-//  socket descriptors to generate the set. However, it turns out 
-//  that, during typical usage, you'll scrape through most of them 
-//  anyway (post-receive), so it's not exactly a big win.
-//  However: it's tested, it works, it stays until it becomes a 
-//  problem.
+void SocketManager::add_socket( Socket * s )
+{
+  //  note that s_ is a "socket id" for unreliable sockets
+  sockets_.insert( s->s_, s );
+  schedule_timeout( s );
+#if !defined( WIN32 )
+  if( settings_.reliable ) {
+    if( settings_.zerocopy && !s->zeroCopy_ ) {
+      int one = 1;
+      if( ::setsockopt( s->s_, SOL_SOCKET, SO_ZEROCOPY, (char const *)&one, sizeof(one) ) < 0 ) {
+        //  Old kernel; the socket just sends the usual way.
+        debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::setsockopt(SO_ZEROCOPY)" );
+      }
+      else {
+        s->zeroCopy_ = true;
+      }
+    }
+    //  A connecting socket hears about the connection through EPOLLOUT.
+    if( s->connecting_ ) {
+      s->interest_ |= EPOLLOUT;
+    }
+    unsigned int cur = 0;
+    set_interest( s->s_, cur, s->interest_ );
+  }
+#endif
+}
+
+void SocketManager::remove_socket( Socket * s )
+{
+  wheel_.cancel( s );
+  if( s->resolving_ ) {
+    //  The answer may still come; nobody will be waiting for it.
+    s->resolving_ = false;
+    for( LookupMap::iterator ptr = lookups_.begin(); ptr != lookups_.end(); ++ptr ) {
+      if( (*ptr).second == s ) {
+        lookups_.erase( ptr );
+        break;
+      }
+    }
+    if( settings_.reliable ) {
+      return;   //  it's nowhere else yet
+    }
+  }
+  else {
+    socketAddrs_.erase( s->addr_ );
+  }
+#if !defined( WIN32 )
+  if( s->writeQueued_ ) {
+    writers_.erase( std::find( writers_.begin(), writers_.end(), s ) );
+    s->writeQueued_ = false;
+  }
+  if( s->parked_ ) {
+    parked_.erase( std::find( parked_.begin(), parked_.end(), s ) );
+    s->parked_ = false;
+  }
+#endif
+  if( !settings_.reliable ) {
+    freeIds_.push_back( s->s_ );
+  }
+  if( sockets_.erase( s->s_ ) ) {
+    if( settings_.reliable ) {
+#if !defined( WIN32 )
+      set_interest( s->s_, s->interest_, 0 );
+#endif
+      regenerate_sets();
+    }
+    return;
+  }
+  std::deque< Socket * >::iterator q = std::find( accepted_.begin(), accepted_.end(), s );
+  if( q != accepted_.end() ) {
+    accepted_.erase( q );
+    return;
+  }
+  ASSERT( !"Socket not found in SocketManager::remove_socket()" );
+}
+
+//  The theory behind regenerate_sets() is that it's more efficient 
+//  to create the socket read/write/exception fd_set once, and keep 
+//  it around, than having to scrape through all the individual 
+//  socket descriptors to generate the set. However, it turns out 
+//  that, during typical usage, you'll scrape through most of them 
+//  anyway (post-receive), so it's not exactly a big win.
+//  However: it's tested, it works, it stays until it becomes a 
+//  problem.
+//
+//  With epoll, the kernel keeps the interest set, and sockets are added 
+//  and removed one at a time in add_socket() and remove_socket() instead.
 void SocketManager::regenerate_sets()
 {
+#if defined( WIN32 )
   size_t needed = sockets_.size() + 1; // for listening
   if( !settings_.reliable ) {
     needed = 1;
   }
+  if( resolver_.is_open() ) {
+    ++needed;   //  for the name server
+  }
   maxSock_ = 0;
   if( needed > maxNumSocks_ ) {
     maxNumSocks_ = (size_t)(needed * 1.5 + 10);
@@ -551,7 +1121,6 @@ void SocketManager::regenerate_sets()
     ::operator delete( writeSet_ );
     ::operator delete( writeTempSet_ );
     ::operator delete( exceptSet_ );
-#if defined( WIN32 )
     fd_set * nu = (fd_set *)::operator new( sizeof( fd_set ) + sizeof(SOCKET)*(maxNumSocks_-FD_SETSIZE) );
     FD_ZERO( nu );
     allSet_ = nu;
@@ -567,9 +1136,6 @@ void SocketManager::regenerate_sets()
     nu = (fd_set *)::operator new( sizeof( fd_set ) + sizeof(SOCKET)*(maxNumSocks_-FD_SETSIZE) );
     FD_ZERO( nu );
     exceptSet_ = nu;
-#else
-#error "implement me!"
-#endif
   }
   numSocks_ = needed-1;
   FD_ZERO( allSet_ );
@@ -581,21 +1147,289 @@ void SocketManager::regenerate_sets()
     }
   }
   if( settings_.reliable ) {
-    SocketMap::iterator ptr = sockets_.begin(), end = sockets_.end();
-    while( ptr != end ) {
-      FD_SET( (*ptr).first, allSet_ );
-      if( (*ptr).first > maxSock_ ) {
-        maxSock_ = (*ptr).first;
+    for( size_t i = 0, n = sockets_.size(); i != n; ++i ) {
+      SOCKET s = sockets_.at( i )->s_;
+      FD_SET( s, allSet_ );
+      if( s > maxSock_ ) {
+        maxSock_ = s;
+      }
+    }
+  }
+  if( resolver_.is_open() ) {
+    FD_SET( resolver_.socket(), allSet_ );
+    if( resolver_.socket() > maxSock_ ) {
+      maxSock_ = resolver_.socket();
+    }
+  }
+#endif
+}
+
+void SocketManager::queue_write( Socket * s )
+{
+#if !defined( WIN32 )
+  //  Sockets that are waiting for EPOLLOUT will hear about it from epoll.
+  //  Unreliable sockets all write through listening_, so they always queue.
+  //  Sockets that are still connecting get queued once they're done.
+  if( s->writeQueued_ || s->connecting_ || (settings_.reliable && (s->interest_ & EPOLLOUT)) ) {
+    return;
+  }
+  s->writeQueued_ = true;
+  writers_.push_back( s );
+#endif
+}
+
+#if !defined( WIN32 )
+bool SocketManager::writes_pending()
+{
+  if( settings_.reliable ) {
+    return !writers_.empty();
+  }
+  return (!writers_.empty() || sendDone_ < sendCount_) && !(listenInterest_ & EPOLLOUT);
+}
+
+//  Turn on UDP_SEGMENT and UDP_GRO for the listening socket. Returns 
+//  false if the kernel doesn't do them, in which case datagrams are 
+//  sent and received one at a time.
+bool SocketManager::open_offload()
+{
+  int zero = 0;
+  int one = 1;
+  if( ::setsockopt( listening_, SOL_UDP, UDP_SEGMENT, (char const *)&zero, sizeof(zero) ) < 0
+      || ::setsockopt( listening_, SOL_UDP, UDP_GRO, (char const *)&one, sizeof(one) ) < 0 ) {
+    etwork_log( 0, ES_note, "UDP segmentation offload is not available (%s); not using it.", 
+        get_error_string( ::WSAGetLastError() ).c_str() );
+    return false;
+  }
+  return true;
+}
+
+//  Move the next message from s into sendBatch_. With offload, a message 
+//  the same size as the one before it, to the same peer, goes in the same 
+//  slot; so can one shorter message, which ends the run. Returns false, 
+//  with nothing taken from s, if the batch is full and won't go out.
+bool SocketManager::batch_message( Socket * s )
+{
+  if( sendCount_ == UDP_BATCH && !send_datagrams() ) {
+    return false;
+  }
+  DatagramBatch * b = sendBatch_;
+  size_t n = sendCount_;
+  if( settings_.offload && n > sendDone_ ) {
+    size_t p = n-1;
+    iovec & v = b->iov_[p];
+    if( b->segOpen_[p] && b->addr_[p] == s->addr_ && b->segCount_[p] < UDP_MAX_SEGMENTS
+        && v.iov_len + settings_.maxMessageSize <= b->size_ ) {
+      int r = s->bufOut_.get_message( (char *)v.iov_base + v.iov_len, settings_.maxMessageSize );
+      ASSERT( r >= 0 || !"impossible message accepted in s->bufOut_" );
+      if( r <= b->segSize_[p] && r > 0 ) {
+        v.iov_len += r;
+        b->segCount_[p]++;
+        b->segOpen_[p] = (r == b->segSize_[p]);
+        //  tell the kernel where to cut
+        msghdr & h = b->msgs_[p].msg_hdr;
+        h.msg_control = b->ctrl_[p];
+        h.msg_controllen = CMSG_SPACE( sizeof( unsigned short ) );
+        cmsghdr * c = CMSG_FIRSTHDR( &h );
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN( sizeof( unsigned short ) );
+        memcpy( CMSG_DATA( c ), &b->segSize_[p], sizeof( unsigned short ) );
+        return true;
+      }
+      //  It doesn't fit the run; it starts the next slot.
+      b->segOpen_[p] = false;
+      memcpy( b->iov_[n].iov_base, (char *)v.iov_base + v.iov_len, r );
+      b->iov_[n].iov_len = r;
+    }
+    else {
+      b->iov_[n].iov_len = s->bufOut_.get_message( b->iov_[n].iov_base, settings_.maxMessageSize );
+    }
+  }
+  else {
+    b->iov_[n].iov_len = s->bufOut_.get_message( b->iov_[n].iov_base, settings_.maxMessageSize );
+  }
+  ASSERT( (int)b->iov_[n].iov_len >= 0 || !"impossible message accepted in s->bufOut_" );
+  b->addr_[n] = s->addr_;
+  b->msgs_[n].msg_hdr.msg_control = 0;
+  b->msgs_[n].msg_hdr.msg_controllen = 0;
+  b->segSize_[n] = (unsigned short)b->iov_[n].iov_len;
+  b->segCount_[n] = 1;
+  //  empty datagrams are keepalives/greetings; don't glue those together
+  b->segOpen_[n] = b->iov_[n].iov_len > 0;
+  ++sendCount_;
+  return true;
+}
+
+//  Send what has been batched up in sendBatch_. Returns false, with the 
+//  error in WSAGetLastError(), if the socket wouldn't take all of it; 
+//  the rest stays batched for next time.
+bool SocketManager::send_datagrams()
+{
+  while( sendDone_ < sendCount_ ) {
+    int r = ::sendmmsg( listening_, &sendBatch_->msgs_[sendDone_], (unsigned int)(sendCount_-sendDone_), 0 );
+    if( r < 0 ) {
+      if( ::WSAGetLastError() != WSAEWOULDBLOCK ) {
+        //  The error is for the first datagram; don't get stuck on it.
+        ++sendDone_;
       }
-      ++ptr;
+      return false;
+    }
+    sendDone_ += r;
+  }
+  sendCount_ = 0;
+  sendDone_ = 0;
+  return true;
+}
+
+SocketManager::DatagramBatch * SocketManager::new_batch( size_t size )
+{
+  DatagramBatch * b = new DatagramBatch;
+  memset( b, 0, sizeof( *b ) );
+  b->size_ = size;
+  b->data_ = new char[ UDP_BATCH * size ];
+  for( int i = 0; i < UDP_BATCH; ++i ) {
+    b->iov_[i].iov_base = b->data_ + i * size;
+    b->iov_[i].iov_len = size;
+    b->msgs_[i].msg_hdr.msg_iov = &b->iov_[i];
+    b->msgs_[i].msg_hdr.msg_iovlen = 1;
+    b->msgs_[i].msg_hdr.msg_name = &b->addr_[i];
+    b->msgs_[i].msg_hdr.msg_namelen = sizeof( b->addr_[i] );
+  }
+  return b;
+}
+
+void SocketManager::delete_batch( DatagramBatch * b )
+{
+  if( b ) {
+    delete[] b->data_;
+    delete b;
+  }
+}
+
+//  Build the list of sockets to write to this pass: the ones that epoll 
+//  says have caught up, plus the ones that queued output since last time.
+void SocketManager::collect_writes( int numEvents )
+{
+  writeList_.clear();
+  for( int i = 0; i < numEvents; ++i ) {
+    if( events_[i].events & EPOLLOUT ) {
+      writeList_.push_back( events_[i].data.fd );
+    }
+  }
+  if( settings_.reliable ) {
+    for( size_t i = 0, n = writers_.size(); i < n; ++i ) {
+      writers_[i]->writeQueued_ = false;
+      writeList_.push_back( writers_[i]->s_ );
+    }
+    writers_.clear();
+  }
+  else if( writes_pending() ) {
+    //  handle_listening_write() drains writers_ itself
+    writeList_.push_back( listening_ );
+  }
+}
+
+void SocketManager::requeue_writes()
+{
+  if( !settings_.reliable ) {
+    return;
+  }
+  for( size_t i = 0, n = writeList_.size(); i < n; ++i ) {
+    Socket * s = sockets_.find( writeList_[i] );
+    if( s && s->wants_to_write() ) {
+      queue_write( s );
+    }
+  }
+  writeList_.clear();
+}
+
+//  A parked socket isn't read from until unpark() finds that it can 
+//  take input again; the user's read() and consume() try it, and so 
+//  does poll(), for all of them, when pool_ has had memory back.
+void SocketManager::park( Socket * s )
+{
+  if( s->parked_ || !settings_.reliable ) {
+    return;
+  }
+  s->parked_ = true;
+  parked_.push_back( s );
+  stop_reading( s );
+}
+
+void SocketManager::unpark( Socket * s )
+{
+  if( !s->parked_ || !s->wants_to_read() ) {
+    return;
+  }
+  s->parked_ = false;
+  parked_.erase( std::find( parked_.begin(), parked_.end(), s ) );
+  if( !s->closed() ) {
+    start_reading( s );
+  }
+}
+
+void SocketManager::unpark_sockets()
+{
+  pool_.returned_ = false;
+  for( size_t i = 0; i < parked_.size(); ) {
+    Socket * s = parked_[i];
+    if( !s->wants_to_read() ) {
+      ++i;
+      continue;
     }
+    s->parked_ = false;
+    parked_[i] = parked_.back();
+    parked_.pop_back();
+    start_reading( s );
   }
 }
 
+void SocketManager::stop_reading( Socket * s )
+{
+  set_interest( s->s_, s->interest_, s->interest_ & ~EPOLLIN );
+}
+
+void SocketManager::start_reading( Socket * s )
+{
+  set_interest( s->s_, s->interest_, s->interest_ | EPOLLIN );
+}
+
+void SocketManager::set_interest( SOCKET s, unsigned int & cur, unsigned int want )
+{
+  //  Engines that don't use epoll never open it.
+  if( cur == want || epoll_ < 0 ) {
+    return;
+  }
+  epoll_event ev;
+  memset( &ev, 0, sizeof( ev ) );
+  ev.events = want;
+  ev.data.fd = s;
+  int op = EPOLL_CTL_MOD;
+  if( !cur ) {
+    op = EPOLL_CTL_ADD;
+  }
+  else if( !want ) {
+    op = EPOLL_CTL_DEL;
+  }
+  int r = ::epoll_ctl( epoll_, op, s, &ev );
+  if( r < 0 ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::epoll_ctl()" );
+    return;
+  }
+  cur = want;
+}
+#endif
+
 //  mint a "socket id" which can be used to identify an
 //  unreliable socket.
 SOCKET SocketManager::socket_id()
 {
+  //  Ids of closed sockets go first, to keep sockets_ dense.
+  if( freeIds_.size() ) {
+    SOCKET ret = freeIds_.back();
+    freeIds_.pop_back();
+    return ret;
+  }
   SOCKET ret;
 again:
   ret = (SOCKET)nextSocket_;
@@ -603,7 +1437,7 @@ again:
   if( !nextSocket_ ) {
     ++nextSocket_;
   }
-  if( ret == listening_ || sockets_.find( ret ) != sockets_.end() ) {
+  if( ret == listening_ || sockets_.find( ret ) ) {
     goto again;
   }
   return ret;
@@ -613,9 +1447,9 @@ again:
 bool SocketManager::handle_listening_except( size_t maxActive )
 {
   int error = 0;
-  int errorsize = sizeof( error );
+  SOCKLEN errorsize = sizeof( error );
   int r = ::getsockopt( listening_, SOL_SOCKET, SO_ERROR, (char *)&error, &errorsize );
-  ASSERT( r == 4 || !"getsockopt() on listening_ SO_ERROR failed" );
+  ASSERT( r == 0 || !"getsockopt() on listening_ SO_ERROR failed" );
   debug_sock_error( 0, error, EA_session, "SocketManager::handle_listening_except() getsockopt() SO_ERROR" );
   //  This means either that the listening socket has an issue,
   //  or that I'm unreliable and some send failed.
@@ -635,7 +1469,7 @@ bool SocketManager::handle_listening_read( size_t maxActive )
   if( settings_.reliable ) {
     //  If I'm reliable, this means I should accept().
     sockaddr_in addr;
-    int alen = sizeof( addr );
+    SOCKLEN alen = sizeof( addr );
     SOCKET so = ::accept( listening_, (sockaddr *)&addr, &alen );
     if( IS_SOCKET_ERROR( so ) ) {
       debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::accept()" );
@@ -643,53 +1477,90 @@ bool SocketManager::handle_listening_read( size_t maxActive )
     }
     int one = 1;
     int r = ::setsockopt( so, IPPROTO_TCP, TCP_NODELAY, (char const *)&one, sizeof(one) );
+#if !defined( WIN32 )
+    if( !make_nonblocking( so, EA_connect ) ) {
+      ::closesocket( so );
+      return false;
+    }
+#endif
     Socket * s = new Socket( this, so, addr );
     accepted_.push_back( s );
+    trace( ET_accept, so, 0 );
   }
   else {
+#if defined( WIN32 )
     //  If I'm unreliable, it means that I should recvfrom().
     while( true ) {
+      //  Each datagram may make one more socket active; what there is 
+      //  no room to report stays in the kernel until next time.
+      if( active_.size() >= maxActive ) {
+        return true;
+      }
       sockaddr_in addr;
-      int alen = sizeof( addr );
+      SOCKLEN alen = sizeof( addr );
       int r = ::recvfrom( listening_, tmpBuffer_, (int)settings_.maxMessageSize, 0, (sockaddr *)&addr, &alen );
       if( r < 0 ) {
         break;
       }
-      AddressMap::iterator ptr = socketAddrs_.find( addr );
-      Socket * s = 0;
-      if( ptr == socketAddrs_.end() ) {
-        if( settings_.accepting ) { //  only accept new clients if "accepting" is true
-          //  a new unreliable socket
-          s = new Socket( this, 0, addr );
-          accepted_.push_back( s );
-          socketAddrs_[addr] = s;
-          //   Special case: write an empty packet to acknowledge connection.
-          //   This acknowledgement may not actually get there, of course.
-          int w = ::sendto( listening_, "", 0, 0, (sockaddr const *)&addr, sizeof(addr) );
-          if( w < 0 ) {
-            debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::sendto() during accept()" );
-          }
+      handle_datagram( addr, 0, tmpBuffer_, r );
+    }
+#else
+    //  If I'm unreliable, it means that I should recvmmsg(), which 
+    //  takes up to UDP_BATCH datagrams per call.
+    DatagramBatch * b = recvBatch_;
+    while( true ) {
+      //  Each datagram may make one more socket active; what there is 
+      //  no room to report stays in the kernel until next time.
+      if( active_.size() >= maxActive ) {
+        return true;
+      }
+      int want = (int)std::min( maxActive - active_.size(), (size_t)UDP_BATCH );
+      for( int i = 0; i < want; ++i ) {
+        b->msgs_[i].msg_hdr.msg_namelen = sizeof( b->addr_[i] );
+        if( settings_.offload ) {
+          b->msgs_[i].msg_hdr.msg_control = b->ctrl_[i];
+          b->msgs_[i].msg_hdr.msg_controllen = sizeof( b->ctrl_[i] );
         }
-        //  else just drop it on the floor -- we didn't ask for it!
-        continue;
       }
-      else {
-        s = (*ptr).second;
-        if( s->accepted_ ) {
-          if( s->notify_ ) {
-            notify_.insert( s );
+      int r = ::recvmmsg( listening_, b->msgs_, want, 0, 0 );
+      if( r < 0 ) {
+        break;
+      }
+      Socket * socks[UDP_BATCH];
+      socketAddrs_.find_batch( b->addr_, r, socks );
+      for( int i = 0; i < r; ++i ) {
+        char const * data = (char const *)b->iov_[i].iov_base;
+        int size = (int)b->msgs_[i].msg_len;
+        int seg = size;
+        if( settings_.offload ) {
+          //  With UDP_GRO, the kernel may have glued together several 
+          //  datagrams from the same peer, all of them seg bytes except 
+          //  (maybe) the last one.
+          msghdr * h = &b->msgs_[i].msg_hdr;
+          for( cmsghdr * c = CMSG_FIRSTHDR( h ); c != 0; c = CMSG_NXTHDR( h, c ) ) {
+            if( c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO ) {
+              memcpy( &seg, CMSG_DATA( c ), sizeof( seg ) );
+            }
           }
-          else {
-            active_.insert( s );
+          if( seg <= 0 ) {
+            seg = size;
           }
-          s->lastActive_ = curTime_;
         }
+        do {
+          int n = std::min( seg, size );
+          handle_datagram( b->addr_[i], socks[i], data, n );
+          data += n;
+          size -= n;
+        }
+        while( size > 0 );
       }
-      int p = s->bufIn_.put_message( tmpBuffer_, r );
-      if( p < 0 ) {
-        etwork_error_from( s->accepted_ ? s : 0, this, EtworkError( ES_warning, EA_session, EO_buffer_full ) );
+      if( r < want ) {
+        //  A short batch means the input is drained; epoll will say 
+        //  if anything more arrived, so don't ask for the EWOULDBLOCK.
+        return true;
       }
     }
+#endif
     //  Unreliable receive always ends in an error (although it may just be wouldblock).
     int error = ::WSAGetLastError();
     switch( error ) {
@@ -705,6 +1576,76 @@ bool SocketManager::handle_listening_read( size_t maxActive )
   return true;
 }
 
+//  A non-blocking connect() is done, one way or the other. Either way, 
+//  the socket goes on the active list so the user hears about it.
+void SocketManager::finish_connect( Socket * s )
+{
+  int error = 0;
+  SOCKLEN optlen = sizeof( error );
+  int r = ::getsockopt( s->s_, SOL_SOCKET, SO_ERROR, (char *)&error, &optlen );
+  if( r < 0 ) {
+    error = WSAGetLastError();
+  }
+  s->connecting_ = false;
+  if( error != 0 ) {
+    debug_sock_error( s, error, EA_connect, "::connect()" );
+    s->close_socket();
+  }
+  else {
+    s->lastActive_ = curTime_;
+    trace( ET_connect, s->s_, 0 );
+  }
+  if( s->notify_ ) {
+    notify_.insert( s );
+  }
+  else {
+    active_.insert( s );
+  }
+}
+
+//  's' is the socket for 'addr' if the caller already looked it up.
+void SocketManager::handle_datagram( sockaddr_in const & addr, Socket * s, char const * data, int size )
+{
+  if( !s ) {
+    //  (It may also have been accepted since the caller looked.)
+    s = socketAddrs_.find( addr );
+  }
+  if( !s ) {
+    if( settings_.accepting ) { //  only accept new clients if "accepting" is true
+      //  a new unreliable socket
+      s = new Socket( this, 0, addr );
+      accepted_.push_back( s );
+      trace( ET_accept, s->s_, 0 );
+      socketAddrs_.insert( addr, s );
+      //   Special case: write an empty packet to acknowledge connection.
+      //   This acknowledgement may not actually get there, of course.
+      int w = ::sendto( listening_, "", 0, 0, (sockaddr const *)&addr, sizeof(addr) );
+      if( w < 0 ) {
+        debug_sock_error( 0, ::WSAGetLastError(), EA_session, "::sendto() during accept()" );
+      }
+    }
+    //  else just drop it on the floor -- we didn't ask for it!
+    return;
+  }
+  else {
+    if( s->accepted_ ) {
+      if( s->notify_ ) {
+        notify_.insert( s );
+      }
+      else {
+        active_.insert( s );
+      }
+      s->lastActive_ = curTime_;
+    }
+  }
+  int p = s->bufIn_.put_message( data, size );
+  s->count_input( size, p < 0 ? 0 : 1 );
+  if( p < 0 ) {
+    s->count_drop();
+    etwork_error_from( s->accepted_ ? s : 0, this, EtworkError( ES_warning, EA_session, EO_buffer_full ) );
+  }
+}
+
 bool SocketManager::handle_listening_write( size_t maxActive )
 {
   //  If I'm reliable, what does this mean?
@@ -714,10 +1655,39 @@ bool SocketManager::handle_listening_write( size_t maxActive )
   }
   //  If I'm unreliable, it means that I should sendto().
   //  But from whom?
-  for( SocketMap::iterator ptr = sockets_.begin(), end = sockets_.end();
-      ptr != end; ++ptr ) {
-    Socket * s = (*ptr).second;
+#if defined( WIN32 )
+  for( size_t i = 0, n = sockets_.size(); i != n; ++i ) {
+    Socket * s = sockets_.at( i );
+    //  a socket that is still resolving has no address to send to yet
+    if( s->connecting_ ) {
+      continue;
+    }
+#else
+  //  Only the sockets that queued something since last time.
+  std::vector< Socket * > writers;
+  writers.swap( writers_ );
+  size_t i = 0;
+  //  Whatever didn't go out last time goes first.
+  if( !send_datagrams() ) {
+    goto error_writing;
+  }
+  for( ; i < writers.size(); ++i ) {
+    Socket * s = writers[i];
+    s->writeQueued_ = false;
+#endif
+    if( active_.size() >= maxActive ) {
+      //  no room to report any more; the rest go next time
+#if !defined( WIN32 )
+      for( ; i < writers.size(); ++i ) {
+        writers[i]->writeQueued_ = false;
+        queue_write( writers[i] );
+      }
+#endif
+      break;
+    }
     while( s->wants_to_write() ) {
+      size_t queued = s->bufOut_.space_used();
+#if defined( WIN32 )
       int r = s->bufOut_.get_message( tmpBuffer_, settings_.maxMessageSize );
       ASSERT( r >= 0 || !"impossible message accepted in s->bufOut_" );
       int w = ::sendto( listening_, tmpBuffer_, r, 0, (sockaddr const *)&s->addr_, sizeof( s->addr_ ) );
@@ -725,6 +1695,15 @@ bool SocketManager::handle_listening_write( size_t maxActive )
         //  probably filled the sending buffer
         goto error_writing;
       }
+#else
+      //  Messages go into the batch, which goes out UDP_BATCH at a time.
+      if( !batch_message( s ) ) {
+        //  probably filled the sending buffer
+        goto error_writing;
+      }
+#endif
+      size_t sent = queued - s->bufOut_.space_used();
+      s->count_sent( sent, sent );
       if( s->notify_ ) {
         notify_.insert( s );
       }
@@ -737,15 +1716,36 @@ bool SocketManager::handle_listening_write( size_t maxActive )
         break;
       }
     }
+#if !defined( WIN32 )
+    if( s->wants_to_write() ) {
+      queue_write( s );
+    }
+#endif
   }
+#if !defined( WIN32 )
+  if( !send_datagrams() ) {
+    goto error_writing;
+  }
+  set_interest( listening_, listenInterest_, EPOLLIN );
+#endif
   return true;  //  I've done all the writing I can think of doing!
 
 error_writing:
   int error = ::WSAGetLastError();
   debug_sock_error( 0, error, EA_session, "::sendto()" );
+#if !defined( WIN32 )
+  //  Whoever didn't get to send goes again when the socket has room.
+  for( ; i < writers.size(); ++i ) {
+    writers[i]->writeQueued_ = false;
+    queue_write( writers[i] );
+  }
+#endif
   switch( error ) {
     case WSAEWOULDBLOCK:
       //  this is OK, just means I filled up the queue
+#if !defined( WIN32 )
+      set_interest( listening_, listenInterest_, EPOLLIN | EPOLLOUT );
+#endif
       return true;
       break;
     default:
@@ -798,12 +1798,80 @@ sockaddr_in Socket::address()
 
 int Socket::read( void * buffer, size_t maxSize )
 {
-  return bufIn_.get_message( buffer, maxSize );
+  int r = bufIn_.get_message( buffer, maxSize );
+#if !defined( WIN32 )
+  if( parked_ ) {
+    mgr_->unpark( this );
+  }
+#endif
+  return r;
+}
+
+int Socket::peek( void const ** first, size_t * firstSize, void const ** rest )
+{
+  BufferSegment segs[2];
+  int r = bufIn_.peek_message( segs );
+  if( r < 0 ) {
+    return -1;
+  }
+  *first = segs[0].data;
+  *firstSize = segs[0].size;
+  *rest = segs[1].size ? segs[1].data : 0;
+  return r;
+}
+
+void Socket::consume()
+{
+  bufIn_.skip_message();
+#if !defined( WIN32 )
+  if( parked_ ) {
+    mgr_->unpark( this );
+  }
+#endif
 }
 
 int Socket::write( void const * buffer, size_t size )
 {
-  return bufOut_.put_message( buffer, size );
+  if( mgr_->settings_.threadedWrites ) {
+    return post_write( buffer, size );
+  }
+  int r = bufOut_.put_message( buffer, size );
+  if( r < 0 ) {
+    count_refused();
+    return r;
+  }
+  count_queued();
+  if( !closed_ ) {
+    mgr_->queue_write( this );
+  }
+  return r;
+}
+
+//  Posted writes are moved into bufOut_ on the manager's thread, so 
+//  with threadedWrites there is no room in it to hand out.
+void * Socket::reserve( size_t maxSize )
+{
+  if( mgr_->settings_.threadedWrites ) {
+    return 0;
+  }
+  void * room = bufOut_.reserve( maxSize );
+  if( !room ) {
+    count_refused();
+  }
+  return room;
+}
+
+int Socket::commit( size_t size )
+{
+  int r = bufOut_.commit( size );
+  if( r < 0 ) {
+    return r;
+  }
+  count_queued();
+  if( !closed_ ) {
+    mgr_->queue_write( this );
+  }
+  return r;
 }
 
 bool Socket::closed()
@@ -811,42 +1879,192 @@ bool Socket::closed()
   return closed_;
 }
 
+bool Socket::connecting()
+{
+  return connecting_;
+}
+
+void Socket::stats( EtworkSocketStats * out )
+{
+  out->bytesIn = stats_.bytesIn_;
+  out->bytesOut = stats_.bytesOut_;
+  out->messagesIn = stats_.messagesIn_;
+  out->messagesOut = stats_.messagesOut_;
+  out->drops = stats_.drops_;
+  out->writesRefused = stats_.writesRefused_;
+  out->partialSends = stats_.partialSends_;
+  out->queueInHigh = stats_.queueInHigh_;
+  out->queueOutHigh = stats_.queueOutHigh_;
+  out->queueIn = (unsigned int)bufIn_.space_used();
+  out->queueOut = (unsigned int)bufOut_.space_used();
+}
+
 void Socket::dispose()
 {
+  if( mgr_->settings_.threadedWrites ) {
+    //  Make sure the manager's lists of posted writers don't 
+    //  point at me anymore.
+    mgr_->drain_writes();
+    if( cold_->heldQueued_ ) {
+      std::vector< Socket * > & hw = mgr_->heldWriters_;
+      hw.erase( std::find( hw.begin(), hw.end(), this ) );
+    }
+  }
+  if( mgr_->errors_ ) {
+    //  Queued errors can't point at me once I'm gone (and closing 
+    //  may have more to say).
+    close_socket();
+    mgr_->forget_errors( this );
+  }
+#if !defined( WIN32 )
+  if( mgr_->linger( this ) ) {
+    return;   //  the manager deletes it once the kernel is done with it
+  }
+#endif
   delete this;
 }
 
+//  This may be called from any thread, so it only touches posted_ and 
+//  postedBytes_ (and the manager's postedWriters_, through post_writer()).
+int Socket::post_write( void const * buffer, size_t size )
+{
+  if( size > mgr_->settings_.maxMessageSize ) {
+    return -1;
+  }
+  if( atomic_add( &cold_->postedBytes_, (long)size ) > (long)mgr_->settings_.queueSize ) {
+    atomic_add( &cold_->postedBytes_, -(long)size );
+    return -1;
+  }
+  PostedWrite * pw = (PostedWrite *)::operator new( sizeof( PostedWrite ) + size );
+  pw->size_ = size;
+  memcpy( &pw[1], buffer, size );
+  void * head;
+  do {
+    head = atomic_load( &cold_->posted_ );
+    pw->next_ = (PostedWrite *)head;
+  }
+  while( !atomic_cas( &cold_->posted_, head, pw ) );
+  if( !head ) {
+    //  The first message since the manager last looked makes the 
+    //  socket known to the manager.
+    mgr_->post_writer( this );
+  }
+  return (int)size;
+}
+
+//  Move posted writes into bufOut_, oldest first, for as long as they 
+//  fit. Called by the manager. Returns true if some are still held.
+bool Socket::take_posted()
+{
+  PostedWrite * pw = (PostedWrite *)atomic_exchange( &cold_->posted_, 0 );
+  PostedWrite * fifo = 0;
+  while( pw ) {
+    PostedWrite * next = pw->next_;
+    pw->next_ = fifo;
+    fifo = pw;
+    pw = next;
+  }
+  PostedWrite * & held = cold_->held_;
+  PostedWrite ** tail = &held;
+  while( *tail ) {
+    tail = &(*tail)->next_;
+  }
+  *tail = fifo;
+  long bytes = 0;
+  while( held ) {
+    if( !closed_ && bufOut_.put_message( &held[1], held->size_ ) < 0 ) {
+      //  bufOut_ is full; try again next poll()
+      break;
+    }
+    count_queued();
+    bytes += (long)held->size_;
+    pw = held;
+    held = held->next_;
+    ::operator delete( pw );
+  }
+  atomic_add( &cold_->postedBytes_, -bytes );
+  if( !closed_ && wants_to_write() ) {
+    mgr_->queue_write( this );
+  }
+  return held != 0;
+}
+
+void Socket::free_posted( PostedWrite * pw )
+{
+  while( pw ) {
+    PostedWrite * next = pw->next_;
+    ::operator delete( pw );
+    pw = next;
+  }
+}
+
+//  Keep reading until the kernel has no more for this socket, or it has 
+//  had its readBudget for this pass, so that a burst doesn't take one 
+//  pass through poll() per maxMessageSize.
 bool Socket::do_read()
 {
   ASSERT( mgr_->settings_.reliable );
-  int r = ::recv( s_, mgr_->tmpBuffer_, (int)mgr_->settings_.maxMessageSize, 0 );
-  if( r < 0 ) {
-    int err = WSAGetLastError();
-    mgr_->debug_sock_error( this, err, EA_session, "::recv() in Socket::do_read()" );
-    switch( err ) {
+  size_t budget = mgr_->settings_.readBudget;
+  size_t got = 0;
+  while( got < budget ) {
+    if( got > 0 && !wants_to_read() ) {
+      //  The user has to read some before more fits, or the manager 
+      //  is over its memory budget; the rest waits in the kernel.
+#if !defined( WIN32 )
+      mgr_->park( this );
+#endif
+      return true;
+    }
+    //  What's left of a message that has started arriving goes right 
+    //  where it belongs in bufIn_; headers go through tmpBuffer_.
+    void * space = 0;
+    size_t n = bufIn_.input_space( &space );
+    bool direct = n > 0;
+    if( !direct ) {
+      space = mgr_->tmpBuffer_;
+      n = mgr_->settings_.maxMessageSize;
+    }
+    if( n > budget - got ) {
+      n = budget - got;
+    }
+    int r = ::recv( s_, (char *)space, (int)n, 0 );
+    if( r < 0 ) {
+      int err = WSAGetLastError();
+      switch( err ) {
 
-      case WSAEWOULDBLOCK: {
-        //  this is OK
-      }
-      return false;
+        case WSAEWOULDBLOCK: {
+          //  this is OK; it means we drained the socket
+        }
+        return got > 0;
 
-      default: {
-        //  socket is closed because of error!
-        close_socket();
+        default: {
+          //  socket is closed because of error!
+          mgr_->debug_sock_error( this, err, EA_session, "::recv() in Socket::do_read()" );
+          close_socket();
+        }
+        return false;
       }
+    }
+    if( r == 0 ) {
+      //  this means the socket closed!
+      close_socket();
+      return true;
+    }
+    lastActive_ = mgr_->curTime_;
+    got += r;
+    size_t had = bufIn_.message_count();
+    int w = direct ? bufIn_.commit_input( r ) : bufIn_.put_data( mgr_->tmpBuffer_, r );
+    count_input( r, bufIn_.message_count() - had );
+    if( w < 0 ) {
+      count_drop();
+      etwork_error_from( this, mgr_, EtworkError( ES_warning, EA_session, EO_buffer_full ) );
       return false;
     }
-  }
-  if( r == 0 ) {
-    //  this means the socket closed!
-    close_socket();
-    return true;
-  }
-  lastActive_ = mgr_->curTime_;
-  int w = bufIn_.put_data( mgr_->tmpBuffer_, r );
-  if( w < 0 ) {
-    etwork_error_from( this, mgr_, EtworkError( ES_warning, EA_session, EO_buffer_full ) );
-    return false;
+    if( r < (int)n ) {
+      //  A short read means the socket is drained; don't go ask 
+      //  for the EWOULDBLOCK.
+      return true;
+    }
   }
   return true;
 }
@@ -854,22 +2072,52 @@ bool Socket::do_read()
 bool Socket::do_write()
 {
   ASSERT( mgr_->settings_.reliable );
-  int r = (int)writebufData_;
-  if( writebufData_ == 0 ) {
-    r = bufOut_.get_data( writebuf_, mgr_->settings_.queueSize );
+  //  Queued messages go out straight from bufOut_, framing and all, 
+  //  and whatever the kernel takes gets consumed from it.
+  BufferSegment segs[WRITE_SEGMENTS];
+  int n = bufOut_.get_segments( segs, WRITE_SEGMENTS );
+  if( n == 0 ) {
+    return true;  //  nothing to write
   }
-  ASSERT( r >= 0 || !"bufOut_ error in Socket::do_write()" );
-  if( r < 0 ) {
-    return false;
+  size_t total = 0;
+  for( int i = 0; i < n; ++i ) {
+    total += segs[i].size;
   }
-  if( r == 0 ) {
-    return true;  //  nothing to write
+#if defined( WIN32 )
+  WSABUF bufs[WRITE_SEGMENTS];
+  for( int i = 0; i < n; ++i ) {
+    bufs[i].buf = (CHAR *)segs[i].data;
+    bufs[i].len = (ULONG)segs[i].size;
+  }
+  DWORD sent = 0;
+  int w = ::WSASend( s_, bufs, n, &sent, 0, 0, 0 );
+  if( w == 0 ) {
+    w = (int)sent;
+  }
+#else
+  iovec iov[WRITE_SEGMENTS];
+  for( int i = 0; i < n; ++i ) {
+    iov[i].iov_base = (void *)segs[i].data;
+    iov[i].iov_len = segs[i].size;
+  }
+  msghdr mh;
+  memset( &mh, 0, sizeof( mh ) );
+  mh.msg_iov = iov;
+  mh.msg_iovlen = n;
+  int flags = SEND_FLAGS;
+  bool zc = false;
+  if( zeroCopy_ ) {
+    //  Pinning pages only pays off for big sends.
+    zc = total >= ZEROCOPY_MIN;
+    if( zc ) {
+      flags |= MSG_ZEROCOPY;
+    }
   }
-  writebufData_ = r;
-  int w = ::send( s_, writebuf_, (int)writebufData_, 0 );
+  int w = (int)::sendmsg( s_, &mh, flags );
+#endif
   if( w < 0 ) {
     int err = WSAGetLastError();
-    mgr_->debug_sock_error( this, err, EA_session, "::send() in Socket::do_write()" );
+    mgr_->debug_sock_error( this, err, EA_session, "::sendmsg() in Socket::do_write()" );
     switch( err ) {
 
       case WSAEWOULDBLOCK: {
@@ -887,21 +2135,117 @@ bool Socket::do_write()
     }
   }
 send_success:
-  if( w > 0 && w < (int)writebufData_ ) {
-    ::memmove( writebuf_, &writebuf_[w], writebufData_-w );
+  count_sent( w, total );
+#if !defined( WIN32 )
+  if( zeroCopy_ ) {
+    if( w > 0 ) {
+      bufOut_.hold( w );
+      ZeroCopySend zs;
+      zs.seq_ = zc ? cold_->zcNext_++ : 0;
+      zs.size_ = w;
+      zs.done_ = !zc;
+      cold_->zcSends_.push_back( zs );
+      release_zerocopy();
+    }
   }
-  writebufData_ -= w;
+  else
+#endif
+  bufOut_.consume( w );
   lastKeepalive_ = mgr_->curTime_;
   return true;
 }
 
+#if !defined( WIN32 )
+//  Reads the MSG_ZEROCOPY completions off the error queue. Returns 
+//  true if there were any.
+bool Socket::reap_zerocopy()
+{
+  SOCKET s = closed_ ? cold_->zcLinger_ : s_;
+  bool any = false;
+  while( true ) {
+    char control[CMSG_SPACE( sizeof( sock_extended_err ) ) + 64];
+    msghdr mh;
+    memset( &mh, 0, sizeof( mh ) );
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof( control );
+    if( ::recvmsg( s, &mh, MSG_ERRQUEUE ) < 0 ) {
+      break;
+    }
+    for( cmsghdr * c = CMSG_FIRSTHDR( &mh ); c != 0; c = CMSG_NXTHDR( &mh, c ) ) {
+      if( c->cmsg_level != SOL_IP || c->cmsg_type != IP_RECVERR ) {
+        continue;
+      }
+      sock_extended_err ee;
+      memcpy( &ee, CMSG_DATA( c ), sizeof( ee ) );
+      if( ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+        continue;
+      }
+      //  sends ee_info through ee_data are done (the count wraps)
+      any = true;
+      std::vector< ZeroCopySend > & sends = cold_->zcSends_;
+      for( size_t i = 0, n = sends.size(); i != n; ++i ) {
+        ZeroCopySend & zs = sends[i];
+        if( !zs.done_ && zs.seq_ - ee.ee_info <= ee.ee_data - ee.ee_info ) {
+          zs.done_ = true;
+        }
+      }
+    }
+  }
+  release_zerocopy();
+  return any;
+}
+
+//  Whether the kernel may still send from a disposed socket's bufOut_, 
+//  so that the manager has to be the one to delete it.
+bool SocketManager::linger( Socket * s )
+{
+  if( !s->zeroCopy_ || s->cold_->zcSends_.empty() ) {
+    return false;
+  }
+  s->close_socket();
+  if( IS_SOCKET_ERROR( s->cold_->zcLinger_ ) ) {
+    return false;
+  }
+  lingering_.push_back( s );
+  return true;
+}
+
+//  Disposed sockets go, and close, once their last MSG_ZEROCOPY send 
+//  is done.
+void SocketManager::reap_lingering()
+{
+  size_t j = 0;
+  for( size_t i = 0, n = lingering_.size(); i != n; ++i ) {
+    Socket * s = lingering_[i];
+    s->reap_zerocopy();
+    if( s->cold_->zcSends_.empty() ) {
+      delete s;
+    }
+    else {
+      lingering_[j++] = s;
+    }
+  }
+  lingering_.resize( j );
+}
+
+void Socket::release_zerocopy()
+{
+  std::vector< ZeroCopySend > & sends = cold_->zcSends_;
+  size_t i = 0;
+  for( size_t n = sends.size(); i != n && sends[i].done_; ++i ) {
+    bufOut_.release( sends[i].size_ );
+  }
+  sends.erase( sends.begin(), sends.begin() + i );
+}
+#endif
+
 bool Socket::do_except()
 {
   ASSERT( mgr_->settings_.reliable );
   int error = 0;
-  int optlen = sizeof(error);
+  SOCKLEN optlen = sizeof(error);
   int r = ::getsockopt( s_, SOL_SOCKET, SO_ERROR, (char *)&error, &optlen );
-  ASSERT( r == 4 );
+  ASSERT( r == 0 );
   switch( error ) {
     case 0:
       mgr_->debug_sock_error( this, 0, EA_session, "Socket::do_except() found no error" );
@@ -950,12 +2294,32 @@ ISocketManager * CreateEtwork( EtworkSettings * settings )
     etwork_log( 0, ES_note, "Setting maxMessageSize to 4000." );
     settings->queueSize = 4000;
   }
-  if( settings->queueSize + settings->maxMessageSize > 65536 ) {
+  if( settings->readBudget == 0 ) {
+    etwork_log( 0, ES_note, "Setting readBudget to queueSize." );
+    settings->readBudget = settings->queueSize;
+  }
+  if( settings->traceSize == 0 ) {
+    etwork_log( 0, ES_note, "Setting traceSize to 8192." );
+    settings->traceSize = 8192;
+  }
+  if( settings->framing != EF_short && settings->framing != EF_varint ) {
+    etwork_log( 0, ES_error, "Unknown framing %d.", settings->framing );
+    return 0;
+  }
+  if( settings->framing == EF_varint && settings->reliable ) {
+    //  four varint bytes carry 28 bits of size
+    if( settings->maxMessageSize > 0x0fffffff || settings->queueSize > 0x0fffffff ) {
+      etwork_log( 0, ES_error, "With EF_varint, queueSize and maxMessageSize must be < 256 MB." );
+      return 0;
+    }
+  }
+  else if( settings->queueSize + settings->maxMessageSize > 65536 ) {
     etwork_log( 0, ES_error, "queueSize + maxMessageSize must be <= 65536." );
     return 0;
   }
 
   //  Open WinSock if necessary.
+#if defined( WIN32 )
   if( !wsOpen ) {
     WSADATA wsaData;
     int i = ::WSAStartup( MAKEWORD(2,2), &wsaData );
@@ -966,9 +2330,23 @@ ISocketManager * CreateEtwork( EtworkSettings * settings )
     }
     wsOpen = true;
   }
+#endif
 
   //  Create the actual socket manager
-  SocketManager * sm = new SocketManager();
+  SocketManager * sm = 0;
+#if defined( __linux__ )
+  if( settings->engine == EE_uring ) {
+    if( settings->reliable ) {
+      sm = new UringSocketManager();
+    }
+    else {
+      etwork_log( 0, ES_note, "The io_uring engine only does reliable sockets; using the default engine." );
+    }
+  }
+#endif
+  if( !sm ) {
+    sm = new SocketManager();
+  }
   if( !sm->open( settings ) ) {
     sm->dispose();
     return 0;
@@ -10,6 +10,8 @@
 
 #if defined( WIN32 )
 #include <windows.h>
+#elif defined( __linux__ )
+#include <linux/io_uring.h>
 #endif
 
 #include <stdio.h>  //  for _snprintf
@@ -19,6 +21,7 @@
 #include <map>
 #include <set>
 #include <deque>
+#include <vector>
 #include <algorithm>
 #include <new>
 
@@ -27,122 +30,786 @@
 
 namespace etwork {
   class Socket;
+
+  //  Resolver turns host names into addresses for SocketManager::connect(). 
+  //  It talks to the name server over UDP itself, so a lookup doesn't hold 
+  //  up the manager (or any other manager), and many can be outstanding 
+  //  at once. Answers, including "no such host", are cached for as long 
+  //  as the name server says they are good for.
+  class Resolver {
+    public:
+      Resolver();
+      ~Resolver();
+
+      struct Answer {
+        std::string name_;
+        bool found_;
+        in_addr addr_;
+      };
+
+      bool configure( char const * nameserver );
+      bool open();
+      bool is_open() { return !IS_SOCKET_ERROR( s_ ); }
+      bool busy() { return !pending_.empty(); }
+      SOCKET socket() { return s_; }
+      static std::string make_key( char const * name );
+      int lookup( char const * name, in_addr * out, double now );
+      int wait( char const * name, in_addr * out, Timer const & time );
+      void handle_read( double now );
+      void handle_timeouts( double now );
+
+      int find( std::string const & key, in_addr * out, double now );
+      bool send_query( std::string const & key, double now );
+      void handle_reply( unsigned char const * p, int n, double now );
+      void store( std::string const & key, bool found, in_addr const & addr, unsigned long ttl, double now );
+
+      struct Entry {
+        bool found_;
+        in_addr addr_;
+        double expires_;
+      };
+      struct Query {
+        unsigned short id_;
+        int tries_;
+        double sent_;
+      };
+      typedef std::map< std::string, Entry > Cache;
+      typedef std::map< std::string, Query > QueryMap;
+      typedef std::map< unsigned short, std::string > IdMap;
+      Cache cache_;
+      QueryMap pending_;
+      IdMap ids_;
+      std::vector< Answer > answers_;   //  for the manager to hand out
+      SOCKET s_;
+      bool configured_;
+      sockaddr_in server_;
+  };
+
+  //  TimingWheel holds the keepalive/timeout deadlines of a manager's 
+  //  sockets, so that poll() only has to look at the sockets whose 
+  //  deadline has come, rather than at every socket. There are two 
+  //  levels of WHEEL_SLOTS lists: the first one tick per list, the 
+  //  second WHEEL_SLOTS ticks per list, which get spread out over the 
+  //  first level as it comes around to them. Deadlines further out 
+  //  than the second level reaches wait at its far end.
+  class TimingWheel {
+    public:
+      enum { WHEEL_BITS = 8, WHEEL_SLOTS = 1 << WHEEL_BITS, WHEEL_MASK = WHEEL_SLOTS - 1 };
+      TimingWheel( double tick );
+
+      void schedule( Socket * s, double when );
+      void cancel( Socket * s );
+      void expire( double now, std::vector< Socket * > & out );
+
+      void insert( Socket * s, unsigned long tick );
+      void take_all( Socket * & list, std::vector< Socket * > & out );
+
+      double tick_;         //  seconds per tick
+      unsigned long now_;   //  ticks expired so far
+      size_t count_;
+      Socket * near_[WHEEL_SLOTS];
+      Socket * far_[WHEEL_SLOTS];
+  };
+
+  //  SocketTable finds the Socket for a SOCKET (or, for unreliable 
+  //  sockets, for an id from SocketManager::socket_id()). Small handles, 
+  //  which POSIX descriptors and socket ids are, index straight into 
+  //  slots_; bigger ones (WinSock handles can be) go in overflow_. The 
+  //  sockets are also packed into live_, for walking all of them.
+  class SocketTable {
+    public:
+      enum { MAX_DIRECT = 1 << 20 };
+
+      Socket * find( SOCKET s ) const
+      {
+        if( (size_t)s < slots_.size() ) {
+          return slots_[(size_t)s];
+        }
+        return find_overflow( s );
+      }
+      size_t size() const { return live_.size(); }
+      bool empty() const { return live_.empty(); }
+      Socket * at( size_t i ) const { return live_[i]; }
+      void insert( SOCKET s, Socket * so );
+      bool erase( SOCKET s );
+
+      Socket * find_overflow( SOCKET s ) const;
+
+      std::vector< Socket * > slots_;
+      std::map< SOCKET, Socket * > overflow_;
+      std::vector< Socket * > live_;
+  };
+
+  //  AddressTable finds the unreliable Socket for a peer address. It is 
+  //  an open-addressing hash table (linear probing, with entries moved 
+  //  back on erase instead of leaving tombstones), keyed on address and 
+  //  port packed into one integer; all the addresses are AF_INET. 
+  //  find_batch() looks up a whole recvmmsg() batch, hashing and 
+  //  prefetching all of it before probing any of it.
+  class AddressTable {
+    public:
+      AddressTable();
+      ~AddressTable();
+
+      Socket * find( sockaddr_in const & addr ) const
+      {
+        return find_key( make_key( addr ) );
+      }
+      void find_batch( sockaddr_in const * addrs, size_t n, Socket ** out ) const;
+      void insert( sockaddr_in const & addr, Socket * s );
+      bool erase( sockaddr_in const & addr );
+      size_t size() const { return count_; }
+
+      typedef unsigned long long Key;   //  0 means an empty entry
+      struct Entry {
+        Key key_;
+        Socket * sock_;
+      };
+      static Key make_key( sockaddr_in const & addr )
+      {
+        return ((Key)addr.sin_addr.s_addr << 16) | (Key)addr.sin_port;
+      }
+      size_t home( Key k ) const
+      {
+        return (size_t)((k * 0x9E3779B97F4A7C15ULL) >> shift_);
+      }
+      Socket * find_key( Key k ) const
+      {
+        for( size_t i = home( k ); ; i = (i + 1) & mask_ ) {
+          if( entries_[i].key_ == k ) {
+            return entries_[i].sock_;
+          }
+          if( !entries_[i].key_ ) {
+            return 0;
+          }
+        }
+      }
+      void grow();
+
+      Entry * entries_;
+      size_t mask_;     //  capacity - 1; capacity is a power of two
+      int shift_;       //  64 - log2( capacity )
+      size_t count_;
+  };
+
+  //  BufferPool lends the Buffers of a manager's sockets their arenas, 
+  //  which they give back whenever they are empty, so idle sockets hold 
+  //  no queue memory. It keeps up to POOL_SPARE arenas that have come 
+  //  back, for sockets that fill up and empty all the time. With a 
+  //  budget, it lends out no more than that many bytes at a time.
+  class BufferPool : public IBufferPool {
+    public:
+      enum { POOL_SPARE = 64 };
+      BufferPool();
+      ~BufferPool();
+
+      virtual void * get( size_t size );
+      virtual void put( void * mem, size_t size );
+      //  whether another arena like the ones lent so far may be had
+      bool can_lend() const { return !budget_ || lent_ + size_ <= budget_; }
+
+      size_t budget_;   //  most bytes to lend out; 0 for no limit
+      size_t lent_;
+      size_t lentHigh_; //  the most lent_ has been
+      size_t size_;     //  the size of the arenas; they are all the same
+      bool returned_;   //  whether put() has been called since the manager looked
+      std::vector< void * > spare_;
+  };
+
   class SocketManager : public ISocketManager {
     public:
       SocketManager();
-      ~SocketManager();
+      virtual ~SocketManager();
       bool open( EtworkSettings * settings );
 
       //  ISocketManager
       virtual int poll( double seconds, ISocket ** outActive, int maxActive );
       virtual int accept( ISocket ** outAccepted, int maxAccepted );
       virtual int connect( char const * address, unsigned short port, ISocket ** outConnected );
+      virtual void stats( EtworkStats * out );
+      virtual int histograms( EtworkHistogram * out, int maxOut, bool reset );
+      virtual bool dump_trace( char const * path );
+      virtual int drain_errors( int maxErrors );
       virtual void dispose();
 
       void debug_sock_error( ISocket * sock, int err, ErrorArea area, char const * func );
-      void remove_socket( Socket * s );
+      void queue_error( ISocket * sock, EtworkError const & err, int osError );
+      void forget_errors( ISocket * sock );
+      void report_queued( EtworkError const & err, int osError, ISocket * sock, unsigned int repeat, double time );
+      //  Put an event in the trace_ ring, over the oldest one.
+      void trace( int event, SOCKET s, size_t value )
+      {
+        EtworkTraceRecord & r = trace_[traced_++ & traceMask_];
+        unsigned long long us = (unsigned long long)(time_.seconds() * 1e6);
+        r.timeLow = (unsigned int)us;
+        r.timeHigh = (unsigned short)(us >> 32);
+        r.event = (unsigned short)event;
+        r.socket = (unsigned int)s;
+        r.value = value < 0xffffffffUL ? (unsigned int)value : 0xffffffffUL;
+      }
+      bool make_nonblocking( SOCKET s, ErrorArea area );
+#if !defined( WIN32 )
+      virtual bool open_engine();
+#endif
+      virtual void add_socket( Socket * s );
+      virtual void remove_socket( Socket * s );
       void regenerate_sets();
+      void queue_write( Socket * s );
       SOCKET socket_id();
       bool handle_listening_read( size_t maxActive );
       bool handle_listening_write( size_t maxActive );
       bool handle_listening_except( size_t maxActive );
+      void finish_connect( Socket * s );
+      SOCKET open_connection( sockaddr_in const & addr, bool & connecting );
+      int resolve( char const * address, in_addr * out );
+      bool open_resolver();
+      void finish_lookups();
+      void resolved( Socket * s, in_addr const * addr );
+      void handle_datagram( sockaddr_in const & addr, Socket * s, char const * data, int size );
       void change_queuing_space();
       void timeout_sockets();
+      void schedule_timeout( Socket * s );
+      void post_writer( Socket * s );
+      void drain_writes();
+      void hold_writes( Socket * s );
+#if !defined( WIN32 )
+      void park( Socket * s );
+      void unpark( Socket * s );
+      void unpark_sockets();
+      virtual bool linger( Socket * s );
+      void reap_lingering();
+      virtual void stop_reading( Socket * s );
+      virtual void start_reading( Socket * s );
+      bool writes_pending();
+      void collect_writes( int numEvents );
+      void requeue_writes();
+      void set_interest( SOCKET s, unsigned int & cur, unsigned int want );
+      void take_wakeup();
+
+      //  Unreliable managers move datagrams UDP_BATCH at a time with 
+      //  recvmmsg()/sendmmsg(), through these pre-allocated slots. 
+      //  With settings_.offload, a slot holds a run of same-size 
+      //  datagrams to or from one peer, which the kernel splits up 
+      //  (UDP_SEGMENT) or coalesced (UDP_GRO).
+      enum { UDP_BATCH = 32, UDP_MAX_SEGMENTS = 64 };
+      struct DatagramBatch {
+        mmsghdr msgs_[UDP_BATCH];
+        iovec iov_[UDP_BATCH];
+        sockaddr_in addr_[UDP_BATCH];
+        char ctrl_[UDP_BATCH][CMSG_SPACE( sizeof( int ) )];
+        unsigned short segSize_[UDP_BATCH];   //  size of each datagram in the slot
+        unsigned short segCount_[UDP_BATCH];  //  datagrams in the slot
+        bool segOpen_[UDP_BATCH];             //  whether more can be added
+        size_t size_;   //  bytes in each slot
+        char * data_;   //  UDP_BATCH * size_
+      };
+      DatagramBatch * new_batch( size_t size );
+      void delete_batch( DatagramBatch * b );
+      bool open_offload();
+      bool batch_message( Socket * s );
+      bool send_datagrams();
+#endif
 
       EtworkSettings settings_;
       SOCKET listening_;
-      typedef std::map< SOCKET, Socket * > SocketMap;
-      SocketMap sockets_;
-      typedef std::map< sockaddr_in, Socket * > AddressMap;
-      AddressMap socketAddrs_;
+      SocketTable sockets_;
+      AddressTable socketAddrs_;
       std::deque< Socket * > accepted_;
+      Resolver resolver_;
+      typedef std::multimap< std::string, Socket * > LookupMap;
+      LookupMap lookups_;   //  sockets waiting for resolver_, by name
       Timer time_;
+      TimingWheel wheel_;
+      std::vector< Socket * > expired_;   //  out of wheel_, for timeout_sockets()
+      BufferPool pool_;
+      Buffer * bufShape_;   //  what the sockets' buffers are made from
       std::set< ISocket * > active_;
       std::set< ISocket * > notify_;
 
       size_t maxNumSocks_;
       size_t numSocks_;
       size_t maxSock_;
+#if defined( WIN32 )
       fd_set * allSet_;
       fd_set * readSet_;
       fd_set * writeSet_;
       fd_set * writeTempSet_;
       fd_set * exceptSet_;
+#else
+      //  Sockets are registered with epoll once, when they are added, 
+      //  and only ask for EPOLLOUT while they have output that the 
+      //  kernel would not take right away.
+      int epoll_;
+      epoll_event * events_;
+      unsigned int listenInterest_;
+      unsigned int resolverInterest_;
+      int wakeup_;                        //  eventfd that post_writer() signals, with threadedWrites; else -1
+      unsigned int wakeupInterest_;
+      std::vector< Socket * > writers_;   //  sockets that queued output since last pass
+      std::vector< SOCKET > writeList_;   //  sockets to service for writing this pass
+      DatagramBatch * recvBatch_;
+      DatagramBatch * sendBatch_;
+      size_t sendCount_;                  //  datagrams batched up in sendBatch_
+      size_t sendDone_;                   //  how many of those have been sent
+      //  Sockets that can't take any input right now (see 
+      //  Socket::wants_to_read()) aren't asked for any, so it waits in the 
+      //  kernel, and TCP pushes back on the sender, until they can again.
+      std::vector< Socket * > parked_;
+      //  Disposed sockets with MSG_ZEROCOPY sends that the kernel isn't 
+      //  done with. Their bufOut_ memory can't be lent out again yet.
+      std::vector< Socket * > lingering_;
+#endif
       char * tmpBuffer_;
+      void * volatile postedWriters_;   //  Sockets with threaded writes, linked by nextPosted_
+      std::vector< Socket * > heldWriters_; //  Sockets with posted writes that didn't fit bufOut_
 
       int nextSocket_;
+      std::vector< SOCKET > freeIds_;   //  socket ids to hand out again
       int curQueueSpace_;
       double curTime_;
+      EtworkStats stats_;   //  totals of the sockets' stats_, and polls
+      EtworkHistogram * hist_;  //  EP_count of them, or NULL without settings_.histograms
+      EtworkTraceRecord * trace_;   //  traceMask_+1 of them
+      size_t traceMask_;
+      unsigned long long traced_;   //  records ever put in trace_
+
+      //  With settings_.asyncErrors, wsa_error_from() and etwork_error_from() 
+      //  only put a QueuedError in this ring; drain_errors() reports them. 
+      //  Both ends are on the polling thread, so it needs no locking.
+      enum { ERROR_QUEUE = 1024 };
+      struct QueuedError {
+        int error_;             //  EtworkError, as an int
+        char const * text_;     //  its own text, in errorTexts_; or NULL
+        int osError_;
+        ISocket * socket_;      //  NULL once disposed
+        unsigned int repeat_;   //  times in a row it happened
+        double time_;
+      };
+      QueuedError * errors_;    //  ERROR_QUEUE of them, or NULL without settings_.asyncErrors
+      size_t errorFirst_;
+      size_t errorCount_;
+      unsigned long errorsDropped_;
+      std::set< std::string > errorTexts_;
   };
 
   class Socket : public ISocket {
     public:
       Socket( SocketManager * mgr, SOCKET s, sockaddr_in const & addr ) :
-        mgr_( mgr ), s_( s ), closed_( false ), accepted_( false ), addr_( addr ),
-        bufIn_( mgr->settings_.maxMessageSize, mgr->settings_.queueSize, mgr->settings_.maxMessageCount ),
-        bufOut_( mgr->settings_.maxMessageSize, mgr->settings_.queueSize, mgr->settings_.maxMessageCount )
+        mgr_( mgr ), s_( s ), closed_( false ), accepted_( false ), connecting_( false ), resolving_( false ), 
+        bufIn_( mgr->bufShape_ ), bufOut_( mgr->bufShape_ ), addr_( addr )
       {
         if( !mgr->settings_.reliable ) {
           s_ = mgr->socket_id();
         }
-        writebuf_ = new char[ mgr->settings_.queueSize ];
-        writebufData_ = 0;
         data_ = 0;    //  this is the only time I touch the "data" member
         notify_ = 0;
         lastActive_ = mgr_->curTime_;
         lastKeepalive_ = 0;
+        wheelNext_ = 0;
+        wheelPrev_ = 0;
+        wheelTick_ = 0;
+        tableIndex_ = 0;
+        memset( &stats_, 0, sizeof( stats_ ) );
+        cold_ = 0;
+        if( mgr->settings_.threadedWrites || mgr->settings_.zerocopy ) {
+          cold_ = new Cold();
+        }
+#if !defined( WIN32 )
+        interest_ = EPOLLIN;
+        writeQueued_ = false;
+        parked_ = false;
+        slot_ = -1;
+        zeroCopy_ = false;
+#endif
       }
       ~Socket() {
         close_socket();
-        delete[] writebuf_;
+#if !defined( WIN32 )
+        if( cold_ && !IS_SOCKET_ERROR( cold_->zcLinger_ ) ) {
+          ::closesocket( cold_->zcLinger_ );
+        }
+#endif
+        if( cold_ ) {
+          free_posted( (PostedWrite *)cold_->posted_ );
+          free_posted( cold_->held_ );
+          delete cold_;
+        }
       }
 
       //  ISocket
       virtual sockaddr_in address();
       virtual int read( void * buffer, size_t maxSize );
+      virtual int peek( void const ** first, size_t * firstSize, void const ** rest );
+      virtual void consume();
       virtual int write( void const * buffer, size_t size );
+      virtual void * reserve( size_t maxSize );
+      virtual int commit( size_t size );
       virtual bool closed();
+      virtual bool connecting();
+      virtual void stats( EtworkSocketStats * out );
       virtual void dispose();
 
       bool wants_to_write()
       {
-        return writebufData_ > 0 || bufOut_.message_count() > 0;
+        return bufOut_.unsent() > 0;
       }
+      //  Whether input from the kernel has somewhere to go: room in bufIn_, 
+      //  and storage for it from the pool.
       bool wants_to_read()
       {
-        return bufOut_.space_used() < mgr_->settings_.queueSize-mgr_->settings_.maxMessageSize
-            && bufOut_.message_count() < mgr_->settings_.maxMessageCount;
+        return has_input_room() && (bufIn_.has_storage() || mgr_->pool_.can_lend());
+      }
+      bool has_input_room()
+      {
+        return bufIn_.space_used() + mgr_->settings_.maxMessageSize <= mgr_->settings_.queueSize
+            && bufIn_.message_count() < mgr_->settings_.maxMessageCount;
+      }
+      //  Each counter goes into stats_ and the manager's total. They are 
+      //  only ever touched on the thread that polls, so need no atomics.
+      void count_input( int bytes, size_t messages )
+      {
+        stats_.bytesIn_ += bytes;
+        stats_.messagesIn_ += (unsigned int)messages;
+        mgr_->stats_.bytesIn += bytes;
+        mgr_->stats_.messagesIn += messages;
+        mgr_->trace( ET_recv, s_, bytes );
+        size_t used = bufIn_.space_used();
+        if( used > stats_.queueInHigh_ ) {
+          stats_.queueInHigh_ = (unsigned int)used;
+        }
+      }
+      void count_drop()
+      {
+        ++stats_.drops_;
+        ++mgr_->stats_.drops;
+        mgr_->trace( ET_drop, s_, 0 );
+      }
+      void count_queued()
+      {
+        ++stats_.messagesOut_;
+        ++mgr_->stats_.messagesOut;
+        size_t used = bufOut_.space_used();
+        if( used > stats_.queueOutHigh_ ) {
+          stats_.queueOutHigh_ = (unsigned int)used;
+        }
+      }
+      void count_refused()
+      {
+        ++stats_.writesRefused_;
+        ++mgr_->stats_.writesRefused;
+      }
+      void count_sent( size_t bytes, size_t offered )
+      {
+        stats_.bytesOut_ += bytes;
+        mgr_->stats_.bytesOut += bytes;
+        mgr_->trace( ET_send, s_, bytes );
+        if( bytes < offered ) {
+          ++stats_.partialSends_;
+          ++mgr_->stats_.partialSends;
+          mgr_->trace( ET_partial, s_, offered - bytes );
+        }
       }
       bool do_read();
+      enum { WRITE_SEGMENTS = 2 };    //  bufOut_ is one ring, so its data is in at most two pieces
       bool do_write();
       bool do_except();
+
+      //  With threadedWrites, write() pushes a PostedWrite onto cold_->posted_ 
+      //  (newest first), and the manager moves them to bufOut_ in poll(). 
+      //  Those that don't fit in bufOut_ yet wait in held_ (oldest first).
+      struct PostedWrite {
+        PostedWrite * next_;
+        size_t size_;
+      };
+      int post_write( void const * buffer, size_t size );
+      bool take_posted();
+      static void free_posted( PostedWrite * pw );
       void close_socket()
       {
         if( !closed_ ) {
           closed_ = true;
+          mgr_->trace( ET_close, s_, 0 );
           mgr_->remove_socket( this );
           if( !IS_SOCKET_ERROR( s_ ) && mgr_->settings_.reliable ) {
+#if !defined( WIN32 )
+            if( zeroCopy_ && !cold_->zcSends_.empty() ) {
+              //  The kernel may still be sending from bufOut_, and 
+              //  says when it's done on this socket's error queue.
+              ::shutdown( s_, SHUT_WR );
+              cold_->zcLinger_ = s_;
+            }
+            else
+#endif
             ::closesocket( s_ );
           }
           s_ = INVALID_SOCKET;
         }
       }
 
+      //  With zeroCopy_, all output is held in bufOut_ after it is sent, 
+      //  and released in order. Sends that went out with MSG_ZEROCOPY 
+      //  are done when the kernel says so on the socket's error queue.
+#if !defined( WIN32 )
+      enum { ZEROCOPY_MIN = 16384 };    //  smaller sends get copied anyway
+      struct ZeroCopySend {
+        unsigned int seq_;      //  the kernel's count of MSG_ZEROCOPY sends
+        size_t size_;
+        bool done_;
+      };
+      bool reap_zerocopy();
+      void release_zerocopy();
+#endif
+
+      //  What only sockets of managers with threadedWrites or zerocopy 
+      //  need, kept out of the Socket itself so that the rest stay small.
+      struct Cold {
+        Cold() : posted_( 0 ), postedBytes_( 0 ), nextPosted_( 0 ), held_( 0 ), heldQueued_( false ) {
+#if !defined( WIN32 )
+          zcNext_ = 0;
+          zcLinger_ = INVALID_SOCKET;
+#endif
+        }
+        void * volatile posted_;          //  PostedWrite list, from any thread
+        long volatile postedBytes_;       //  bytes in posted_ and held_, to bound them
+        Socket * nextPosted_;             //  link in mgr_->postedWriters_
+        PostedWrite * held_;
+        bool heldQueued_;                 //  whether the socket is in mgr_->heldWriters_
+#if !defined( WIN32 )
+        unsigned int zcNext_;             //  seq_ of the next MSG_ZEROCOPY send
+        std::vector< ZeroCopySend > zcSends_;
+        SOCKET zcLinger_;                 //  s_, left open by close_socket() until zcSends_ are done
+#endif
+      };
+
+      //  What poll() looks at for every ready socket comes first.
       SocketManager * mgr_;
-      INotify * notify_;
       SOCKET s_;
+#if !defined( WIN32 )
+      unsigned int interest_;   //  what the socket is registered for with epoll
+#endif
       bool closed_;
       bool accepted_;
-      sockaddr_in addr_;
+      bool connecting_;   //  non-blocking connect() not done yet
+      bool resolving_;    //  waiting for the host name in mgr_->lookups_
+#if !defined( WIN32 )
+      bool writeQueued_;        //  whether the socket is in mgr_->writers_
+      bool zeroCopy_;
+      bool parked_;             //  whether the socket is in mgr_->parked_
+      int slot_;                //  index into UringSocketManager::slots_
+#endif
+      unsigned int tableIndex_; //  where in mgr_->sockets_.live_
+      //  Both share mgr_->bufShape_, and take no memory while empty.
       Buffer bufIn_;
       Buffer bufOut_;
       double lastActive_; //  for timeouts
       double lastKeepalive_;
+      //  Changing lastActive_ or lastKeepalive_ doesn't move the socket in 
+      //  mgr_->wheel_; when its old deadline comes, it gets put back later.
+      Socket * wheelNext_;
+      Socket ** wheelPrev_;     //  the link pointing here, or NULL when not in the wheel
+      unsigned long wheelTick_;
+      INotify * notify_;
+      sockaddr_in addr_;
+      Cold * cold_;             //  NULL unless threadedWrites or zerocopy
+      //  EtworkSocketStats, less what stats() can ask the buffers.
+      struct Counters {
+        unsigned long long bytesIn_;
+        unsigned long long bytesOut_;
+        unsigned int messagesIn_;
+        unsigned int messagesOut_;
+        unsigned int drops_;
+        unsigned int writesRefused_;
+        unsigned int partialSends_;
+        unsigned int queueInHigh_;
+        unsigned int queueOutHigh_;
+      };
+      Counters stats_;
+  };
+
+  //  PollTimer splits the time of one poll() among the EtworkPhases, if 
+  //  the manager keeps histograms. Each enter() ends the phase before 
+  //  it; the last one ends, along with EP_poll, when it goes away.
+  struct PollTimer {
+    SocketManager * mgr_;
+    double seconds_;
+    double start_;
+    double mark_;
+    int phase_;
+    PollTimer( SocketManager * mgr, double seconds ) : mgr_( mgr ), phase_( EP_timeouts ) {
+      seconds_ = seconds > 0 ? seconds : 0;
+      start_ = mark_ = mgr_->hist_ ? mgr_->time_.seconds() : 0;
+    }
+    ~PollTimer() {
+      if( mgr_->hist_ ) {
+        double now = mgr_->time_.seconds();
+        add( &mgr_->hist_[phase_], now - mark_ );
+        add( &mgr_->hist_[EP_poll], now - start_ );
+        add( &mgr_->hist_[EP_overrun], now - start_ > seconds_ ? now - start_ - seconds_ : 0 );
+      }
+    }
+    void enter( int phase ) {
+      if( mgr_->hist_ ) {
+        double now = mgr_->time_.seconds();
+        add( &mgr_->hist_[phase_], now - mark_ );
+        mark_ = now;
+        phase_ = phase;
+      }
+    }
+    static void add( EtworkHistogram * h, double seconds );
+  };
+
+  //  Make sure sockets with an INotify get notified on all exit paths 
+  //  out of poll(). Also clears the set after notification.
+  struct NotifyActive {
+    std::set< ISocket * > & s_;
+    PollTimer & timer_;
+    NotifyActive( std::set< ISocket * > & s, PollTimer & timer ) : s_( s ), timer_( timer ) {
+    }
+    ~NotifyActive() {
+      timer_.enter( EP_notify );
+      std::set< ISocket * > tmp;
+      tmp.swap( s_ );
+      std::for_each( tmp.begin(), tmp.end(), notify );
+    }
+    static void notify( ISocket * s ) {
+      Socket * ss = static_cast< Socket * >( s );
+      if( !ss->notify_ ) {
+        //  The socket notify was removed from this socket while in-flight!
+        //  User won't really hear about this through the regular channel.
+        impl::etwork_error_from( ss, ss->mgr_, EtworkError( ES_warning, EA_session, EO_internal_error ) );
+      }
+      else {
+        ss->notify_->onNotify();
+      }
+    }
+  };
+
+  //  ShardedServer is what CreateShardedEtwork() returns: a number of 
+  //  socket managers listening to the same port, each one driven by 
+  //  the user's IShardHandler on a thread of its own.
+  class ShardedServer : public IShardedServer {
+    public:
+      ShardedServer( IShardHandler * handler );
+      virtual ~ShardedServer();
+
+      //  IShardedServer
+      virtual int count();
+      virtual ISocketManager * shard( int index );
+      virtual void join();
+      virtual void dispose();
 
-      //  because of async I/O, I actually need a third buffer for writing
-      char * writebuf_;
-      size_t writebufData_;
+      bool start( int index );
+      void run( int index );
+
+      struct Shard {
+        ShardedServer * srv_;
+        int index_;
+        ISocketManager * mgr_;
+        bool running_;          //  whether thread_ needs joining
+#if defined( WIN32 )
+        HANDLE thread_;
+#else
+        pthread_t thread_;
+#endif
+      };
+      IShardHandler * handler_;
+      std::vector< Shard > shards_;
+  };
+
+#if defined( __linux__ )
+  //  UringSocketManager is the io_uring engine (EE_uring). Instead of 
+  //  waiting for readiness and then calling recv()/send() per socket, 
+  //  it keeps a recv outstanding on every socket, and submits all new 
+  //  recv/send/accept requests and collects completions with a single 
+  //  io_uring_enter() per pass through poll(). The rest of a message 
+  //  that has started arriving is received right where it goes in 
+  //  bufIn_; headers and small messages come in through buffers that 
+  //  the kernel takes from one ring the manager provides, so that 
+  //  memory doesn't grow with the number of sockets. Sends go out 
+  //  straight from bufOut_. Each socket gets a slot, which outlives 
+  //  it, and keeps a disposed socket, until the kernel is done with 
+  //  its requests. Only reliable managers use this engine.
+  class UringSocketManager : public SocketManager {
+    public:
+      UringSocketManager();
+      ~UringSocketManager();
+
+      virtual int poll( double seconds, ISocket ** outActive, int maxActive );
+
+      virtual bool open_engine();
+      virtual void add_socket( Socket * s );
+      virtual void remove_socket( Socket * s );
+      virtual void stop_reading( Socket * s );
+      virtual void start_reading( Socket * s );
+      virtual bool linger( Socket * s );
+
+      struct Slot {
+        Socket * sock_;       //  NULL once the socket is closed
+        Socket * owner_;      //  whose buffers the requests use, until the slot is released
+        unsigned int sendData_; //  bytes offered in the send in flight
+        unsigned char inflight_; //  requests the kernel still owns
+        bool recving_ : 1;
+        bool direct_ : 1;     //  the recv in flight is into bufIn_, not a provided buffer
+        bool sending_ : 1;
+        bool connecting_ : 1; //  waiting for the socket to connect
+        bool disposed_ : 1;   //  owner_ was disposed; it goes with the slot
+      };
+      //  What a send hands the kernel; it is read when the send is 
+      //  submitted, so these only last a pass.
+      struct SendMsg {
+        msghdr msg_;
+        iovec iov_[Socket::WRITE_SEGMENTS];
+      };
+
+      int new_slot( Socket * s );
+      void release_slot( int slot );
+      char * recv_buffer( unsigned short bid );
+      void provide_buffer( unsigned short bid );
+      io_uring_sqe * get_sqe();
+      void prep( io_uring_sqe * sqe, int op, SOCKET s, void * addr, size_t len, unsigned long long data );
+      void start_accept();
+      void start_connect( int slot );
+      void start_resolve();
+      void start_wake();
+      void start_recv( int slot );
+      void start_send( Socket * s );
+      int enter( unsigned int toSubmit, unsigned int minComplete, double timeout );
+      bool reap( size_t maxActive );
+      void complete( unsigned long long data, int res, unsigned int flags );
+      void mark_active( Socket * s );
+
+      int ring_;
+      void * sqRing_;
+      size_t sqRingSize_;
+      void * cqRing_;
+      size_t cqRingSize_;
+      io_uring_sqe * sqes_;
+      size_t sqesSize_;
+      unsigned int * sqHead_;
+      unsigned int * sqTail_;
+      unsigned int sqMask_;
+      unsigned int * sqArray_;
+      unsigned int sqEntries_;
+      unsigned int * cqHead_;
+      unsigned int * cqTail_;
+      unsigned int cqMask_;
+      io_uring_cqe * cqes_;
+      unsigned int toSubmit_;
+
+      io_uring_buf_ring * bufRing_;   //  the provided receive buffers
+      unsigned short bufTail_;
+      char * recvBufs_;     //  RECV_BUFFERS of maxMessageSize bytes
+      std::deque< SendMsg > sendMsgs_;  //  deque, so that they stay put while it grows
+      std::vector< Slot > slots_;
+      std::vector< int > freeSlots_;
+      std::vector< int > rearm_;  //  slots whose recv completed
+      bool accepting_;
+      bool resolving_;      //  waiting for the resolver's socket
+      bool waking_;         //  waiting for the wakeup eventfd
+      sockaddr_in acceptAddr_;
+      SOCKLEN acceptLen_;
   };
+#endif
 }
 
 #endif  //  etwork_sockimpl_h
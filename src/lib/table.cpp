@@ -0,0 +1,185 @@
+
+#include "sockimpl.h"
+
+#include <string.h>
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+void SocketTable::insert( SOCKET s, Socket * so )
+{
+  if( (size_t)s < MAX_DIRECT ) {
+    if( (size_t)s >= slots_.size() ) {
+      size_t n = slots_.size() ? slots_.size() : 64;
+      while( n <= (size_t)s ) {
+        n *= 2;
+      }
+      slots_.resize( n, 0 );
+    }
+    if( slots_[(size_t)s] ) {
+      erase( s );
+    }
+    slots_[(size_t)s] = so;
+  }
+  else {
+    if( overflow_.find( s ) != overflow_.end() ) {
+      erase( s );
+    }
+    overflow_[s] = so;
+  }
+  so->tableIndex_ = (unsigned int)live_.size();
+  live_.push_back( so );
+}
+
+//  The last socket in live_ moves into the hole, so walking the table
+//  while erasing from it has to go back to front (or start over).
+bool SocketTable::erase( SOCKET s )
+{
+  Socket * so;
+  if( (size_t)s < slots_.size() ) {
+    so = slots_[(size_t)s];
+    slots_[(size_t)s] = 0;
+  }
+  else {
+    std::map< SOCKET, Socket * >::iterator ptr = overflow_.find( s );
+    if( ptr == overflow_.end() ) {
+      return false;
+    }
+    so = (*ptr).second;
+    overflow_.erase( ptr );
+  }
+  if( !so ) {
+    return false;
+  }
+  Socket * last = live_.back();
+  live_[so->tableIndex_] = last;
+  last->tableIndex_ = so->tableIndex_;
+  live_.pop_back();
+  return true;
+}
+
+Socket * SocketTable::find_overflow( SOCKET s ) const
+{
+  std::map< SOCKET, Socket * >::const_iterator ptr = overflow_.find( s );
+  if( ptr == overflow_.end() ) {
+    return 0;
+  }
+  return (*ptr).second;
+}
+
+
+namespace {
+  size_t const ADDRESS_TABLE_START = 64;  //  entries; must be a power of two
+}
+
+AddressTable::AddressTable()
+{
+  entries_ = new Entry[ ADDRESS_TABLE_START ];
+  memset( entries_, 0, sizeof( Entry ) * ADDRESS_TABLE_START );
+  mask_ = ADDRESS_TABLE_START - 1;
+  shift_ = 64 - 6;
+  count_ = 0;
+}
+
+AddressTable::~AddressTable()
+{
+  delete[] entries_;
+}
+
+void AddressTable::find_batch( sockaddr_in const * addrs, size_t n, Socket ** out ) const
+{
+  //  Get all the cache misses going before waiting on the first one.
+  Key keys[64];
+  size_t homes[64];
+  while( n > 0 ) {
+    size_t m = std::min( n, (size_t)64 );
+    for( size_t i = 0; i < m; ++i ) {
+      keys[i] = make_key( addrs[i] );
+      homes[i] = home( keys[i] );
+#if defined( __GNUC__ )
+      __builtin_prefetch( &entries_[homes[i]] );
+#endif
+    }
+    for( size_t i = 0; i < m; ++i ) {
+      out[i] = 0;
+      for( size_t j = homes[i]; entries_[j].key_; j = (j + 1) & mask_ ) {
+        if( entries_[j].key_ == keys[i] ) {
+          out[i] = entries_[j].sock_;
+          break;
+        }
+      }
+    }
+    addrs += m;
+    out += m;
+    n -= m;
+  }
+}
+
+void AddressTable::insert( sockaddr_in const & addr, Socket * s )
+{
+  //  keep it at most half full, so probes stay short
+  if( (count_ + 1) * 2 > mask_ + 1 ) {
+    grow();
+  }
+  Key k = make_key( addr );
+  size_t i = home( k );
+  while( entries_[i].key_ && entries_[i].key_ != k ) {
+    i = (i + 1) & mask_;
+  }
+  if( !entries_[i].key_ ) {
+    entries_[i].key_ = k;
+    ++count_;
+  }
+  entries_[i].sock_ = s;
+}
+
+bool AddressTable::erase( sockaddr_in const & addr )
+{
+  Key k = make_key( addr );
+  size_t i = home( k );
+  while( entries_[i].key_ != k ) {
+    if( !entries_[i].key_ ) {
+      return false;
+    }
+    i = (i + 1) & mask_;
+  }
+  //  Move later entries of the same run back into the hole, unless
+  //  that would put them in front of their home.
+  size_t j = i;
+  while( true ) {
+    j = (j + 1) & mask_;
+    if( !entries_[j].key_ ) {
+      break;
+    }
+    size_t h = home( entries_[j].key_ );
+    if( ((j - h) & mask_) >= ((j - i) & mask_) ) {
+      entries_[i] = entries_[j];
+      i = j;
+    }
+  }
+  entries_[i].key_ = 0;
+  entries_[i].sock_ = 0;
+  --count_;
+  return true;
+}
+
+void AddressTable::grow()
+{
+  Entry * old = entries_;
+  size_t oldSize = mask_ + 1;
+  entries_ = new Entry[ oldSize * 2 ];
+  memset( entries_, 0, sizeof( Entry ) * oldSize * 2 );
+  mask_ = oldSize * 2 - 1;
+  --shift_;
+  for( size_t i = 0; i < oldSize; ++i ) {
+    if( old[i].key_ ) {
+      size_t j = home( old[i].key_ );
+      while( entries_[j].key_ ) {
+        j = (j + 1) & mask_;
+      }
+      entries_[j] = old[i];
+    }
+  }
+  delete[] old;
+}
@@ -0,0 +1,53 @@
+
+#include "sockimpl.h"
+
+using namespace etwork;
+using namespace etwork::impl;
+
+//  Trace errors belong to the manager, so asyncErrors and its notify 
+//  apply to them.
+static void trace_error( SocketManager * sm, char const * fmt, char const * path )
+{
+  char buf[2048];
+  _snprintf( buf, 2048, fmt, path );
+  buf[2047] = 0;
+  EtworkError err( ES_warning, EA_unknown, EO_no_error );
+  err.setText( buf );
+  etwork_error_from( 0, sm, err );
+}
+
+//  Once the ring has gone around, the oldest record is the one that
+//  is to be written over next.
+bool SocketManager::dump_trace( char const * path )
+{
+  size_t size = traceMask_ + 1;
+  EtworkTraceHeader hdr;
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, "ETWTRACE", 8 );
+  hdr.version = 1;
+  hdr.recordSize = sizeof( EtworkTraceRecord );
+  hdr.total = traced_;
+  hdr.count = traced_ < size ? traced_ : size;
+  size_t first = traced_ < size ? 0 : (size_t)(traced_ & traceMask_);
+
+  FILE * f = fopen( path, "wb" );
+  if( !f ) {
+    trace_error( this, "Could not open %s to dump the trace into.", path );
+    return false;
+  }
+  bool ok = fwrite( &hdr, sizeof( hdr ), 1, f ) == 1;
+  size_t older = (size_t)hdr.count - first;
+  if( ok && older > 0 ) {
+    ok = fwrite( &trace_[first], sizeof( EtworkTraceRecord ), older, f ) == older;
+  }
+  if( ok && first > 0 ) {
+    ok = fwrite( trace_, sizeof( EtworkTraceRecord ), first, f ) == first;
+  }
+  if( fclose( f ) != 0 ) {
+    ok = false;
+  }
+  if( !ok ) {
+    trace_error( this, "Could not write the trace to %s.", path );
+  }
+  return ok;
+}
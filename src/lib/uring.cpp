@@ -0,0 +1,819 @@
+
+#include "sockimpl.h"
+
+#if defined( __linux__ )
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace etwork;
+using namespace etwork::impl;
+
+//  The io_uring engine talks to the kernel directly through the three
+//  io_uring system calls, rather than through liburing, so that there
+//  is nothing extra to install to build Etwork.
+//
+//  Each request carries its slot index and what kind of request it is
+//  in user_data, so a completion for a socket that has since gone away
+//  can still be matched up with the slot that owns the memory.
+namespace {
+  enum {
+    OP_ACCEPT = 0,
+    OP_RECV = 1,
+    OP_SEND = 2,
+    OP_CANCEL = 3,
+    OP_CONNECT = 4,
+    OP_RESOLVE = 5,
+    OP_WAKE = 6,
+    OP_BITS = 3,
+  };
+
+  //  Submission queue depth. If it fills up within a pass, it gets
+  //  flushed to the kernel early; the completion queue is bigger, and
+  //  the kernel buffers any overflow (IORING_FEAT_NODROP).
+  unsigned int const SQ_ENTRIES = 256;
+  unsigned int const CQ_ENTRIES = 4096;
+  //  Provided receive buffers (a power of two). A recv that finds none 
+  //  left goes again next pass, when this pass's have come back.
+  unsigned int const RECV_BUFFERS = 128;
+  unsigned short const RECV_GROUP = 0;
+
+  inline unsigned long long make_data( int slot, int op ) {
+    return ((unsigned long long)slot << OP_BITS) | op;
+  }
+  inline unsigned int load_acquire( unsigned int * p ) {
+    return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+  }
+  inline void store_release( unsigned int * p, unsigned int v ) {
+    __atomic_store_n( p, v, __ATOMIC_RELEASE );
+  }
+}
+
+UringSocketManager::UringSocketManager()
+{
+  ring_ = -1;
+  sqRing_ = 0;
+  sqRingSize_ = 0;
+  cqRing_ = 0;
+  cqRingSize_ = 0;
+  sqes_ = 0;
+  sqesSize_ = 0;
+  toSubmit_ = 0;
+  bufRing_ = 0;
+  bufTail_ = 0;
+  recvBufs_ = 0;
+  accepting_ = false;
+  resolving_ = false;
+  waking_ = false;
+  acceptLen_ = 0;
+}
+
+UringSocketManager::~UringSocketManager()
+{
+  //  Closing the ring cancels whatever the kernel still has in flight,
+  //  so the memory it used can go away after that.
+  if( ring_ >= 0 ) {
+    ::close( ring_ );
+    ring_ = -1;
+  }
+  for( size_t i = 0, n = slots_.size(); i < n; ++i ) {
+    if( slots_[i].disposed_ ) {
+      delete slots_[i].owner_;
+    }
+  }
+  if( bufRing_ ) {
+    ::munmap( bufRing_, RECV_BUFFERS * sizeof( io_uring_buf ) );
+  }
+  delete[] recvBufs_;
+  if( sqes_ ) {
+    ::munmap( sqes_, sqesSize_ );
+  }
+  if( cqRing_ && cqRing_ != sqRing_ ) {
+    ::munmap( cqRing_, cqRingSize_ );
+  }
+  if( sqRing_ ) {
+    ::munmap( sqRing_, sqRingSize_ );
+  }
+}
+
+bool UringSocketManager::open_engine()
+{
+  io_uring_params p;
+  memset( &p, 0, sizeof( p ) );
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = CQ_ENTRIES;
+  ring_ = (int)::syscall( __NR_io_uring_setup, SQ_ENTRIES, &p );
+  if( ring_ < 0 ) {
+    //  Typically a kernel that is too old, or a sandbox that doesn't allow it.
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::io_uring_setup()" );
+    etwork_log( 0, ES_warning, "io_uring is not available; using the default engine." );
+    return SocketManager::open_engine();
+  }
+  //  SUBMIT_STABLE means a SendMsg only has to last until it is submitted.
+  if( !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) 
+      || !(p.features & IORING_FEAT_SUBMIT_STABLE) ) {
+    etwork_log( 0, ES_warning, "io_uring is too old; using the default engine." );
+    ::close( ring_ );
+    ring_ = -1;
+    return SocketManager::open_engine();
+  }
+
+  sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof( unsigned int );
+  cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof( io_uring_cqe );
+  if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( cqRingSize_ > sqRingSize_ ) {
+      sqRingSize_ = cqRingSize_;
+    }
+    cqRingSize_ = sqRingSize_;
+  }
+  void * m = ::mmap( 0, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_, IORING_OFF_SQ_RING );
+  if( m == MAP_FAILED ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::mmap(IORING_OFF_SQ_RING)" );
+    return false;
+  }
+  sqRing_ = m;
+  if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    cqRing_ = sqRing_;
+  }
+  else {
+    m = ::mmap( 0, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring_, IORING_OFF_CQ_RING );
+    if( m == MAP_FAILED ) {
+      debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::mmap(IORING_OFF_CQ_RING)" );
+      return false;
+    }
+    cqRing_ = m;
+  }
+  sqesSize_ = p.sq_entries * sizeof( io_uring_sqe );
+  m = ::mmap( 0, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_, IORING_OFF_SQES );
+  if( m == MAP_FAILED ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::mmap(IORING_OFF_SQES)" );
+    return false;
+  }
+  sqes_ = (io_uring_sqe *)m;
+
+  char * sq = (char *)sqRing_;
+  sqHead_ = (unsigned int *)(sq + p.sq_off.head);
+  sqTail_ = (unsigned int *)(sq + p.sq_off.tail);
+  sqMask_ = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  sqArray_ = (unsigned int *)(sq + p.sq_off.array);
+  sqEntries_ = p.sq_entries;
+  char * cq = (char *)cqRing_;
+  cqHead_ = (unsigned int *)(cq + p.cq_off.head);
+  cqTail_ = (unsigned int *)(cq + p.cq_off.tail);
+  cqMask_ = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  //  The ring of provided receive buffers is memory we share with the 
+  //  kernel; it must be page aligned.
+  m = ::mmap( 0, RECV_BUFFERS * sizeof( io_uring_buf ), PROT_READ | PROT_WRITE, 
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( m == MAP_FAILED ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::mmap(provided buffers)" );
+    return false;
+  }
+  bufRing_ = (io_uring_buf_ring *)m;
+  io_uring_buf_reg reg;
+  memset( &reg, 0, sizeof( reg ) );
+  reg.ring_addr = (unsigned long long)bufRing_;
+  reg.ring_entries = RECV_BUFFERS;
+  reg.bgid = RECV_GROUP;
+  int r = (int)::syscall( __NR_io_uring_register, ring_, IORING_REGISTER_PBUF_RING, &reg, 1 );
+  if( r < 0 ) {
+    debug_sock_error( 0, ::WSAGetLastError(), EA_init, "::io_uring_register(IORING_REGISTER_PBUF_RING)" );
+    etwork_log( 0, ES_warning, "io_uring is too old; using the default engine." );
+    ::close( ring_ );
+    ring_ = -1;
+    return SocketManager::open_engine();
+  }
+  recvBufs_ = new char[ RECV_BUFFERS * settings_.maxMessageSize ];
+  for( unsigned int i = 0; i < RECV_BUFFERS; ++i ) {
+    provide_buffer( (unsigned short)i );
+  }
+
+  if( !IS_SOCKET_ERROR( listening_ ) ) {
+    start_accept();
+  }
+  return true;
+}
+
+void UringSocketManager::add_socket( Socket * s )
+{
+  if( ring_ < 0 ) {
+    SocketManager::add_socket( s );
+    return;
+  }
+  sockets_.insert( s->s_, s );
+  schedule_timeout( s );
+  s->slot_ = new_slot( s );
+  if( s->connecting_ ) {
+    start_connect( s->slot_ );
+  }
+  else {
+    start_recv( s->slot_ );
+  }
+}
+
+void UringSocketManager::remove_socket( Socket * s )
+{
+  if( ring_ >= 0 && s->slot_ >= 0 ) {
+    int slot = s->slot_;
+    Slot & sl = slots_[slot];
+    sl.sock_ = 0;
+    //  The cancels count as in flight, so the slot can't be handed out
+    //  again (with the same user_data) before they have run.
+    if( sl.recving_ ) {
+      io_uring_sqe * sqe = get_sqe();
+      if( sqe ) {
+        prep( sqe, IORING_OP_ASYNC_CANCEL, -1, 0, 0, make_data( slot, OP_CANCEL ) );
+        sqe->addr = make_data( slot, OP_RECV );
+        ++sl.inflight_;
+      }
+    }
+    if( sl.sending_ ) {
+      io_uring_sqe * sqe = get_sqe();
+      if( sqe ) {
+        prep( sqe, IORING_OP_ASYNC_CANCEL, -1, 0, 0, make_data( slot, OP_CANCEL ) );
+        sqe->addr = make_data( slot, OP_SEND );
+        ++sl.inflight_;
+      }
+    }
+    if( sl.connecting_ ) {
+      io_uring_sqe * sqe = get_sqe();
+      if( sqe ) {
+        prep( sqe, IORING_OP_ASYNC_CANCEL, -1, 0, 0, make_data( slot, OP_CANCEL ) );
+        sqe->addr = make_data( slot, OP_CONNECT );
+        ++sl.inflight_;
+      }
+    }
+    if( !sl.inflight_ ) {
+      release_slot( slot );
+    }
+  }
+  SocketManager::remove_socket( s );
+}
+
+int UringSocketManager::new_slot( Socket * s )
+{
+  int slot;
+  if( freeSlots_.size() ) {
+    slot = freeSlots_.back();
+    freeSlots_.pop_back();
+  }
+  else {
+    slot = (int)slots_.size();
+    Slot sl;
+    memset( &sl, 0, sizeof( sl ) );
+    slots_.push_back( sl );
+  }
+  Slot & sl = slots_[slot];
+  sl.sock_ = s;
+  sl.owner_ = s;
+  sl.sendData_ = 0;
+  sl.inflight_ = 0;
+  sl.recving_ = false;
+  sl.direct_ = false;
+  sl.sending_ = false;
+  sl.connecting_ = false;
+  sl.disposed_ = false;
+  return slot;
+}
+
+void UringSocketManager::stop_reading( Socket * s )
+{
+  if( ring_ < 0 ) {
+    SocketManager::stop_reading( s );
+  }
+  //  Else there is nothing to stop; complete() just didn't start another.
+}
+
+void UringSocketManager::start_reading( Socket * s )
+{
+  if( ring_ < 0 ) {
+    SocketManager::start_reading( s );
+    return;
+  }
+  if( s->slot_ >= 0 ) {
+    start_recv( s->slot_ );
+  }
+}
+
+//  The kernel is done with the owner's buffers; a disposed owner can 
+//  go now.
+void UringSocketManager::release_slot( int slot )
+{
+  Slot & sl = slots_[slot];
+  ASSERT( !sl.sock_ && !sl.inflight_ );
+  if( sl.disposed_ ) {
+    delete sl.owner_;
+  }
+  else {
+    sl.owner_->slot_ = -1;
+  }
+  sl.owner_ = 0;
+  sl.disposed_ = false;
+  freeSlots_.push_back( slot );
+}
+
+//  A socket disposed with requests in flight stays until they're done, 
+//  as they may still use its buffers. Closing it cancels them.
+bool UringSocketManager::linger( Socket * s )
+{
+  if( ring_ < 0 ) {
+    return SocketManager::linger( s );
+  }
+  if( s->slot_ < 0 ) {
+    return false;
+  }
+  s->close_socket();
+  if( s->slot_ < 0 ) {
+    return false;   //  nothing was in flight
+  }
+  slots_[s->slot_].disposed_ = true;
+  return true;
+}
+
+char * UringSocketManager::recv_buffer( unsigned short bid )
+{
+  return recvBufs_ + (size_t)bid * settings_.maxMessageSize;
+}
+
+//  Give a receive buffer (back) to the kernel.
+void UringSocketManager::provide_buffer( unsigned short bid )
+{
+  //  The entries start at the ring itself (its tail is in the first 
+  //  one's resv). Not through bufs[], which some headers declare in a 
+  //  way that C++ puts further in.
+  io_uring_buf & b = ((io_uring_buf *)bufRing_)[bufTail_ & (RECV_BUFFERS - 1)];
+  b.addr = (unsigned long long)recv_buffer( bid );
+  b.len = (unsigned int)settings_.maxMessageSize;
+  b.bid = bid;
+  ++bufTail_;
+  __atomic_store_n( &bufRing_->tail, bufTail_, __ATOMIC_RELEASE );
+}
+
+io_uring_sqe * UringSocketManager::get_sqe()
+{
+  unsigned int tail = *sqTail_;
+  if( tail - load_acquire( sqHead_ ) >= sqEntries_ ) {
+    //  Full; hand what we have to the kernel now.
+    enter( toSubmit_, 0, 0 );
+    if( tail - load_acquire( sqHead_ ) >= sqEntries_ ) {
+      return 0;
+    }
+  }
+  io_uring_sqe * sqe = &sqes_[tail & sqMask_];
+  memset( sqe, 0, sizeof( *sqe ) );
+  return sqe;
+}
+
+void UringSocketManager::prep( io_uring_sqe * sqe, int op, SOCKET s, void * addr, size_t len, unsigned long long data )
+{
+  sqe->opcode = (unsigned char)op;
+  sqe->fd = s;
+  sqe->addr = (unsigned long long)addr;
+  sqe->len = (unsigned int)len;
+  sqe->user_data = data;
+  //  Publish the entry. get_sqe() gave us the entry at the tail.
+  unsigned int tail = *sqTail_;
+  sqArray_[tail & sqMask_] = (unsigned int)(sqe - sqes_);
+  store_release( sqTail_, tail + 1 );
+  ++toSubmit_;
+}
+
+void UringSocketManager::start_accept()
+{
+  if( accepting_ ) {
+    return;
+  }
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    return;   //  try again next pass
+  }
+  acceptLen_ = sizeof( acceptAddr_ );
+  prep( sqe, IORING_OP_ACCEPT, listening_, &acceptAddr_, 0, make_data( 0, OP_ACCEPT ) );
+  sqe->addr2 = (unsigned long long)&acceptLen_;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  accepting_ = true;
+}
+
+//  Wait for a non-blocking connect() to finish; the socket becomes 
+//  writable when it does, or when it fails.
+void UringSocketManager::start_connect( int slot )
+{
+  Slot & sl = slots_[slot];
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    //  no way to find out; let the timeout, if any, deal with it
+    debug_sock_error( sl.sock_, EBUSY, EA_connect, "UringSocketManager::start_connect()" );
+    return;
+  }
+  prep( sqe, IORING_OP_POLL_ADD, sl.sock_->s_, 0, 0, make_data( slot, OP_CONNECT ) );
+  sqe->poll32_events = POLLOUT;
+  sl.connecting_ = true;
+  ++sl.inflight_;
+}
+
+//  Wait for answers from the name server.
+void UringSocketManager::start_resolve()
+{
+  if( resolving_ || !resolver_.is_open() ) {
+    return;
+  }
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    return;   //  try again next pass
+  }
+  prep( sqe, IORING_OP_POLL_ADD, resolver_.socket(), 0, 0, make_data( 0, OP_RESOLVE ) );
+  sqe->poll32_events = POLLIN;
+  resolving_ = true;
+}
+
+//  Wait for writes posted from other threads.
+void UringSocketManager::start_wake()
+{
+  if( waking_ || wakeup_ < 0 ) {
+    return;
+  }
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    return;   //  try again next pass
+  }
+  prep( sqe, IORING_OP_POLL_ADD, wakeup_, 0, 0, make_data( 0, OP_WAKE ) );
+  sqe->poll32_events = POLLIN;
+  waking_ = true;
+}
+
+void UringSocketManager::start_recv( int slot )
+{
+  Slot & sl = slots_[slot];
+  if( sl.recving_ || !sl.sock_ ) {
+    return;
+  }
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    rearm_.push_back( slot );
+    return;
+  }
+  //  What's left of a message that has started arriving goes right 
+  //  where it belongs in bufIn_; headers go through a provided buffer.
+  void * space = 0;
+  size_t n = sl.sock_->bufIn_.input_space( &space );
+  sl.direct_ = n > 0;
+  if( sl.direct_ ) {
+    prep( sqe, IORING_OP_RECV, sl.sock_->s_, space, n, make_data( slot, OP_RECV ) );
+  }
+  else {
+    prep( sqe, IORING_OP_RECV, sl.sock_->s_, 0, settings_.maxMessageSize, make_data( slot, OP_RECV ) );
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+  }
+  sl.recving_ = true;
+  ++sl.inflight_;
+}
+
+void UringSocketManager::start_send( Socket * s )
+{
+  if( s->slot_ < 0 ) {
+    return;
+  }
+  int slot = s->slot_;
+  Slot & sl = slots_[slot];
+  if( !sl.sock_ || sl.sending_ || s->connecting_ ) {
+    return;   //  the completion will queue it again
+  }
+  //  Queued messages go out straight from bufOut_, framing and all. 
+  //  Writes meanwhile only add after them, so they stay put until the 
+  //  completion consumes what the kernel took.
+  BufferSegment segs[Socket::WRITE_SEGMENTS];
+  int n = s->bufOut_.get_segments( segs, Socket::WRITE_SEGMENTS );
+  if( n == 0 ) {
+    return;
+  }
+  io_uring_sqe * sqe = get_sqe();
+  if( !sqe ) {
+    queue_write( s );
+    return;
+  }
+  sendMsgs_.push_back( SendMsg() );
+  SendMsg & sm = sendMsgs_.back();
+  memset( &sm.msg_, 0, sizeof( sm.msg_ ) );
+  sl.sendData_ = 0;
+  for( int i = 0; i < n; ++i ) {
+    sm.iov_[i].iov_base = (void *)segs[i].data;
+    sm.iov_[i].iov_len = segs[i].size;
+    sl.sendData_ += (unsigned int)segs[i].size;
+  }
+  sm.msg_.msg_iov = sm.iov_;
+  sm.msg_.msg_iovlen = n;
+  //  A plain write() could raise SIGPIPE; sendmsg() with MSG_NOSIGNAL doesn't.
+  prep( sqe, IORING_OP_SENDMSG, s->s_, &sm.msg_, 1, make_data( slot, OP_SEND ) );
+  sqe->msg_flags = SEND_FLAGS;
+  sl.sending_ = true;
+  ++sl.inflight_;
+}
+
+int UringSocketManager::enter( unsigned int toSubmit, unsigned int minComplete, double timeout )
+{
+  unsigned int flags = 0;
+  io_uring_getevents_arg arg;
+  __kernel_timespec ts;
+  if( minComplete ) {
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    ts.tv_sec = (long long)floor( timeout );
+    ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1e9);
+    memset( &arg, 0, sizeof( arg ) );
+    arg.ts = (unsigned long long)&ts;
+  }
+  int r = (int)::syscall( __NR_io_uring_enter, ring_, toSubmit, minComplete, flags,
+      minComplete ? &arg : 0, sizeof( arg ) );
+  if( r > 0 ) {
+    toSubmit_ -= r;
+  }
+  if( !toSubmit_ ) {
+    //  The kernel has read the sends' SendMsgs.
+    sendMsgs_.clear();
+  }
+  return r;
+}
+
+void UringSocketManager::mark_active( Socket * s )
+{
+  if( s->notify_ ) {
+    notify_.insert( s );
+  }
+  else {
+    active_.insert( s );
+  }
+}
+
+//  Return false if the active array filled up before all completions
+//  were handled; the rest stay in the completion queue until next time.
+bool UringSocketManager::reap( size_t maxActive )
+{
+  unsigned int head = *cqHead_;
+  unsigned int tail = load_acquire( cqTail_ );
+  while( head != tail ) {
+    io_uring_cqe * cqe = &cqes_[head & cqMask_];
+    unsigned long long data = cqe->user_data;
+    int res = cqe->res;
+    unsigned int flags = cqe->flags;
+    ++head;
+    store_release( cqHead_, head );
+    complete( data, res, flags );
+    if( active_.size() >= maxActive ) {
+      if( settings_.debug ) {
+        OutputDebugString( "Etwork: UringSocketManager::poll() filled up the active socket array.\n" );
+      }
+      return false;
+    }
+    if( head == tail ) {
+      tail = load_acquire( cqTail_ );
+    }
+  }
+  return true;
+}
+
+void UringSocketManager::complete( unsigned long long data, int res, unsigned int flags )
+{
+  int op = (int)(data & ((1 << OP_BITS) - 1));
+  int slot = (int)(data >> OP_BITS);
+  if( op == OP_ACCEPT ) {
+    accepting_ = false;
+    if( res < 0 ) {
+      if( res != -ECANCELED ) {
+        debug_sock_error( 0, -res, EA_session, "io_uring accept()" );
+      }
+      return;
+    }
+    SOCKET so = res;
+    int one = 1;
+    ::setsockopt( so, IPPROTO_TCP, TCP_NODELAY, (char const *)&one, sizeof(one) );
+    Socket * s = new Socket( this, so, acceptAddr_ );
+    accepted_.push_back( s );
+    trace( ET_accept, so, 0 );
+    start_accept();
+    return;
+  }
+  if( op == OP_RESOLVE ) {
+    resolving_ = false;
+    resolver_.handle_read( curTime_ );
+    finish_lookups();
+    return;
+  }
+  if( op == OP_WAKE ) {
+    waking_ = false;
+    take_wakeup();
+    drain_writes();
+    return;
+  }
+
+  Socket * s = slots_[slot].sock_;
+  switch( op ) {
+
+    case OP_RECV: {
+      slots_[slot].recving_ = false;
+      --slots_[slot].inflight_;
+      char * buf = 0;
+      unsigned short bid = 0;
+      if( flags & IORING_CQE_F_BUFFER ) {
+        bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+        buf = recv_buffer( bid );
+      }
+      if( buf && (!s || res <= 0) ) {
+        provide_buffer( bid );
+        buf = 0;
+      }
+      if( !s ) {
+        break;
+      }
+      if( res > 0 ) {
+        s->lastActive_ = curTime_;
+        size_t had = s->bufIn_.message_count();
+        int w = buf ? s->bufIn_.put_data( buf, res ) : s->bufIn_.commit_input( res );
+        if( buf ) {
+          provide_buffer( bid );
+        }
+        s->count_input( res, s->bufIn_.message_count() - had );
+        if( w < 0 ) {
+          s->count_drop();
+          etwork_error_from( s, this, EtworkError( ES_warning, EA_session, EO_buffer_full ) );
+        }
+        //  Without room for another receive, the slot stays idle, and the 
+        //  rest waits in the kernel until unpark() starts it again.
+        if( s->wants_to_read() ) {
+          rearm_.push_back( slot );
+        }
+        else {
+          park( s );
+        }
+      }
+      else if( res == 0 ) {
+        //  this means the socket closed!
+        s->close_socket();
+      }
+      else if( res == -EAGAIN || res == -EINTR || res == -ENOBUFS ) {
+        //  ENOBUFS: the provided buffers ran out, and come back this pass
+        rearm_.push_back( slot );
+        break;
+      }
+      else {
+        debug_sock_error( s, -res, EA_session, "io_uring recv() in UringSocketManager::complete()" );
+        s->close_socket();
+      }
+      mark_active( s );
+    }
+    break;
+
+    case OP_SEND: {
+      Slot & sl = slots_[slot];
+      sl.sending_ = false;
+      --sl.inflight_;
+      if( !s ) {
+        break;
+      }
+      if( res >= 0 ) {
+        s->count_sent( res, sl.sendData_ );
+        s->bufOut_.consume( res );
+        s->lastKeepalive_ = curTime_;
+        if( s->wants_to_write() ) {
+          queue_write( s );
+        }
+        mark_active( s );
+      }
+      else if( res == -EAGAIN || res == -EINTR ) {
+        queue_write( s );
+      }
+      else {
+        debug_sock_error( s, -res, EA_session, "io_uring send() in UringSocketManager::complete()" );
+        s->close_socket();
+        mark_active( s );
+      }
+    }
+    break;
+
+    case OP_CONNECT: {
+      slots_[slot].connecting_ = false;
+      --slots_[slot].inflight_;
+      if( !s ) {
+        break;
+      }
+      finish_connect( s );
+      if( !s->closed() ) {
+        start_recv( slot );
+        if( s->wants_to_write() ) {
+          queue_write( s );
+        }
+      }
+    }
+    break;
+
+    case OP_CANCEL: {
+      --slots_[slot].inflight_;
+    }
+    break;
+  }
+  //  Closing the socket above may have released the slot already.
+  Slot & sl = slots_[slot];
+  if( sl.owner_ && !sl.sock_ && !sl.inflight_ ) {
+    release_slot( slot );
+  }
+}
+
+int UringSocketManager::poll( double seconds, ISocket ** outActive, int maxActive )
+{
+  if( ring_ < 0 ) {
+    return SocketManager::poll( seconds, outActive, maxActive );
+  }
+  if( maxActive < 1 || !outActive ) {
+    debug_sock_error( 0, WSAEINVAL, EA_session, "UringSocketManager::poll() maxActive" );
+    return -1;
+  }
+  ++stats_.polls;
+
+  memset( outActive, 0, sizeof( *outActive )*maxActive );
+  active_.clear();
+  PollTimer pt( this, seconds );
+  NotifyActive na( notify_, pt );
+
+  //  handle timeouts
+  double now = time_.seconds();
+  curTime_ = now;
+  timeout_sockets();
+  if( settings_.threadedWrites ) {
+    drain_writes();
+  }
+  if( resolver_.busy() || !resolver_.answers_.empty() ) {
+    finish_lookups();
+  }
+
+  if( seconds < 0 ) {
+    seconds = 0;
+  }
+
+again:
+  pt.enter( EP_write );
+  if( pool_.returned_ && !parked_.empty() ) {
+    unpark_sockets();
+  }
+  {
+    //  Put receives back on sockets that got data, and start sends for
+    //  sockets that have queued output. None of this is a system call.
+    std::vector< int > rearm;
+    rearm.swap( rearm_ );
+    for( size_t i = 0, n = rearm.size(); i < n; ++i ) {
+      start_recv( rearm[i] );
+    }
+    std::vector< Socket * > writers;
+    writers.swap( writers_ );
+    for( size_t i = 0, n = writers.size(); i < n; ++i ) {
+      writers[i]->writeQueued_ = false;
+      start_send( writers[i] );
+    }
+    if( !IS_SOCKET_ERROR( listening_ ) ) {
+      start_accept();
+    }
+    if( resolver_.busy() ) {
+      start_resolve();
+    }
+    start_wake();
+  }
+
+  curTime_ = time_.seconds();
+  double then = seconds - curTime_ + now;
+  if( then < 0 ) {
+    then = 0;
+  }
+  //  One system call submits everything, and waits for something to complete.
+  pt.enter( EP_wait );
+  int r = enter( toSubmit_, 1, then );
+  if( r < 0 ) {
+    int err = ::WSAGetLastError();
+    if( err != ETIME && err != EINTR && err != EBUSY ) {
+      debug_sock_error( 0, err, EA_session, "::io_uring_enter()" );
+      if( active_.size() ) {
+        std::copy( active_.begin(), active_.end(), outActive );
+        return (int)active_.size();
+      }
+      return -1;
+    }
+  }
+  curTime_ = time_.seconds();
+  pt.enter( EP_read );
+  if( !reap( maxActive ) ) {
+    goto no_more_actives;
+  }
+
+  then = time_.seconds();
+  if( then-now < seconds ) {
+    goto again;
+  }
+no_more_actives:
+  std::copy( active_.begin(), active_.end(), outActive );
+  return (int)active_.size();
+}
+
+#endif  //  __linux__
@@ -0,0 +1,124 @@
+
+#include "sockimpl.h"
+
+using namespace etwork;
+using namespace etwork::impl;
+
+
+TimingWheel::TimingWheel( double tick )
+{
+  tick_ = tick;
+  now_ = 0;
+  count_ = 0;
+  for( int i = 0; i < WHEEL_SLOTS; ++i ) {
+    near_[i] = 0;
+    far_[i] = 0;
+  }
+}
+
+//  The socket is due on the first tick that ends at or after "when",
+//  so it never comes out of the wheel early.
+void TimingWheel::schedule( Socket * s, double when )
+{
+  cancel( s );
+  double t = ceil( when / tick_ );
+  unsigned long tick;
+  if( t <= (double)now_ ) {
+    tick = now_ + 1;
+  }
+  else if( t - (double)now_ >= (double)(WHEEL_SLOTS * WHEEL_SLOTS) ) {
+    tick = now_ + WHEEL_SLOTS * WHEEL_SLOTS - 1;
+  }
+  else {
+    tick = (unsigned long)t;
+  }
+  insert( s, tick );
+  ++count_;
+}
+
+void TimingWheel::cancel( Socket * s )
+{
+  if( s->wheelPrev_ ) {
+    *s->wheelPrev_ = s->wheelNext_;
+    if( s->wheelNext_ ) {
+      s->wheelNext_->wheelPrev_ = s->wheelPrev_;
+    }
+    s->wheelNext_ = 0;
+    s->wheelPrev_ = 0;
+    --count_;
+  }
+}
+
+//  Moves the sockets that are due by "now" into "out". Expiring a
+//  socket takes it out of the wheel; it's up to the caller to put
+//  it back in with its next deadline.
+void TimingWheel::expire( double now, std::vector< Socket * > & out )
+{
+  double t = floor( now / tick_ );
+  if( t <= (double)now_ ) {
+    return;
+  }
+  if( !count_ ) {
+    //  nothing to walk past; just catch up
+    now_ = (unsigned long)t;
+    return;
+  }
+  if( t - (double)now_ >= (double)(WHEEL_SLOTS * WHEEL_SLOTS) ) {
+    //  We have been away for longer than the wheel reaches,
+    //  so everything in it is due.
+    for( int i = 0; i < WHEEL_SLOTS; ++i ) {
+      take_all( near_[i], out );
+      take_all( far_[i], out );
+    }
+    now_ = (unsigned long)t;
+    return;
+  }
+  unsigned long end = (unsigned long)t;
+  while( now_ < end && count_ ) {
+    ++now_;
+    if( !(now_ & WHEEL_MASK) ) {
+      //  spread the next stretch of the far level over the near level
+      Socket * s = far_[(now_ >> WHEEL_BITS) & WHEEL_MASK];
+      far_[(now_ >> WHEEL_BITS) & WHEEL_MASK] = 0;
+      while( s ) {
+        Socket * next = s->wheelNext_;
+        insert( s, s->wheelTick_ );
+        s = next;
+      }
+    }
+    take_all( near_[now_ & WHEEL_MASK], out );
+  }
+  now_ = end;
+}
+
+void TimingWheel::insert( Socket * s, unsigned long tick )
+{
+  s->wheelTick_ = tick;
+  Socket ** head;
+  if( tick - now_ < WHEEL_SLOTS ) {
+    head = &near_[tick & WHEEL_MASK];
+  }
+  else {
+    head = &far_[(tick >> WHEEL_BITS) & WHEEL_MASK];
+  }
+  s->wheelNext_ = *head;
+  s->wheelPrev_ = head;
+  if( *head ) {
+    (*head)->wheelPrev_ = &s->wheelNext_;
+  }
+  *head = s;
+}
+
+void TimingWheel::take_all( Socket * & list, std::vector< Socket * > & out )
+{
+  Socket * s = list;
+  list = 0;
+  while( s ) {
+    Socket * next = s->wheelNext_;
+    s->wheelNext_ = 0;
+    s->wheelPrev_ = 0;
+    --count_;
+    out.push_back( s );
+    s = next;
+  }
+}
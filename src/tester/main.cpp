@@ -3,12 +3,24 @@
 #include "etwork/buffer.h"
 #include "etwork/errors.h"
 #include "etwork/notify.h"
+#include "etwork/locker.h"
+#include "etwork/timer.h"
 #include "etwork/marshal.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <math.h>
+#include <time.h>
+
+#if !defined( WIN32 )
+#include <sched.h>
+#include <unistd.h>
+#endif
+#if defined( __GLIBC__ )
+#include <malloc.h>
+#endif
 
 #if defined( NDEBUG )
 #pragma warning( disable: 4101 )  //  unreferenced local variable
@@ -51,6 +63,231 @@ void TestEtworkBuffer()
   assert( b.space_used() == 0 );
 }
 
+void TestEtworkBufferVarint()
+{
+  etwork::Buffer b( 100000, 200000, 10, EF_varint );
+  static char big[100000];
+  memset( big, 'v', sizeof( big ) );
+  size_t sizes[] = { 0, 1, 127, 128, 300, 16383, 16384, 100000 };
+  size_t n = sizeof( sizes ) / sizeof( sizes[0] );
+  for( size_t i = 0; i < n; ++i ) {
+    assert( b.put_message( big, sizes[i] ) == (int)sizes[i] );
+  }
+  //  a padded header, from room reserved for more than was used
+  void * room = b.reserve( 1000 );
+  assert( room != 0 );
+  memcpy( room, "tiny", 4 );
+  assert( b.commit( 4 ) == 4 );
+  static char wire[200000];
+  int r = b.get_data( wire, sizeof( wire ) );
+  assert( r == 1+0 + 1+1 + 1+127 + 2+128 + 2+300 + 2+16383 + 3+16384 + 3+100000 + 2+4 );
+  assert( wire[0] == 0 );
+  assert( wire[1] == 1 && wire[2] == 'v' );
+  assert( (unsigned char)wire[131] == 0x80 && wire[132] == 1 );
+  //  in again, a byte at a time at first, so headers come in pieces
+  etwork::Buffer c( 100000, 200000, 10, EF_varint );
+  for( int i = 0; i < 1000; ++i ) {
+    assert( c.put_data( &wire[i], 1 ) == 1 );
+  }
+  assert( c.put_data( &wire[1000], r - 1000 ) == r - 1000 );
+  static char out[100000];
+  for( size_t i = 0; i < n; ++i ) {
+    assert( c.get_message( out, sizeof( out ) ) == (int)sizes[i] );
+    assert( !sizes[i] || (out[0] == 'v' && out[sizes[i]-1] == 'v') );
+  }
+  assert( c.get_message( out, sizeof( out ) ) == 4 );
+  assert( !strncmp( out, "tiny", 4 ) );
+  assert( c.get_message( out, sizeof( out ) ) == -1 );
+}
+
+//  Lots of small messages in one chunk go in as a run; what's at the 
+//  end of it, or doesn't fit, goes the slow way.
+void TestEtworkBufferBulk( int framing )
+{
+  etwork::Buffer b( 100, 1000, 10, framing );
+  char wire[200];
+  int hdr = (framing == EF_varint) ? 1 : 2;
+  int n = 0;
+  for( int i = 0; i < 15; ++i ) {
+    if( hdr == 2 ) {
+      wire[n++] = 0;
+    }
+    wire[n++] = 5;
+    memset( &wire[n], 'a' + i, 5 );
+    n += 5;
+  }
+  //  The first ten fit, and the rest are dropped, even the last, 
+  //  which comes in two pieces.
+  assert( b.put_data( wire, n - 3 ) == n - 3 );
+  assert( b.message_count() == 10 );
+  assert( b.space_used() == 50 );
+  char buf[100];
+  assert( b.get_message( buf, 100 ) == 5 );
+  assert( buf[0] == 'a' && buf[4] == 'a' );
+  assert( b.put_data( &wire[n - 3], 3 ) == 3 );
+  assert( b.message_count() == 9 );
+  for( int i = 1; i < 10; ++i ) {
+    assert( b.get_message( buf, 100 ) == 5 );
+    assert( buf[0] == 'a' + i && buf[4] == 'a' + i );
+  }
+  assert( b.get_message( buf, 100 ) == -1 );
+  //  and a run after a partial message
+  assert( b.put_data( wire, hdr + 2 ) == hdr + 2 );
+  assert( b.put_data( &wire[hdr + 2], 3 * (hdr + 5) - (hdr + 2) ) == 3 * (hdr + 5) - (hdr + 2) );
+  assert( b.message_count() == 3 );
+  assert( b.get_message( buf, 100 ) == 5 && buf[0] == 'a' );
+  assert( b.get_message( buf, 100 ) == 5 && buf[0] == 'b' );
+  assert( b.get_message( buf, 100 ) == 5 && buf[0] == 'c' );
+}
+
+//  Counts what it lends out, and lends no more than one block.
+class TestPool : public etwork::IBufferPool {
+  public:
+    TestPool() : lent_( 0 ), gets_( 0 ) {}
+    virtual void * get( size_t size ) {
+      if( lent_ ) {
+        return 0;
+      }
+      lent_ = size;
+      ++gets_;
+      return ::operator new( size );
+    }
+    virtual void put( void * mem, size_t size ) {
+      assert( size == lent_ );
+      lent_ = 0;
+      ::operator delete( mem );
+    }
+    size_t lent_;
+    int gets_;
+};
+
+void TestEtworkBufferPool()
+{
+  TestPool tp;
+  {
+    etwork::Buffer a( 100, 300, 10 );
+    etwork::Buffer b( 100, 300, 10 );
+    a.set_pool( &tp );
+    b.set_pool( &tp );
+    assert( !a.has_storage() );
+    assert( a.put_message( "hello", 5 ) == 5 );
+    assert( a.has_storage() && tp.lent_ > 0 );
+    //  the pool has nothing more to lend
+    assert( b.put_message( "world", 5 ) == -1 );
+    assert( b.reserve( 5 ) == 0 );
+    char wire[20] = { 0, 5, 'w', 'o', 'r', 'l', 'd' };
+    assert( b.put_data( wire, 7 ) == -1 );
+    assert( b.message_count() == 0 );
+    //  empty again, a gives it back
+    char buf[10];
+    assert( a.get_message( buf, 10 ) == 5 );
+    assert( !a.has_storage() && tp.lent_ == 0 );
+    assert( b.put_data( wire, 7 ) == 7 );
+    assert( b.get_message( buf, 10 ) == 5 );
+    assert( !strncmp( buf, "world", 5 ) );
+    assert( tp.lent_ == 0 );
+    assert( b.put_message( "x", 1 ) == 1 );
+  }
+  //  and the buffer going away gives it back too
+  assert( tp.lent_ == 0 );
+  assert( tp.gets_ == 3 );
+}
+
+//  Gathers what get_segments() describes into one run of bytes.
+int GatherSegments( etwork::Buffer & b, char * out )
+{
+  etwork::BufferSegment segs[4];
+  int n = b.get_segments( segs, 4 );
+  int total = 0;
+  for( int i = 0; i < n; ++i ) {
+    memcpy( &out[total], segs[i].data, segs[i].size );
+    total += (int)segs[i].size;
+  }
+  return total;
+}
+
+void TestEtworkBufferSegments()
+{
+  etwork::Buffer b( 1000, 3000, 10 );
+  b.put_message( "hello, world!", 13 );
+  b.put_message( "", 0 );
+  b.put_message( "1234567890", 10 );
+  char buf[100];
+  assert( GatherSegments( b, buf ) == 2+13+2+2+10 );
+  assert( buf[0] == 0 && buf[1] == 13 );
+  assert( !strncmp( &buf[2], "hello, world!", 13 ) );
+  assert( buf[15] == 0 && buf[16] == 0 );
+  assert( buf[17] == 0 && buf[18] == 10 );
+  //  half a header, then the rest of the first message and a bit more
+  b.consume( 1 );
+  assert( GatherSegments( b, buf ) == 1+13+2+2+10 );
+  assert( buf[0] == 13 );
+  b.consume( 1+13+2+5 );
+  assert( b.space_used() == 10 );
+  assert( b.message_count() == 1 );
+  assert( GatherSegments( b, buf ) == 2+10-5 );
+  assert( !strncmp( buf, "4567890", 7 ) );
+  b.consume( 2+10-5 );
+  assert( b.space_used() == 0 );
+  assert( b.unsent() == 0 );
+  assert( GatherSegments( b, buf ) == 0 );
+
+  //  Held data stays until released.
+  etwork::Buffer r( 100, 200, 4 );
+  char msg[100];
+  for( int round = 0; round < 20; ++round ) {
+    memset( msg, 'a' + round, 100 );
+    assert( r.put_message( msg, 60 + round ) == 60 + round );
+    assert( r.put_message( msg, 30 ) == 30 );
+    size_t total = r.unsent();
+    assert( total == (size_t)(2+60+round+2+30) );
+    r.hold( 10 );
+    assert( r.unsent() == total - 10 );
+    assert( r.message_count() == 2 );
+    r.hold( total - 10 );
+    r.release( 2+60+round );
+    assert( r.message_count() == 1 );
+    assert( r.space_used() == 30 );
+    r.release( total - (2+60+round) );
+    assert( r.message_count() == 0 );
+  }
+  //  A queue that never empties has messages wrapping around the end.
+  int next = 0;
+  for( int round = 0; round < 100; ++round ) {
+    if( round % 3 ) {
+      memset( msg, 'a' + round % 26, 100 );
+      assert( r.put_message( msg, 20 + round % 40 ) == 20 + round % 40 );
+    }
+    else {
+      //  built in place, or on the side when the room would wrap
+      char * room = (char *)r.reserve( 60 );
+      assert( room != 0 );
+      assert( r.put_message( msg, 10 ) == -1 );
+      memset( room, 'a' + round % 26, 20 + round % 40 );
+      assert( r.commit( 20 + round % 40 ) == 20 + round % 40 );
+      assert( r.commit( 0 ) == -1 );
+    }
+    if( r.message_count() == 3 ) {
+      int i;
+      if( round & 1 ) {
+        i = r.get_message( buf, 100 );
+      }
+      else {
+        //  peeking sees the same thing, in one or two pieces
+        etwork::BufferSegment segs[2];
+        i = r.peek_message( segs );
+        assert( i == (int)(segs[0].size + segs[1].size) );
+        memcpy( buf, segs[0].data, segs[0].size );
+        memcpy( &buf[segs[0].size], segs[1].data, segs[1].size );
+        assert( r.skip_message() == i );
+      }
+      assert( i == 20 + next % 40 );
+      assert( buf[0] == 'a' + next % 26 && buf[i-1] == 'a' + next % 26 );
+      ++next;
+    }
+  }
+}
+
 void TestEtworkBufferEvil()
 {
   etwork::Buffer b( 10, 20, 5 );
@@ -79,12 +316,13 @@ void TestEtworkBufferEvil()
   assert( b.get_message( buf, 100 ) == -1 );
 }
 
-void TestEtworkTcp()
+void TestEtworkTcp( int engine = EE_default )
 {
   EtworkSettings es;
   es.accepting = true;
   es.reliable = true;
   es.port = 11147;
+  es.engine = engine;
   ISocketManager * sm = CreateEtwork( &es );
   ISocket * s1;
   int i = sm->connect( "127.0.0.1", 11147, &s1 );
@@ -123,96 +361,1531 @@ void TestEtworkTcp()
   sm->dispose();
 }
 
-void TestEtworkUdp()
+//  A burst bigger than maxMessageSize gets read in one pass, as long 
+//  as it fits the read budget.
+void TestEtworkTcpBurst()
 {
-  EtworkSettings es1;
-  es1.accepting = true;
-  es1.reliable = false;
-  es1.port = 11147;
-  ISocketManager * sm1 = CreateEtwork( &es1 );
-  assert( sm1 != 0 );
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11160;
+  es.queueSize = 30000;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11160, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  char buf[1000];
+  for( int j = 0; j < 20; ++j ) {
+    if( j % 4 == 3 ) {
+      //  built right in the send queue
+      Block b( s1->reserve( 1400 ), 1400 );
+      assert( b.begin() != 0 );
+      memset( buf, 'a' + j, 1000 );
+      b.write( buf, 1000 );
+      i = s1->commit( b.pos() );
+      assert( i == 1000 );
+      continue;
+    }
+    memset( buf, 'a' + j, 1000 );
+    i = s1->write( buf, 1000 );
+    assert( i == 1000 );
+  }
+  assert( s1->commit( 10 ) == -1 );
+  sm->poll( 0, active, 4 );   //  out in one sendmsg()
+  sm->poll( 0, active, 4 );   //  in without a pass per recv()
+  for( int j = 0; j < 20; ++j ) {
+    if( j & 1 ) {
+      //  look at it in place
+      void const * first;
+      size_t firstSize;
+      void const * rest;
+      i = s2->peek( &first, &firstSize, &rest );
+      assert( i == 1000 );
+      assert( ((char const *)first)[0] == 'a' + j );
+      assert( (rest ? ((char const *)rest)[i-firstSize-1] : ((char const *)first)[i-1]) == 'a' + j );
+      s2->consume();
+      continue;
+    }
+    i = s2->read( buf, 1000 );
+    assert( i == 1000 );
+    assert( buf[0] == 'a' + j && buf[999] == 'a' + j );
+  }
+  assert( s2->read( buf, 1000 ) == -1 );
+  void const * first;
+  size_t firstSize;
+  void const * rest;
+  assert( s2->peek( &first, &firstSize, &rest ) == -1 );
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
+
+//  With EF_varint, messages can be bigger than 64 kB; they stream 
+//  through the queues a piece at a time.
+void TestEtworkTcpLarge( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11162;
+  es.engine = engine;
+  es.framing = EF_varint;
+  es.maxMessageSize = 200000;
+  es.queueSize = 300000;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11162, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  static char big[200000];
+  for( int j = 0; j < 200000; ++j ) {
+    big[j] = (char)(j * 7);
+  }
+  assert( s1->write( big, 200000 ) == 200000 );
+  assert( s1->write( "x", 1 ) == 1 );
+  static char got[200000];
+  etwork::Timer t;
+  while( (i = s2->read( got, sizeof( got ) )) < 0 ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( i == 200000 );
+  assert( !memcmp( got, big, 200000 ) );
+  while( (i = s2->read( got, sizeof( got ) )) < 0 ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( i == 1 && got[0] == 'x' );
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
 
+  //  Without it, the old limit stands.
   EtworkSettings es2;
-  es2.accepting = true;
-  es2.reliable = false;
-  es2.port = 11148;
-  ISocketManager * sm2 = CreateEtwork( &es2 );
-  assert( sm2 != 0 );
+  es2.maxMessageSize = 200000;
+  es2.queueSize = 300000;
+  assert( CreateEtwork( &es2 ) == 0 );
+}
 
-  ISocket * s1 = 0;
-  int i = sm1->connect( "127.0.0.1", 11148, &s1 );
+//  A socket that has no room for input isn't read from (nor does poll() 
+//  spin on it) until the user reads; until then, the rest waits in the 
+//  kernel, and none of it is lost.
+void TestEtworkTcpFull( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11172;
+  es.engine = engine;
+  es.maxMessageSize = 1000;
+  es.queueSize = 4000;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11172, &s1 );
   assert( i == 1 );
   ISocket * active[4];
-  i = sm1->poll( 0.1, active, 4 );
-  assert( i == 1 ); // the newly connected socket
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  char buf[100];
+  etwork::Timer t;
+  for( int j = 0; j < 100; ) {
+    assert( t.seconds() < 5 );
+    memset( buf, j, sizeof( buf ) );
+    if( s1->write( buf, sizeof( buf ) ) > 0 ) {
+      ++j;
+    }
+    else {
+      sm->poll( 0.01, active, 4 );
+    }
+  }
+  for( i = 0; i < 10; ++i ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  EtworkSocketStats ss;
+  s2->stats( &ss );
+  assert( ss.messagesIn < 100 );
+  clock_t c = clock();
+  sm->poll( 0.2, active, 4 );
+  assert( clock() - c < CLOCKS_PER_SEC / 10 );
+  for( int j = 0; j < 100; ) {
+    assert( t.seconds() < 5 );
+    i = s2->read( buf, sizeof( buf ) );
+    if( i < 0 ) {
+      sm->poll( 0.01, active, 4 );
+      continue;
+    }
+    assert( i == 100 && buf[0] == (char)j && buf[99] == (char)j );
+    ++j;
+  }
+  s2->stats( &ss );
+  assert( ss.messagesIn == 100 && ss.drops == 0 );
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
 
-  i = sm2->poll( 0.1, active, 4 );
-  assert( i == 0 );
+//  With a memoryBudget of one queue, sockets take turns having one.
+void TestEtworkMemoryBudget()
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11163;
+  es.queueSize = 4000;
+  es.maxMessageCount = 50;
+  es.memoryBudget = 4000 + 2 * 51;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11163, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
   ISocket * s2 = 0;
-  i = sm2->accept( &s2, 1 );
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( s1->write( "hello", 5 ) == 5 );
+  assert( s2->write( "world", 5 ) == -1 );
+  char buf[10];
+  etwork::Timer t;
+  while( s2->read( buf, 10 ) < 0 ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( !strncmp( buf, "hello", 5 ) );
+  assert( s2->write( "world", 5 ) == 5 );
+  while( s1->read( buf, 10 ) < 0 ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( !strncmp( buf, "world", 5 ) );
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+
+  //  A socket that can't have a queue waits, without poll() spinning on 
+  //  it, until another one gives its queue back.
+  EtworkSettings es1;
+  es1.reliable = true;
+  ISocketManager * sm1 = CreateEtwork( &es1 );
+  assert( sm1 != 0 );
+  es.port = 11173;
+  ISocketManager * sm2 = CreateEtwork( &es );
+  assert( sm2 != 0 );
+  ISocket * c[2];
+  ISocket * r[2];
+  for( int j = 0; j < 2; ++j ) {
+    assert( sm1->connect( "127.0.0.1", 11173, &c[j] ) == 1 );
+    while( sm2->accept( &r[j], 1 ) == 0 ) {
+      assert( t.seconds() < 10 );
+      sm1->poll( 0, active, 4 );
+      sm2->poll( 0.01, active, 4 );
+    }
+  }
+  assert( c[0]->write( "hello", 5 ) == 5 );
+  EtworkSocketStats ss;
+  do {
+    assert( t.seconds() < 10 );
+    sm1->poll( 0, active, 4 );
+    sm2->poll( 0.01, active, 4 );
+    r[0]->stats( &ss );
+  } while( ss.messagesIn == 0 );
+  assert( c[1]->write( "world", 5 ) == 5 );
+  sm1->poll( 0.01, active, 4 );
+  etwork::Timer wait;
+  clock_t cpu = clock();
+  sm2->poll( 0.2, active, 4 );
+  assert( wait.seconds() > 0.1 && clock() - cpu < CLOCKS_PER_SEC / 10 );
+  r[1]->stats( &ss );
+  assert( ss.messagesIn == 0 && ss.drops == 0 );
+  assert( r[0]->read( buf, 10 ) == 5 );
+  while( r[1]->read( buf, 10 ) < 0 ) {
+    assert( t.seconds() < 10 );
+    sm2->poll( 0.01, active, 4 );
+  }
+  assert( !strncmp( buf, "world", 5 ) );
+  for( int j = 0; j < 2; ++j ) {
+    c[j]->dispose();
+    r[j]->dispose();
+  }
+  sm1->dispose();
+  sm2->dispose();
+}
+
+void TestEtworkStats( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11165;
+  es.engine = engine;
+  es.queueSize = 4000;
+  es.maxMessageCount = 50;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11165, &s1 );
   assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  for( i = 0; i < 3; ++i ) {
+    assert( s1->write( "0123456789", 10 ) == 10 );
+  }
+  EtworkSocketStats ss;
+  s1->stats( &ss );
+  assert( ss.messagesOut == 3 && ss.queueOut == 30 && ss.queueOutHigh == 30 );
+  etwork::Timer t;
+  do {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+    s2->stats( &ss );
+  } while( ss.messagesIn < 3 );
+  assert( ss.bytesIn == 3 * 12 && ss.queueIn == 30 && ss.queueInHigh >= 10 );
+  char buf[10];
+  while( s2->read( buf, 10 ) >= 0 ) {
+  }
+  s2->stats( &ss );
+  assert( ss.queueIn == 0 && ss.messagesOut == 0 && ss.bytesOut == 0 );
+  s1->stats( &ss );
+  assert( ss.bytesOut == 3 * 12 && ss.queueOut == 0 && ss.queueOutHigh == 30 );
+  assert( ss.messagesIn == 0 && ss.writesRefused == 0 );
 
-  char buf[200];
-  assert( s2->read( buf, 200 ) == -1 );   //  can't receive data until accepted
-  i = s2->write( "hello, world!\n", 14 );
-  assert( i == 14 );
-  i = s2->write( "xyzzy", 6 );
-  assert( i == 6 );
+  //  Fill the output queue until it says no.
+  char big[1400];
+  memset( big, 0, sizeof( big ) );
+  int n = 0;
+  while( s1->write( big, sizeof( big ) ) > 0 ) {
+    ++n;
+  }
+  assert( n > 0 );
+  assert( s1->reserve( 1400 ) == 0 );
+  s1->stats( &ss );
+  assert( ss.messagesOut == 3 + (unsigned int)n && ss.writesRefused == 2 );
 
-  i = sm1->poll( 0.1, active, 4 );
-  assert( i == 1 );   //  s1 is receiving greeting message
-  assert( active[0] == s1 );
-  i = s1->read( buf, 200 );
-  assert( i == 0 );
-  i = s1->read( buf, 200 );
-  assert( i == -1 );
-  i = sm2->poll( 0.1, active, 4 );
-  assert( i == 1 );   //  s2 just sent data
-  i = sm1->poll( 0.1, active, 4 );
-  assert( i == 1 );   //  s1 received it
-  assert( s2->read( buf, 200 ) == -1 );
-  i = s1->read( buf, 200 );
-  assert( i == 14 );
-  assert( !strncmp( buf, "hello, world!\n", 14 ) );
-  i = s1->read( buf, 200 );
-  assert( i == 6 );
-  assert( !strncmp( buf, "xyzzy", 6 ) );
+  EtworkStats ms;
+  sm->stats( &ms );
+  assert( ms.polls > 0 && ms.messagesIn == 3 && ms.messagesOut == 3 + (unsigned long long)n );
+  assert( ms.bytesIn == 3 * 12 && ms.bytesOut >= 3 * 12 && ms.writesRefused == 2 );
+  assert( ms.queueMemory > 0 && ms.queueMemoryHigh >= ms.queueMemory );
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
 
-  //  UDP doesn't give us notice when it closes
+void TestEtworkHistograms( int engine = EE_default )
+{
+  assert( EtworkHistogramBucket( 7 ) == 7e-6 && EtworkHistogramBucket( 8 ) == 8e-6 );
+  for( int b = 1; b < ETWORK_HISTOGRAM_BUCKETS; ++b ) {
+    double lo = EtworkHistogramBucket( b - 1 );
+    double hi = EtworkHistogramBucket( b );
+    assert( hi > lo && (b <= 8 || hi - lo <= lo / 8 + 1e-12) );
+  }
+  assert( EtworkHistogramBucket( ETWORK_HISTOGRAM_BUCKETS - 1 ) > 3600 );
+
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11166;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  EtworkHistogram hist[EP_count + 1];
+  assert( sm->histograms( hist, EP_count, false ) == -1 );
+  sm->dispose();
+
+  es.histograms = true;
+  sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11166, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( sm->histograms( hist, EP_count, true ) == EP_count );
+  assert( hist[EP_poll].count > 0 && hist[EP_wait].count >= hist[EP_poll].count );
+  for( i = 0; i < 5; ++i ) {
+    s1->write( "hello", 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( sm->histograms( hist, EP_count + 1, false ) == EP_count );
+  EtworkHistogram const & poll = hist[EP_poll];
+  assert( poll.count == 5 && hist[EP_overrun].count == 5 && hist[EP_notify].count == 5 );
+  assert( hist[EP_read].count >= 5 && hist[EP_wait].count >= 5 );
+  //  poll() waits out its time, as there is always progress
+  assert( poll.max >= 0.01 && poll.total >= 0.05 );
+  double p50 = EtworkHistogramPercentile( &poll, 0.5 );
+  assert( p50 > 0 && p50 <= EtworkHistogramPercentile( &poll, 1.0 ) );
+  assert( EtworkHistogramPercentile( &poll, 1.0 ) == poll.max );
+  unsigned long long n = 0;
+  for( int b = 0; b < ETWORK_HISTOGRAM_BUCKETS; ++b ) {
+    n += poll.counts[b];
+  }
+  assert( n == poll.count );
+  sm->histograms( hist, 1, true );
+  assert( sm->histograms( hist, EP_count, false ) == EP_count );
+  assert( hist[EP_poll].count == 0 && hist[EP_wait].count == 0 );
   s1->dispose();
   s2->dispose();
-  sm1->dispose();
-  sm2->dispose();
+  sm->dispose();
 }
 
-class ErrorNotify : public IErrorNotify {
-  public:
-    ErrorInfo error_;
-    ErrorNotify() {
-      clear();
-    }
-    virtual void onSocketError( ErrorInfo const & info ) {
-      error_ = info;
-    }
-    void clear() {
-      error_.socket = 0;
-      error_.osError = 0;
-      error_.error = 0;
+//  Reads back what dump_trace() wrote; returns the number of records.
+static int ReadTrace( char const * path, EtworkTraceHeader & hdr, EtworkTraceRecord * recs, int maxRecs )
+{
+  FILE * f = fopen( path, "rb" );
+  assert( f != 0 );
+  assert( fread( &hdr, sizeof( hdr ), 1, f ) == 1 );
+  assert( !memcmp( hdr.magic, "ETWTRACE", 8 ) && hdr.version == 1 );
+  assert( hdr.recordSize == sizeof( EtworkTraceRecord ) && hdr.count <= hdr.total );
+  int n = (int)fread( recs, sizeof( EtworkTraceRecord ), maxRecs, f );
+  fclose( f );
+  remove( path );
+  assert( n == (int)hdr.count );
+  for( int i = 1; i < n; ++i ) {
+    unsigned long long a = ((unsigned long long)recs[i-1].timeHigh << 32) | recs[i-1].timeLow;
+    unsigned long long b = ((unsigned long long)recs[i].timeHigh << 32) | recs[i].timeLow;
+    assert( a <= b );
+  }
+  return n;
+}
+
+void TestEtworkTrace( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11167;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  assert( es.traceSize == 8192 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11167, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( s1->write( "hello", 5 ) == 5 );
+  char buf[10];
+  etwork::Timer t;
+  while( s2->read( buf, 10 ) < 0 ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  s1->dispose();
+  while( !s2->closed() ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  char const * path = "etwork_trace.bin";
+  assert( sm->dump_trace( path ) );
+  EtworkTraceHeader hdr;
+  EtworkTraceRecord recs[64];
+  int n = ReadTrace( path, hdr, recs, 64 );
+  assert( hdr.total == hdr.count );
+  int seen[ET_close + 1] = { 0 };
+  for( i = 0; i < n; ++i ) {
+    assert( recs[i].event >= ET_accept && recs[i].event <= ET_close );
+    seen[recs[i].event]++;
+    if( recs[i].event == ET_send || recs[i].event == ET_recv ) {
+      assert( recs[i].value == 7 || recs[i].value == 0 );
     }
-};
+  }
+  assert( seen[ET_accept] == 1 && seen[ET_connect] == 1 && seen[ET_close] == 2 );
+  assert( seen[ET_send] >= 1 && seen[ET_recv] >= 1 );
+  assert( recs[n-1].event == ET_close );
+  s2->dispose();
+  sm->dispose();
 
-void TestEtworkErrors()
+  //  A small ring keeps only the latest.
+  es.port = 11168;
+  es.traceSize = 3;
+  sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  i = sm->connect( "127.0.0.1", 11168, &s1 );
+  assert( i == 1 );
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  for( i = 0; i < 10; ++i ) {
+    assert( s1->write( "hello", 5 ) == 5 );
+    sm->poll( 0.01, active, 4 );
+  }
+  s2->dispose();
+  assert( sm->dump_trace( path ) );
+  n = ReadTrace( path, hdr, recs, 64 );
+  assert( n == 4 && hdr.total > 4 );
+  assert( recs[3].event == ET_close );
+  assert( !sm->dump_trace( "no/such/directory/etwork_trace.bin" ) );
+  s1->dispose();
+  sm->dispose();
+}
+
+//  Zero-copy output stays in bufOut_ until the kernel lets go of it, 
+//  which has to happen for more output to fit.
+void TestEtworkZeroCopy()
 {
-  ISocketManager * mgr;
-  ErrorNotify en;
-  SetEtworkErrorNotify( &en );
-  EtworkSettings st;
-  st.port = 0;
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11161;
+  es.queueSize = 60000;
+  es.maxMessageSize = 4000;
+  es.zerocopy = true;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1;
+  int i = sm->connect( "127.0.0.1", 11161, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  char buf[4000];
+  for( int round = 0; round < 3; ++round ) {
+    int sent = 0;
+    int got = 0;
+    for( int k = 0; k < 200 && got < 10; ++k ) {
+      while( sent < 10 ) {
+        memset( buf, 'a' + sent, 4000 );
+        if( s1->write( buf, 4000 ) < 0 ) {
+          break;    //  wait for the kernel to be done with some
+        }
+        ++sent;
+      }
+      sm->poll( 0.01, active, 4 );
+      while( (i = s2->read( buf, 4000 )) >= 0 ) {
+        assert( i == 4000 );
+        assert( buf[0] == 'a' + got && buf[3999] == 'a' + got );
+        ++got;
+      }
+    }
+    assert( got == 10 );
+  }
+  assert( !s1->closed() );
+  s1->dispose();
+  s2->dispose();
+
+  //  A socket disposed while the kernel may still be sending from its 
+  //  output queue keeps that memory, and the connection, until the 
+  //  kernel is done with them.
+  i = sm->connect( "127.0.0.1", 11161, &s1 );
+  assert( i == 1 );
+  s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  for( int j = 0; j < 10; ++j ) {
+    memset( buf, 'k' + j, 4000 );
+    assert( s1->write( buf, 4000 ) == 4000 );
+  }
+  sm->poll( 0, active, 4 );
+  EtworkStats st;
+  sm->stats( &st );
+  size_t held = st.queueMemory;
+  s1->dispose();
+  sm->stats( &st );
+  assert( st.queueMemory == held );
+  int got = 0;
+  etwork::Timer t;
+  while( got < 10 || st.queueMemory >= held ) {
+    assert( t.seconds() < 5 );
+    sm->poll( 0.01, active, 4 );
+    while( (i = s2->read( buf, 4000 )) >= 0 ) {
+      assert( i == 4000 );
+      assert( buf[0] == 'k' + got && buf[3999] == 'k' + got );
+      ++got;
+    }
+    sm->stats( &st );
+  }
+  s2->dispose();
+  sm->dispose();
+}
+
+void TestEtworkManyIdle( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11149;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * clients[50];
+  ISocket * servers[50];
+  ISocket * active[4];
+  int n = 0;
+  for( int j = 0; j < 50; ++j ) {
+    int i = sm->connect( "127.0.0.1", 11149, &clients[j] );
+    assert( i == 1 );
+    sm->poll( 0.01, active, 4 );
+    n += sm->accept( &servers[n], 50-n );
+  }
+  while( n < 50 ) {
+    sm->poll( 0.01, active, 4 );
+    n += sm->accept( &servers[n], 50-n );
+  }
+  //  Only the one socket with traffic shows up, no matter how many are idle.
+  int i = clients[17]->write( "ping", 4 );
+  assert( i == 4 );
+  i = sm->poll( 0.1, active, 4 );
+  assert( i == 2 );
+  assert( active[0] == clients[17] || active[1] == clients[17] );
+  char buf[20];
+  bool found = false;
+  for( int j = 0; j < 50; ++j ) {
+    if( servers[j]->read( buf, 20 ) == 4 ) {
+      assert( !found );
+      assert( active[0] == servers[j] || active[1] == servers[j] );
+      found = true;
+    }
+  }
+  assert( found );
+  i = sm->poll( 0.01, active, 4 );
+  assert( i == 0 );
+  for( int j = 0; j < 50; ++j ) {
+    clients[j]->dispose();
+    servers[j]->dispose();
+  }
+  sm->dispose();
+}
+
+//  A benchmark more than a test: how much heap an idle connection 
+//  costs, per socket, once a message has been through it. glibc can 
+//  tell how much is in use; under a sanitizer, it says 0, and then 
+//  there is nothing to check.
+void BenchEtworkIdleMemory( int engine = EE_default )
+{
+#if defined( __GLIBC__ ) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  enum { PAIRS = 400 };
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11164;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  std::vector< ISocket * > clients( PAIRS );
+  std::vector< ISocket * > servers( PAIRS );
+  ISocket * active[4];
+  char buf[20];
+  size_t before = mallinfo2().uordblks;
+  for( int j = 0; j < PAIRS; ++j ) {
+    int i = sm->connect( "127.0.0.1", 11164, &clients[j] );
+    assert( i == 1 );
+    while( sm->accept( &servers[j], 1 ) == 0 ) {
+      sm->poll( 0.01, active, 4 );
+    }
+    assert( clients[j]->write( "ping", 4 ) == 4 );
+    etwork::Timer t;
+    while( servers[j]->read( buf, 20 ) != 4 ) {
+      assert( t.seconds() < 5 );
+      sm->poll( 0.01, active, 4 );
+    }
+  }
+  size_t after = mallinfo2().uordblks;
+  int perSocket = (int)(after - before) / (2 * PAIRS);
+  fprintf( stderr, "Idle connections take %d bytes of heap per socket.\n", perSocket );
+  if( before && after ) {
+    assert( perSocket < 256 );
+  }
+  for( int j = 0; j < PAIRS; ++j ) {
+    clients[j]->dispose();
+    servers[j]->dispose();
+  }
+  sm->dispose();
+#endif
+}
+
+//  Keepalives keep idle connections open past the timeout; a peer 
+//  that sends no keepalives gets timed out, on time.
+void TestEtworkTimeouts( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11158;
+  es.timeout = 0.5;
+  es.keepalive = 0.1;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  EtworkSettings es2;
+  es2.reliable = true;
+  es2.engine = engine;
+  ISocketManager * sm2 = CreateEtwork( &es2 );
+  assert( sm2 != 0 );
+
+  ISocket * active[4];
+  ISocket * s1 = 0;
+  int i = sm->connect( "127.0.0.1", 11158, &s1 );
+  assert( i == 1 );
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  ISocket * s3 = 0;
+  i = sm2->connect( "127.0.0.1", 11158, &s3 );
+  assert( i == 1 );
+  ISocket * s4 = 0;
+  while( sm->accept( &s4, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+    sm2->poll( 0, active, 4 );
+  }
+
+  etwork::Timer t;
+  char buf[20];
+  while( !s4->closed() && t.seconds() < 2 ) {
+    sm->poll( 0.01, active, 4 );
+    sm2->poll( 0, active, 4 );
+    while( s1->read( buf, 20 ) >= 0 ) {
+    }
+    while( s2->read( buf, 20 ) >= 0 ) {
+    }
+    while( s3->read( buf, 20 ) >= 0 ) {
+    }
+  }
+  assert( s4->closed() );
+  assert( t.seconds() >= 0.4 );
+  assert( !s1->closed() );
+  assert( !s2->closed() );
+
+  s1->dispose();
+  s2->dispose();
+  s3->dispose();
+  s4->dispose();
+  sm2->dispose();
+  sm->dispose();
+}
+
+class EchoShards : public IShardHandler {
+  public:
+    etwork::Lock lock_;
+    bool stop_;
+    int accepted_;
+    EchoShards() {
+      stop_ = false;
+      accepted_ = 0;
+    }
+    bool stopped() {
+      etwork::Locker l( lock_ );
+      return stop_;
+    }
+    virtual void onShard( int, ISocketManager * mgr ) {
+      std::vector< ISocket * > socks;
+      ISocket * active[4];
+      char buf[200];
+      while( !stopped() ) {
+        mgr->poll( 0.01, active, 4 );
+        ISocket * s = 0;
+        while( mgr->accept( &s, 1 ) == 1 ) {
+          socks.push_back( s );
+          etwork::Locker l( lock_ );
+          ++accepted_;
+        }
+        for( size_t i = 0; i < socks.size(); ++i ) {
+          int r;
+          while( (r = socks[i]->read( buf, 200 )) > 0 ) {
+            socks[i]->write( buf, r );
+          }
+        }
+      }
+      for( size_t i = 0; i < socks.size(); ++i ) {
+        socks[i]->dispose();
+      }
+    }
+};
+
+void TestEtworkSharded()
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11152;
+  EchoShards echo;
+  IShardedServer * srv = CreateShardedEtwork( &es, 4, &echo );
+  assert( srv != 0 );
+  assert( srv->count() == 4 );
+
+  EtworkSettings cs;
+  ISocketManager * sm = CreateEtwork( &cs );
+  assert( sm != 0 );
+  ISocket * clients[16];
+  for( int j = 0; j < 16; ++j ) {
+    int i = sm->connect( "127.0.0.1", 11152, &clients[j] );
+    assert( i == 1 );
+    i = clients[j]->write( "ping", 4 );
+    assert( i == 4 );
+  }
+  //  Every connection gets its echo, whichever shard it landed on.
+  ISocket * active[4];
+  char buf[20];
+  int echoed = 0;
+  for( int k = 0; k < 200 && echoed < 16; ++k ) {
+    sm->poll( 0.01, active, 4 );
+    for( int j = 0; j < 16; ++j ) {
+      if( clients[j]->read( buf, 20 ) == 4 ) {
+        assert( !strncmp( buf, "ping", 4 ) );
+        ++echoed;
+      }
+    }
+  }
+  assert( echoed == 16 );
+  {
+    etwork::Locker l( echo.lock_ );
+    assert( echo.accepted_ == 16 );
+    echo.stop_ = true;
+  }
+  srv->dispose();
+  for( int j = 0; j < 16; ++j ) {
+    clients[j]->dispose();
+  }
+  sm->dispose();
+}
+
+struct ThreadedWriter {
+  ISocket * sock_;
+  int index_;
+};
+
+#if defined( WIN32 )
+DWORD WINAPI ThreadedWriterMain( void * arg )
+#else
+void * ThreadedWriterMain( void * arg )
+#endif
+{
+  ThreadedWriter * tw = (ThreadedWriter *)arg;
+  char buf[20];
+  for( int j = 0; j < 100; ++j ) {
+    sprintf( buf, "%d %d", tw->index_, j );
+    while( tw->sock_->write( buf, strlen( buf ) ) < 0 ) {
+      //  queue is full until the poll() thread catches up
+#if defined( WIN32 )
+      ::Sleep( 1 );
+#else
+      ::sched_yield();
+#endif
+    }
+  }
+  return 0;
+}
+
+void TestEtworkThreadedWrites()
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11153;
+  es.threadedWrites = true;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1 = 0;
+  int i = sm->connect( "127.0.0.1", 11153, &s1 );
+  assert( i == 1 );
+  ISocket * s2 = 0;
+  ISocket * active[4];
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  //  there's no room to hand out when anyone may write
+  assert( s2->reserve( 10 ) == 0 );
+
+  //  Four threads write to s2 while this thread polls.
+  ThreadedWriter tw[4];
+#if defined( WIN32 )
+  HANDLE threads[4];
+#else
+  pthread_t threads[4];
+#endif
+  for( int j = 0; j < 4; ++j ) {
+    tw[j].sock_ = s2;
+    tw[j].index_ = j;
+#if defined( WIN32 )
+    threads[j] = ::CreateThread( 0, 0, &ThreadedWriterMain, &tw[j], 0, 0 );
+#else
+    ::pthread_create( &threads[j], 0, &ThreadedWriterMain, &tw[j] );
+#endif
+  }
+  int next[4] = { 0, 0, 0, 0 };
+  int got = 0;
+  char buf[20];
+  for( int k = 0; k < 1000 && got < 400; ++k ) {
+    sm->poll( 0.01, active, 4 );
+    while( (i = s1->read( buf, 19 )) > 0 ) {
+      buf[i] = 0;
+      int t = -1, m = -1;
+      sscanf( buf, "%d %d", &t, &m );
+      assert( t >= 0 && t < 4 );
+      assert( m == next[t] );   //  each thread's messages arrive in order
+      ++next[t];
+      ++got;
+    }
+  }
+  assert( got == 400 );
+  for( int j = 0; j < 4; ++j ) {
+#if defined( WIN32 )
+    ::WaitForSingleObject( threads[j], INFINITE );
+    ::CloseHandle( threads[j] );
+#else
+    ::pthread_join( threads[j], 0 );
+#endif
+  }
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
+
+#if defined( WIN32 )
+DWORD WINAPI DelayedWriterMain( void * arg )
+#else
+void * DelayedWriterMain( void * arg )
+#endif
+{
+  ThreadedWriter * tw = (ThreadedWriter *)arg;
+#if defined( WIN32 )
+  ::Sleep( 50 );
+#else
+  ::usleep( 50000 );
+#endif
+  int i = tw->sock_->write( "wake", 4 );
+  assert( i == 4 );
+  return 0;
+}
+
+//  A write posted while poll() is waiting goes out without waiting 
+//  for the poll() to time out.
+void TestEtworkThreadedWake( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11174;
+  es.engine = engine;
+  es.threadedWrites = true;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  ISocket * s1 = 0;
+  int i = sm->connect( "127.0.0.1", 11174, &s1 );
+  assert( i == 1 );
+  ISocket * s2 = 0;
+  ISocket * active[4];
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  for( i = 0; i < 5; ++i ) {
+    sm->poll( 0.01, active, 4 );
+  }
+
+  ThreadedWriter tw;
+  tw.sock_ = s2;
+  tw.index_ = 0;
+#if defined( WIN32 )
+  HANDLE thread = ::CreateThread( 0, 0, &DelayedWriterMain, &tw, 0, 0 );
+#else
+  pthread_t thread;
+  ::pthread_create( &thread, 0, &DelayedWriterMain, &tw );
+#endif
+  //  poll() returns as soon as one socket is active
+  etwork::Timer t;
+  char buf[10];
+  while( (i = s1->read( buf, sizeof( buf ) )) < 0 ) {
+    assert( t.seconds() < 1.5 );
+    sm->poll( 2.0, active, 1 );
+  }
+  assert( i == 4 && !memcmp( buf, "wake", 4 ) );
+  assert( t.seconds() < 1.0 );
+#if defined( WIN32 )
+  ::WaitForSingleObject( thread, INFINITE );
+  ::CloseHandle( thread );
+#else
+  ::pthread_join( thread, 0 );
+#endif
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
+
+void TestEtworkAsyncConnect( int engine = EE_default )
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11154;
+  es.asyncConnect = true;
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+
+  //  connect() returns right away; what's written meanwhile goes out 
+  //  once the connection is made.
+  ISocket * s1 = 0;
+  int i = sm->connect( "127.0.0.1", 11154, &s1 );
+  assert( i == 1 );
+  assert( !s1->closed() );
+  i = s1->write( "hello", 5 );
+  assert( i == 5 );
+  ISocket * active[4];
+  bool seen = false;
+  for( int k = 0; k < 100 && s1->connecting(); ++k ) {
+    i = sm->poll( 0.01, active, 4 );
+    for( int j = 0; j < i; ++j ) {
+      seen = seen || (active[j] == s1);
+    }
+  }
+  assert( !s1->connecting() );
+  assert( !s1->closed() );
+  assert( seen );   //  completion shows up as activity
+  ISocket * s2 = 0;
+  while( sm->accept( &s2, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  char buf[20];
+  for( int k = 0; k < 100 && (i = s2->read( buf, 20 )) < 0; ++k ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( i == 5 );
+  assert( !strncmp( buf, "hello", 5 ) );
+
+  //  Nobody listens here; the socket closes instead of connecting.
+  ISocket * s3 = 0;
+  i = sm->connect( "127.0.0.1", 11155, &s3 );
+  assert( i == 1 || i == -1 );
+  if( i == 1 ) {
+    for( int k = 0; k < 100 && !s3->closed(); ++k ) {
+      sm->poll( 0.01, active, 4 );
+    }
+    assert( s3->closed() );
+    assert( !s3->connecting() );
+    s3->dispose();
+  }
+
+  s1->dispose();
+  s2->dispose();
+  sm->dispose();
+}
+
+//  A stand-in name server for TestEtworkResolver(). It knows one host, 
+//  and says "no such host" to everything else. With forge_, it first 
+//  says "no such host" with the id of the query, but for another name.
+class StandInDns {
+  public:
+#if defined( WIN32 )
+    SOCKET s_;
+#else
+    int s_;
+#endif
+    int queries_;
+    bool forge_;
+    StandInDns( unsigned short port ) {
+      queries_ = 0;
+      forge_ = false;
+      s_ = ::socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+      sockaddr_in addr;
+      memset( &addr, 0, sizeof( addr ) );
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons( port );
+      addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+      int r = ::bind( s_, (sockaddr const *)&addr, sizeof( addr ) );
+      assert( r == 0 );
+    }
+    ~StandInDns() {
+#if defined( WIN32 )
+      ::closesocket( s_ );
+#else
+      ::close( s_ );
+#endif
+    }
+    //  Answer whatever queries have come in.
+    void serve() {
+      while( true ) {
+        fd_set fds;
+        FD_ZERO( &fds );
+        FD_SET( s_, &fds );
+        timeval tv = { 0, 0 };
+        if( ::select( (int)s_+1, &fds, 0, 0, &tv ) <= 0 ) {
+          return;
+        }
+        unsigned char buf[512];
+        sockaddr_in from;
+#if defined( WIN32 )
+        int flen = sizeof( from );
+#else
+        socklen_t flen = sizeof( from );
+#endif
+        int n = ::recvfrom( s_, (char *)buf, 400, 0, (sockaddr *)&from, &flen );
+        assert( n > 12 );
+        ++queries_;
+        static unsigned char const known[] = "\x04" "host" "\x06" "etwork" "\x04" "test";
+        bool found = !memcmp( &buf[12], known, sizeof( known ) );
+        if( forge_ ) {
+          unsigned char fake[512];
+          memcpy( fake, buf, n );
+          fake[2] = 0x81;
+          fake[3] = 0x83;
+          fake[13] ^= 1;
+          ::sendto( s_, (char const *)fake, n, 0, (sockaddr const *)&from, flen );
+        }
+        buf[2] = 0x81;                  //  response, recursion desired
+        buf[3] = found ? 0x80 : 0x83;   //  recursion available; NXDOMAIN if not found
+        if( found ) {
+          //  one answer: 127.0.0.1, TTL 1 second
+          static unsigned char const a[] = { 0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 1, 0, 4, 127, 0, 0, 1 };
+          buf[7] = 1;
+          memcpy( &buf[n], a, sizeof( a ) );
+          n += sizeof( a );
+        }
+        else {
+          //  an SOA, with a TTL of 300 but MINIMUM of 1 second
+          static unsigned char const soa[] = { 0xc0, 12, 0, 6, 0, 1, 0, 0, 1, 44, 0, 22, 0, 0,
+              0, 0, 0, 1,  0, 0, 0, 1,  0, 0, 0, 1,  0, 0, 0, 1,  0, 0, 0, 1 };
+          buf[9] = 1;
+          memcpy( &buf[n], soa, sizeof( soa ) );
+          n += sizeof( soa );
+        }
+        ::sendto( s_, (char const *)buf, n, 0, (sockaddr const *)&from, flen );
+      }
+    }
+};
+
+void TestEtworkResolver( int engine = EE_default )
+{
+  StandInDns dns( 11157 );
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11156;
+  es.asyncConnect = true;
+  es.nameserver = "127.0.0.1:11157";
+  es.engine = engine;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+
+  //  Both lookups are outstanding at the same time.
+  ISocket * s1 = 0;
+  int i = sm->connect( "Host.Etwork.Test", 11156, &s1 );
+  assert( i == 1 );
+  assert( s1->connecting() );
+  ISocket * s2 = 0;
+  i = sm->connect( "nowhere.etwork.test", 11156, &s2 );
+  assert( i == 1 );
+  assert( s2->connecting() );
+  ISocket * active[4];
+  for( int k = 0; k < 100 && (s1->connecting() || s2->connecting()); ++k ) {
+    dns.serve();
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( dns.queries_ == 2 );
+  assert( !s1->connecting() && !s1->closed() );
+  assert( !s2->connecting() && s2->closed() );
+  ISocket * s3 = 0;
+  while( sm->accept( &s3, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  s2->dispose();
+  s3->dispose();
+  s1->dispose();
+
+  //  Both answers are cached, so there are no more questions...
+  i = sm->connect( "host.etwork.test", 11156, &s1 );
+  assert( i == 1 );
+  i = sm->connect( "nowhere.etwork.test", 11156, &s2 );
+  assert( i == -1 );
+  assert( dns.queries_ == 2 );
+  while( sm->accept( &s3, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  s1->dispose();
+  s3->dispose();
+
+  //  ... until they expire. An answer to some other question doesn't 
+  //  count, even with the right id.
+  for( int k = 0; k < 120; ++k ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  dns.forge_ = true;
+  i = sm->connect( "host.etwork.test", 11156, &s1 );
+  assert( i == 1 );
+  assert( s1->connecting() );
+  for( int k = 0; k < 100 && s1->connecting(); ++k ) {
+    dns.serve();
+    sm->poll( 0.01, active, 4 );
+  }
+  assert( dns.queries_ == 3 );
+  assert( !s1->closed() );
+  while( sm->accept( &s3, 1 ) == 0 ) {
+    sm->poll( 0.01, active, 4 );
+  }
+  s1->dispose();
+  s3->dispose();
+  sm->dispose();
+}
+
+void TestEtworkUdp()
+{
+  EtworkSettings es1;
+  es1.accepting = true;
+  es1.reliable = false;
+  es1.port = 11147;
+  ISocketManager * sm1 = CreateEtwork( &es1 );
+  assert( sm1 != 0 );
+
+  EtworkSettings es2;
+  es2.accepting = true;
+  es2.reliable = false;
+  es2.port = 11148;
+  ISocketManager * sm2 = CreateEtwork( &es2 );
+  assert( sm2 != 0 );
+
+  ISocket * s1 = 0;
+  int i = sm1->connect( "127.0.0.1", 11148, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  i = sm1->poll( 0.1, active, 4 );
+  assert( i == 1 ); // the newly connected socket
+
+  i = sm2->poll( 0.1, active, 4 );
+  assert( i == 0 );
+  ISocket * s2 = 0;
+  i = sm2->accept( &s2, 1 );
+  assert( i == 1 );
+
+  char buf[200];
+  assert( s2->read( buf, 200 ) == -1 );   //  can't receive data until accepted
+  i = s2->write( "hello, world!\n", 14 );
+  assert( i == 14 );
+  i = s2->write( "xyzzy", 6 );
+  assert( i == 6 );
+
+  i = sm1->poll( 0.1, active, 4 );
+  assert( i == 1 );   //  s1 is receiving greeting message
+  assert( active[0] == s1 );
+  i = s1->read( buf, 200 );
+  assert( i == 0 );
+  i = s1->read( buf, 200 );
+  assert( i == -1 );
+  i = sm2->poll( 0.1, active, 4 );
+  assert( i == 1 );   //  s2 just sent data
+  i = sm1->poll( 0.1, active, 4 );
+  assert( i == 1 );   //  s1 received it
+  assert( s2->read( buf, 200 ) == -1 );
+  i = s1->read( buf, 200 );
+  assert( i == 14 );
+  assert( !strncmp( buf, "hello, world!\n", 14 ) );
+  i = s1->read( buf, 200 );
+  assert( i == 6 );
+  assert( !strncmp( buf, "xyzzy", 6 ) );
+
+  //  UDP doesn't give us notice when it closes
+  s1->dispose();
+  s2->dispose();
+  sm1->dispose();
+  sm2->dispose();
+}
+
+void TestEtworkUdpBurst( bool offload = false )
+{
+  //  More datagrams than go in one batch, both ways through the socket.
+  EtworkSettings es1;
+  es1.accepting = true;
+  es1.reliable = false;
+  es1.port = 11150;
+  es1.offload = offload;
+  ISocketManager * sm1 = CreateEtwork( &es1 );
+  assert( sm1 != 0 );
+
+  EtworkSettings es2;
+  es2.accepting = true;
+  es2.reliable = false;
+  es2.port = 11151;
+  es2.offload = offload;
+  ISocketManager * sm2 = CreateEtwork( &es2 );
+  assert( sm2 != 0 );
+
+  ISocket * s1 = 0;
+  int i = sm1->connect( "127.0.0.1", 11151, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  sm1->poll( 0.1, active, 4 );
+  sm2->poll( 0.1, active, 4 );
+  ISocket * s2 = 0;
+  i = sm2->accept( &s2, 1 );
+  assert( i == 1 );
+
+  char buf[200];
+  for( int j = 0; j < 45; ++j ) {
+    sprintf( buf, "message %d", j );
+    i = s2->write( buf, strlen( buf ) );
+    assert( i == (int)strlen( buf ) );
+  }
+  sm2->poll( 0.1, active, 4 );
+  sm1->poll( 0.1, active, 4 );
+  i = s1->read( buf, 200 );
+  assert( i == 0 );   //  the greeting
+  for( int j = 0; j < 45; ++j ) {
+    char exp[40];
+    sprintf( exp, "message %d", j );
+    i = s1->read( buf, 200 );
+    assert( i == (int)strlen( exp ) );
+    assert( !strncmp( buf, exp, i ) );
+  }
+  assert( s1->read( buf, 200 ) == -1 );
+
+  s1->dispose();
+  s2->dispose();
+  sm1->dispose();
+  sm2->dispose();
+}
+
+//  Enough peers to make the server's address table grow, with some 
+//  of them going away again, and the rest still getting their data.
+void TestEtworkUdpPeers()
+{
+  EtworkSettings es1;
+  es1.accepting = true;
+  es1.reliable = false;
+  es1.port = 11159;
+  ISocketManager * sm1 = CreateEtwork( &es1 );
+  assert( sm1 != 0 );
+
+  int const N = 40;
+  ISocketManager * clients[N];
+  ISocket * cs[N];
+  ISocket * active[4];
+  for( int j = 0; j < N; ++j ) {
+    EtworkSettings es;
+    es.reliable = false;
+    clients[j] = CreateEtwork( &es );
+    assert( clients[j] != 0 );
+    int i = clients[j]->connect( "127.0.0.1", 11159, &cs[j] );
+    assert( i == 1 );
+    clients[j]->poll( 0, active, 4 );
+  }
+  ISocket * ss[N];
+  int n = 0;
+  for( int k = 0; k < 100 && n < N; ++k ) {
+    sm1->poll( 0.01, active, 4 );
+    n += sm1->accept( &ss[n], N-n );
+  }
+  assert( n == N );
+
+  //  Tell each peer where the server has it, then drop every other one.
+  char buf[20];
+  for( int j = 0; j < N; ++j ) {
+    sprintf( buf, "%d", j );
+    ss[j]->write( buf, strlen( buf ) );
+  }
+  for( int k = 0; k < 20; ++k ) {
+    sm1->poll( 0.01, active, 4 );   //  only 4 active sockets at a time
+  }
+  int peer[N];
+  for( int j = 0; j < N; ++j ) {
+    clients[j]->poll( 0.01, active, 4 );
+    int i = cs[j]->read( buf, 20 );
+    assert( i == 0 );   //  the greeting
+    i = cs[j]->read( buf, 20 );
+    assert( i > 0 );
+    buf[i] = 0;
+    peer[j] = atoi( buf );
+    assert( peer[j] >= 0 && peer[j] < N );
+  }
+  for( int j = 0; j < N; j += 2 ) {
+    ss[peer[j]]->dispose();
+    ss[peer[j]] = 0;
+  }
+  for( int j = 1; j < N; j += 2 ) {
+    cs[j]->write( "ping", 4 );
+    clients[j]->poll( 0, active, 4 );
+  }
+  for( int k = 0; k < 10; ++k ) {
+    sm1->poll( 0.01, active, 4 );
+  }
+  for( int j = 1; j < N; j += 2 ) {
+    int i = ss[peer[j]]->read( buf, 20 );
+    assert( i == 4 );
+    assert( !strncmp( buf, "ping", 4 ) );
+  }
+
+  for( int j = 0; j < N; ++j ) {
+    if( ss[j] ) {
+      ss[j]->dispose();
+    }
+    cs[j]->dispose();
+    clients[j]->dispose();
+  }
+  sm1->dispose();
+}
+
+class ErrorNotify : public IErrorNotify {
+  public:
+    ErrorInfo error_;
+    ErrorNotify() {
+      clear();
+    }
+    virtual void onSocketError( ErrorInfo const & info ) {
+      error_ = info;
+    }
+    void clear() {
+      error_.socket = 0;
+      error_.osError = 0;
+      error_.error = 0;
+    }
+};
+
+void TestEtworkErrors()
+{
+  ISocketManager * mgr;
+  ErrorNotify en;
+  SetEtworkErrorNotify( &en );
+  EtworkSettings st;
+  st.port = 0;
   st.accepting = true;
   mgr = CreateEtwork( &st );
   assert( mgr == 0 );
   assert( (int)en.error_.error != 0 );
   SetEtworkErrorNotify( 0 );
+
+  EtworkError e( ES_warning, EA_session, EO_buffer_full );
+  assert( !e.hasText() );
+  assert( strstr( e.c_str(), "buffer full" ) != 0 );
+  assert( e.hasText() );
+  e.setText( "full up" );
+  EtworkError e2( e );
+  assert( e2.hasText() && !strcmp( e2.c_str(), "full up" ) );
+}
+
+class CountingErrorNotify : public IErrorNotify {
+  public:
+    CountingErrorNotify() {
+      calls_ = 0;
+      bufferFull_ = 0;
+      repeated_ = 0;
+      sock_ = 0;
+      fromSock_ = 0;
+    }
+    virtual void onSocketError( ErrorInfo const & info ) {
+      ++calls_;
+      if( info.error.option() == EO_buffer_full ) {
+        ++bufferFull_;
+      }
+      if( strstr( info.error.c_str(), " times)" ) ) {
+        ++repeated_;
+      }
+      if( sock_ && info.socket == sock_ ) {
+        ++fromSock_;
+      }
+      texts_.push_back( info.error.c_str() );
+    }
+    int calls_;
+    int bufferFull_;
+    int repeated_;
+    ISocket * sock_;
+    int fromSock_;
+    std::vector< std::string > texts_;
+};
+
+//  With asyncErrors, nothing is reported until drain_errors().
+void TestEtworkAsyncErrors()
+{
+  EtworkSettings es;
+  es.accepting = true;
+  es.reliable = true;
+  es.port = 11169;
+  ISocketManager * sm = CreateEtwork( &es );
+  assert( sm != 0 );
+  assert( sm->drain_errors( 0 ) == -1 );
+  sm->dispose();
+
+  //  Datagrams that don't fit are dropped, and each drop is an error.
+  EtworkSettings es1;
+  es1.accepting = true;
+  es1.reliable = false;
+  es1.port = 11170;
+  ISocketManager * sm1 = CreateEtwork( &es1 );
+  assert( sm1 != 0 );
+  CountingErrorNotify en;
+  EtworkSettings es2;
+  es2.accepting = true;
+  es2.reliable = false;
+  es2.port = 11171;
+  es2.asyncErrors = true;
+  es2.notify = &en;
+  ISocketManager * sm2 = CreateEtwork( &es2 );
+  assert( sm2 != 0 );
+  ISocket * s1 = 0;
+  int i = sm1->connect( "127.0.0.1", 11171, &s1 );
+  assert( i == 1 );
+  ISocket * active[4];
+  sm1->poll( 0.1, active, 4 );
+  ISocket * s2 = 0;
+  while( sm2->accept( &s2, 1 ) == 0 ) {
+    sm2->poll( 0.01, active, 4 );
+  }
+  //  s2 never reads, so its input queue overflows.
+  char buf[1000];
+  memset( buf, 0, sizeof( buf ) );
+  for( i = 0; i < 20; ++i ) {
+    s1->write( buf, sizeof( buf ) );
+    sm1->poll( 0, active, 4 );
+    sm2->poll( 0.01, active, 4 );
+  }
+  assert( en.calls_ == 0 );
+  assert( sm2->drain_errors( 1 ) == 1 );
+  assert( en.calls_ == 1 );
+  //  The drops in a row come out as one report that counts them.
+  assert( en.bufferFull_ == 1 && en.repeated_ == 1 );
+  int n = sm2->drain_errors( 0 );
+  assert( n >= 0 && en.calls_ == 1 + n );
+  assert( sm2->drain_errors( 0 ) == 0 );
+
+  //  Errors of a disposed socket no longer point at it.
+  for( i = 0; i < 5; ++i ) {
+    s1->write( buf, sizeof( buf ) );
+    sm1->poll( 0, active, 4 );
+    sm2->poll( 0.01, active, 4 );
+  }
+  en.sock_ = s2;
+  s2->dispose();
+  en.bufferFull_ = 0;
+  assert( sm2->drain_errors( 0 ) > 0 );
+  assert( en.bufferFull_ > 0 && en.fromSock_ == 0 );
+
+  //  An error with text of its own keeps it through the queue, and 
+  //  errors with different text don't run together.
+  en.texts_.clear();
+  assert( !sm2->dump_trace( "/no/such/dir/a.trace" ) );
+  assert( !sm2->dump_trace( "/no/such/dir/b.trace" ) );
+  assert( !sm2->dump_trace( "/no/such/dir/b.trace" ) );
+  assert( en.texts_.empty() );
+  assert( sm2->drain_errors( 0 ) == 2 );
+  assert( en.texts_.size() == 2 );
+  assert( en.texts_[0] == "Could not open /no/such/dir/a.trace to dump the trace into." );
+  assert( en.texts_[1] == "Could not open /no/such/dir/b.trace to dump the trace into. (2 times)" );
+  s1->dispose();
+  sm1->dispose();
+  sm2->dispose();
 }
 
 class SocketNotify : public INotify {
@@ -415,9 +2088,46 @@ int main()
   TestEtworkCreate();
   TestEtworkBuffer();
   TestEtworkBufferEvil();
+  TestEtworkBufferSegments();
+  TestEtworkBufferVarint();
+  TestEtworkBufferBulk( EF_short );
+  TestEtworkBufferBulk( EF_varint );
+  TestEtworkBufferPool();
   TestEtworkTcp();
+  TestEtworkTcp( EE_uring );
+  TestEtworkTcpBurst();
+  TestEtworkTcpLarge();
+  TestEtworkTcpLarge( EE_uring );
+  TestEtworkTcpFull();
+  TestEtworkTcpFull( EE_uring );
+  TestEtworkMemoryBudget();
+  TestEtworkStats();
+  TestEtworkStats( EE_uring );
+  TestEtworkHistograms();
+  TestEtworkHistograms( EE_uring );
+  TestEtworkTrace();
+  TestEtworkTrace( EE_uring );
+  TestEtworkZeroCopy();
+  TestEtworkManyIdle();
+  TestEtworkManyIdle( EE_uring );
+  BenchEtworkIdleMemory();
+  BenchEtworkIdleMemory( EE_uring );
+  TestEtworkTimeouts();
+  TestEtworkTimeouts( EE_uring );
+  TestEtworkSharded();
+  TestEtworkThreadedWrites();
+  TestEtworkThreadedWake();
+  TestEtworkThreadedWake( EE_uring );
+  TestEtworkAsyncConnect();
+  TestEtworkAsyncConnect( EE_uring );
+  TestEtworkResolver();
+  TestEtworkResolver( EE_uring );
   TestEtworkUdp();
+  TestEtworkUdpBurst();
+  TestEtworkUdpBurst( true );
+  TestEtworkUdpPeers();
   TestEtworkErrors();
+  TestEtworkAsyncErrors();
   TestEtworkNotify();
   TestBlock();
   TestMarshal();
@@ -0,0 +1,81 @@
+//  tracedump.cpp
+//  This tool turns a file from ISocketManager::dump_trace() into text, 
+//  one event per line, oldest first:
+//
+//    tracedump <file> [socket]
+//
+//  With a socket handle, it only shows the events of that socket.
+
+#include "etwork/etwork.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static char const * event_name( unsigned int event )
+{
+  switch( event ) {
+    case ET_accept: return "accept";
+    case ET_connect: return "connect";
+    case ET_recv: return "recv";
+    case ET_send: return "send";
+    case ET_partial: return "partial";
+    case ET_drop: return "drop";
+    case ET_timeout: return "timeout";
+    case ET_keepalive: return "keepalive";
+    case ET_close: return "close";
+    default: return "?";
+  }
+}
+
+int main( int argc, char const * argv[] )
+{
+  if( argc < 2 || argc > 3 ) {
+    fprintf( stderr, "usage: tracedump <file> [socket]\n" );
+    return 1;
+  }
+  bool onlyOne = argc == 3;
+  unsigned int only = onlyOne ? (unsigned int)strtoul( argv[2], 0, 10 ) : 0;
+  FILE * f = fopen( argv[1], "rb" );
+  if( !f ) {
+    fprintf( stderr, "tracedump: can't open %s\n", argv[1] );
+    return 1;
+  }
+  EtworkTraceHeader hdr;
+  if( fread( &hdr, sizeof( hdr ), 1, f ) != 1 || memcmp( hdr.magic, "ETWTRACE", 8 ) ) {
+    fprintf( stderr, "tracedump: %s is not an Etwork trace\n", argv[1] );
+    fclose( f );
+    return 1;
+  }
+  if( hdr.version != 1 || hdr.recordSize != sizeof( EtworkTraceRecord ) ) {
+    fprintf( stderr, "tracedump: %s is trace version %u with %u byte records; I know version 1 with %u\n",
+        argv[1], hdr.version, hdr.recordSize, (unsigned int)sizeof( EtworkTraceRecord ) );
+    fclose( f );
+    return 1;
+  }
+  printf( "# %llu events, the last %llu of %llu written\n", hdr.count, hdr.count, hdr.total );
+  printf( "#       seconds     +usec    socket  event      value\n" );
+  //  +usec is the time since the event on the line before.
+  unsigned long long prev = 0;
+  bool shown = false;
+  unsigned long long i = 0;
+  EtworkTraceRecord r;
+  for( ; i < hdr.count && fread( &r, sizeof( r ), 1, f ) == 1; ++i ) {
+    if( onlyOne && r.socket != only ) {
+      continue;
+    }
+    unsigned long long us = ((unsigned long long)r.timeHigh << 32) | r.timeLow;
+    unsigned long long delta = shown ? us - prev : 0;
+    prev = us;
+    shown = true;
+    printf( "%8llu.%06llu %9llu %9u  %-9s %6u\n", us / 1000000, us % 1000000, delta,
+        r.socket, event_name( r.event ), r.value );
+  }
+  fclose( f );
+  if( i < hdr.count ) {
+    fprintf( stderr, "tracedump: %s ends after %llu of %llu events\n", argv[1], i, hdr.count );
+    return 1;
+  }
+  return 0;
+}